@@ -1,30 +1,147 @@
-#version 120
+#version 130
 
 uniform float uZFar;
 uniform float uZUnproject;
 
 uniform float uExposure;
 
+uniform mat4 uProjectionMatrixInverse;
+
 uniform sampler2D uDepth;
 uniform sampler2D uNormal;
 uniform sampler2D uDiffuse;
 uniform sampler2D uSpecular;
 
+// Homogeneous medium, must match cgra_airlight.hpp
 const vec3 beta_sc = vec3(0.02);
 const vec3 beta_ex = 1.1 * beta_sc;
 
 struct Light {
 	vec3 pos_v; // Viewspace position
 	vec3 flux;
+	float radius; // influence radius, no light reaches past it
 };
 
+// Light data as a structure-of-arrays in a float texture, light i is in
+// column i % light_data_width of row pair i / light_data_width, with the
+// view-space position and radius in the first row and flux in the second
 uniform int uNumLights;
-uniform Light[64] uLights;
+uniform sampler2D uLightData;
+
+const int light_data_width = 1024;
+
+// Clustered light lists (see cgra_cluster.hpp)
+// uClusterGrid holds (offset, count) into uClusterLights for each cluster,
+// tiles_x wide and tiles_y * (slices + 1) high, the last layer being the
+// lights that cover a tile at any depth
+uniform bool uClustered;
+uniform usampler2D uClusterGrid;
+uniform usampler2D uClusterLights;
+uniform ivec3 uClusterDims;
+uniform float uClusterZNear;
+uniform float uClusterSliceScale;
+
+const int cluster_lights_width = 4096;
+
+// How in-scattering is done in the deferred pass
+const int inscatter_per_pixel = 0; // computed for every pixel
+const int inscatter_low_res = 1; // upsampled from uInscatter
+const int inscatter_froxels = 2; // looked up in uFroxelVolume
+uniform int uInscatterMode;
+
+// In-scattering rendered separately at a lower resolution (see INSCATTER_PASS)
+// rgb is the in-scattered radiance and a the view-space depth it was
+// computed for, clamped to inscatter_max_depth
+uniform sampler2D uInscatter;
+uniform vec2 uInscatterSize;
+
+// Froxel grid, a volume texture over the view frustum (see FROXEL_INJECT_PASS
+// and FROXEL_INTEGRATE_PASS). Slice boundaries are at depths
+// uFroxelFar * (t / slices)^uFroxelExponent for t = 0 .. slices
+uniform ivec3 uFroxelDims;
+uniform float uFroxelFar;
+uniform float uFroxelExponent;
+uniform int uFroxelSlice; // slice being rendered by the froxel passes
+uniform sampler3D uFroxelScatter; // rgb scattered radiance per unit length, a extinction
+uniform sampler3D uFroxelVolume; // rgb in-scattering from the eye to the far side of a slice, a transmittance
+uniform sampler2D uFroxelIntegral; // uFroxelVolume's slice uFroxelSlice - 1, while it is being integrated
+
+// in-scattering is only computed this far along a ray
+const float inscatter_range = 100.0;
+const float inscatter_max_depth = 2.0 * inscatter_range;
+
+// Lighting accumulated by the light volume passes, used instead of
+// looping over the lights when uLightVolumes is set
+uniform bool uLightVolumes;
+uniform sampler2D uLightAccum;
+
+// Hierarchical depth for occlusion culling (see HIZ_BUILD_PASS and
+// HIZ_TEST_PASS). Each level holds the furthest log encoded depth over the
+// texels it covers in the level above, level 0 being half the scene depth
+// resolution uDepthSize, so texel t of level l covers pixels t * 2^(l+1)
+// onwards (and the rest of the row or column, for the last texel).
+// Object bounds are world space min and max in consecutive texels,
+// hiz_objects_per_row objects per row
+uniform sampler2D uHiZ;
+uniform int uHiZLevels;
+uniform ivec2 uDepthSize;
+uniform sampler2D uObjectBounds;
+uniform int uNumObjects;
+uniform mat4 uViewProjection;
+uniform float uZNear;
+
+const int hiz_objects_per_row = 1024;
 
 const float pi = 3.14159265;
 
+#if defined(LIGHT_STENCIL_PASS) || defined(LIGHT_VOLUME_PASS)
+
+// Light volumes are drawn as spheres, so the screen position comes from the
+// fragment rather than a fullscreen triangle
+uniform vec2 uScreenSize;
+uniform int uLightIndex;
+varying float vDepth; // view-space depth (+ve) of the sphere
+
+#define vTextureCoord (gl_FragCoord.xy / uScreenSize)
+
+#else
+
 varying vec2 vTextureCoord;
 
+#endif
+
+
+#ifdef COMPACT_GBUFFER
+
+// Compact G-buffer (see scene_shader.frag for encoding)
+const float max_log_shininess = 14.0;
+
+vec2 oct_wrap(vec2 v) {
+	return (1.0 - abs(v.yx)) * vec2(v.x >= 0.0 ? 1.0 : -1.0, v.y >= 0.0 ? 1.0 : -1.0);
+}
+
+vec3 decode_normal(vec2 e) {
+	e = e * 2.0 - 1.0;
+	vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+	if (n.z < 0.0) n.xy = oct_wrap(n.xy);
+	return normalize(n);
+}
+
+vec3 read_normal() { return decode_normal(texture2D(uNormal, vTextureCoord).rg); }
+vec3 read_diffuse() { vec3 c = texture2D(uDiffuse, vTextureCoord).rgb; return c * c; }
+vec3 read_specular() { vec3 c = texture2D(uSpecular, vTextureCoord).rgb; return c * c; }
+float read_shininess() { return exp2(texture2D(uSpecular, vTextureCoord).a * max_log_shininess); }
+
+#else
+
+// need to renormalize because normals are stored in lower precision
+vec3 read_normal() { return normalize(texture2D(uNormal, vTextureCoord).xyz); }
+vec3 read_diffuse() { return texture2D(uDiffuse, vTextureCoord).rgb; }
+vec3 read_specular() { return texture2D(uSpecular, vTextureCoord).rgb; }
+float read_shininess() { return texture2D(uSpecular, vTextureCoord).a; }
+
+#endif
+
 // also +ve
 float read_log_depth() {
 	const float c = 0.01;
@@ -73,31 +190,88 @@ vec3 transmittance(float d) {
 	return exp(-beta_ex * d);
 }
 
-// size of next inscatter sample
-float inscatter_sample_size(vec3 pos_v, vec3 dir_v, Light light) {
-	// random hacky stuff, will have to do
-	vec3 ld = light.pos_v - pos_v;
-	float dl2 = dot(ld, ld);
-	ld = normalize(ld);
-	float k = abs(dot(dir_v, ld));
-	return 0.3 + mix(dl2 * 0.02, 0.2 * sqrt(dl2), k);
+// Airlight table F(k, gamma) (see cgra_airlight.hpp), gamma across and
+// sqrt(k / (k + 1)) down, must match the constants there
+uniform sampler2D uAirlight;
+const vec2 airlight_size = vec2(512.0, 128.0);
+const float airlight_max_k = 16.0;
+const float airlight_min_distance = 0.1;
+
+float airlight(float k, float gamma) {
+	vec2 uv = vec2(gamma / pi + 0.5, min(sqrt(k / (k + 1.0) * (airlight_max_k + 1.0) / airlight_max_k), 1.0));
+	return texture2D(uAirlight, (uv * (airlight_size - 1.0) + 0.5) / airlight_size).r;
+}
+
+// Smooth falloff to 0 at a light's radius, so culling lights past it
+// doesn't leave a visible edge
+float light_window(float d, float radius) {
+	float x = d / radius;
+	x *= x;
+	float w = clamp(1.0 - x * x, 0.0, 1.0);
+	return w * w;
 }
 
-// inscattered radiance along a ray from a light
+// inscattered radiance along a ray from a light, up to inscatter_range
+// Closed form over the whole ray, beta_ex is assumed to be grey
+// Windowed by how close the ray gets to the light, so a ray that misses
+// the light's radius gets nothing, as it would if the light were culled
 vec3 inscatter(vec3 pos0_v, vec3 dir_v, float d_max, Light light) {
-	vec3 p = pos0_v;
-	vec3 l = vec3(0.0);
-	for (float d = 0.0; d < min(d_max, 100.0); ) {
-		float dd = inscatter_sample_size(p, dir_v, light);
-		vec3 ph = p + dd * 0.5;
-		float dl = length(light.pos_v - ph);
-		float muvs = dot(normalize(light.pos_v - ph), dir_v);
-		vec3 e0 = light.flux / pow(dl, 2.0) * transmittance(dl);
-		l += transmittance(d + 0.5 * dd) * e0 * beta_sc * phase_m(muvs) * dd;
-		p += dd * dir_v;
-		d += dd;
-	}
-	return l;
+	vec3 lo = light.pos_v - pos0_v;
+	float sl = dot(lo, dir_v);
+	float b = max(sqrt(max(dot(lo, lo) - sl * sl, 0.0)), airlight_min_distance);
+	if (b >= light.radius) return vec3(0.0);
+	float k = beta_ex.x * b;
+	float f = airlight(k, atan((min(d_max, inscatter_range) - sl) / b)) - airlight(k, atan(-sl / b));
+	return light.flux * beta_sc * (exp(-beta_ex.x * sl) * f / b * light_window(b, light.radius));
+}
+
+// i-th light from the light data texture
+Light get_light(int i) {
+	ivec2 t = ivec2(i % light_data_width, 2 * (i / light_data_width));
+	Light light;
+	vec4 pos_radius = texelFetch(uLightData, t, 0);
+	light.pos_v = pos_radius.xyz;
+	light.radius = pos_radius.w;
+	light.flux = texelFetch(uLightData, t + ivec2(0, 1), 0).rgb;
+	return light;
+}
+
+// cluster screen tile of this fragment
+ivec2 cluster_tile() {
+	return clamp(ivec2(vTextureCoord * vec2(uClusterDims.xy)), ivec2(0), uClusterDims.xy - 1);
+}
+
+// cluster depth slice of a view-space depth (+ve)
+int cluster_slice(float depth_v) {
+	float s = floor(log(max(depth_v, uClusterZNear) / uClusterZNear) * uClusterSliceScale);
+	return int(min(s, float(uClusterDims.z - 1)));
+}
+
+// (offset, count) of the lights in a cluster, slice == uClusterDims.z for the whole tile
+uvec2 cluster_range(ivec2 tile, int slice) {
+	return texelFetch(uClusterGrid, ivec2(tile.x, tile.y + uClusterDims.y * slice), 0).rg;
+}
+
+// i-th entry of the cluster light index list
+int cluster_light(uint i) {
+	int j = int(i);
+	return int(texelFetch(uClusterLights, ivec2(j % cluster_lights_width, j / cluster_lights_width), 0).r);
+}
+
+// reflected radiance from a single light
+vec3 surface_radiance(Light light, vec3 pos_v, vec3 norm_v, vec3 dir_v, vec3 diffuse, vec3 specular, float shininess) {
+	// direction and distance from fragment to light
+	vec3 ldir_v = light.pos_v - pos_v;
+	float d = length(ldir_v);
+	if (d >= light.radius) return vec3(0.0);
+	ldir_v = normalize(ldir_v);
+
+	// Irradiance from light
+	vec3 e = light.flux / pow(d, 2.0) * transmittance(d) * light_window(d, light.radius);
+	e *= max(0.0, dot(ldir_v, norm_v));
+
+	// radiance from this light
+	return lambertPhong(e, ldir_v, norm_v, -dir_v, diffuse, specular, shininess);
 }
 
 float cos_atan(float v) {
@@ -105,41 +279,303 @@ float cos_atan(float v) {
 }
 
 
-void main() {
-	// view-space depth (+ve)
-	// float depth_v = read_depth();
-	float depth_v = read_log_depth();
-
+// view-space near plane position and direction of the ray through a point
+// on the screen (0 to 1)
+void screen_ray(vec2 uv, out vec3 pos_nearplane, out vec3 dir_v) {
 	// view-space near plane ray intersection
-	vec4 projection_nearplane = gl_ProjectionMatrixInverse * vec4((vTextureCoord * 2.0 - 1.0), -1.0, 1.0);
-	vec3 pos_nearplane = (projection_nearplane / projection_nearplane.w).xyz;
+	vec4 projection_nearplane = uProjectionMatrixInverse * vec4((uv * 2.0 - 1.0), -1.0, 1.0);
+	pos_nearplane = (projection_nearplane / projection_nearplane.w).xyz;
 
 	// view-space 'far' plane ray intersection
 	// it would be nice if we could just use the far plane, but application of the
 	// inverse projection matrix results in precision problems. so, we let the
 	// application decide what z (ndc) will be used for unprojection.
-	vec4 projection_farplane = gl_ProjectionMatrixInverse * vec4((vTextureCoord * 2.0 - 1.0), uZUnproject, 1.0);
+	vec4 projection_farplane = uProjectionMatrixInverse * vec4((uv * 2.0 - 1.0), uZUnproject, 1.0);
 	vec3 pos_farplane = (projection_farplane / projection_farplane.w).xyz;
 	
 	// view-space ray direction (from viewer to frament)
 	// 
-	vec3 dir_v = normalize(pos_farplane - pos_nearplane);
+	dir_v = normalize(pos_farplane - pos_nearplane);
+}
+
+// view-space position along a ray at a depth (+ve)
+vec3 ray_at_depth(vec3 pos_nearplane, vec3 dir_v, float depth_v) {
+	return pos_nearplane + dir_v * ((depth_v + pos_nearplane.z) / -dir_v.z);
+}
+
+// view-space depth (+ve), position, and ray through this fragment
+void view_ray(out float depth_v, out vec3 pos_nearplane, out vec3 dir_v, out vec3 pos_v) {
+	// float depth_v = read_depth();
+	depth_v = read_log_depth();
+
+	screen_ray(vTextureCoord, pos_nearplane, dir_v);
 
 	// view-space fragment position
 	// 
-	vec3 pos_v = pos_nearplane + dir_v * ((depth_v + pos_nearplane.z) / -dir_v.z);
+	pos_v = ray_at_depth(pos_nearplane, dir_v, depth_v);
+}
+
+// in-scattered radiance along the view ray from every light
+vec3 inscatter_all(vec3 pos_nearplane, vec3 dir_v, float d_max) {
+	vec3 l = vec3(0.0);
+	if (uClustered) {
+		// inscattering needs every light along the view ray
+		uvec2 range = cluster_range(cluster_tile(), uClusterDims.z);
+		for (uint i = 0u; i < range.y; ++i) {
+			l += inscatter(pos_nearplane, dir_v, d_max, get_light(cluster_light(range.x + i)));
+		}
+	} else {
+		for (int i = 0; i < uNumLights; ++i) {
+			l += inscatter(pos_nearplane, dir_v, d_max, get_light(i));
+		}
+	}
+	return l;
+}
+
+// Depth-aware (bilateral) upsample of the low resolution in-scattering
+// The 4 nearest texels are weighted bilinearly and by how close their depth
+// is to this fragment's, so in-scattering doesn't bleed across edges
+vec3 upsample_inscatter(float depth_v) {
+	depth_v = min(depth_v, inscatter_max_depth);
+	vec2 p = vTextureCoord * uInscatterSize - 0.5;
+	ivec2 p0 = ivec2(floor(p));
+	vec2 f = p - floor(p);
+	ivec2 size = ivec2(uInscatterSize);
+
+	vec3 l = vec3(0.0);
+	float w_sum = 0.0;
+	for (int y = 0; y < 2; ++y) {
+		for (int x = 0; x < 2; ++x) {
+			vec4 s = texelFetch(uInscatter, clamp(p0 + ivec2(x, y), ivec2(0), size - 1), 0);
+			float w_bilinear = max((x == 0 ? 1.0 - f.x : f.x) * (y == 0 ? 1.0 - f.y : f.y), 0.001);
+			float w_depth = 1.0 / (0.01 + abs(s.a - depth_v) / depth_v);
+			l += s.rgb * w_bilinear * w_depth;
+			w_sum += w_bilinear * w_depth;
+		}
+	}
+	return l / w_sum;
+}
 
 
+// depth (+ve) of a froxel slice boundary, t from 0 to slices
+float froxel_depth(float t) {
+	return uFroxelFar * pow(t / float(uFroxelDims.z), uFroxelExponent);
+}
+
+// continuous slice coordinate (0 to slices) of a depth
+float froxel_slice(float depth_v) {
+	return float(uFroxelDims.z) * pow(clamp(depth_v / uFroxelFar, 0.0, 1.0), 1.0 / uFroxelExponent);
+}
+
+// in-scattering between the eye and a depth on this fragment's ray, from
+// the integrated froxel volume
+vec3 froxel_inscatter(float depth_v) {
+	// texel k holds the in-scattering up to the far side of slice k
+	float t = froxel_slice(depth_v);
+	vec3 l = texture(uFroxelVolume, vec3(vTextureCoord, (t - 0.5) / float(uFroxelDims.z))).rgb;
+	return t < 1.0 ? l * t : l;
+}
+
+
+#if defined(LIGHT_STENCIL_PASS)
+
+// Only the depth of the sphere is needed, to test against the scene, in
+// the same log encoding as the scene shader writes
+void main() {
+	const float c = 0.01;
+	float fc = 1.0 / log(uZFar * c + 1.0);
+	gl_FragDepth = log(vDepth * c + 1.0) * fc;
+}
+
+#elif defined(LIGHT_VOLUME_PASS)
+
+// Reflected radiance from light uLightIndex, for the pixels the stencil
+// pass found inside its volume
+void main() {
+	if (texture2D(uDiffuse, vTextureCoord).a > 0.5) discard; // emissive
+
+	float depth_v;
+	vec3 pos_nearplane, dir_v, pos_v;
+	view_ray(depth_v, pos_nearplane, dir_v, pos_v);
+
+	gl_FragColor.rgb = surface_radiance(get_light(uLightIndex), pos_v, read_normal(), dir_v, read_diffuse(), read_specular(), read_shininess());
+	gl_FragColor.a = 1.0;
+}
+
+#elif defined(FROXEL_INJECT_PASS)
+
+// Radiance scattered towards the eye per unit length in each froxel in
+// slice uFroxelSlice, from every light whose cluster covers it.
+// Costs lights * froxels, whatever the screen resolution
+void main() {
+	vec3 pos_nearplane, dir_v;
+	screen_ray(vTextureCoord, pos_nearplane, dir_v);
+	float depth_v = froxel_depth(float(uFroxelSlice) + 0.5);
+	vec3 pos_v = ray_at_depth(pos_nearplane, dir_v, depth_v);
+
+	// the froxel's extent along the ray through its centre
+	float s0 = max((froxel_depth(float(uFroxelSlice)) + pos_nearplane.z) / -dir_v.z, 0.0);
+	float s1 = max((froxel_depth(float(uFroxelSlice + 1)) + pos_nearplane.z) / -dir_v.z, s0 + 1e-4);
+
+	vec3 l = vec3(0.0);
+	uvec2 range = uvec2(0u, uint(uNumLights));
+	if (uClustered) range = cluster_range(cluster_tile(), cluster_slice(depth_v));
+	for (uint i = 0u; i < range.y; ++i) {
+		Light light = get_light(uClustered ? cluster_light(range.x + i) : int(i));
+		vec3 ld = light.pos_v - pos_v;
+		float dl = length(ld);
+
+		// 1/r^2 integrated over the segment exactly, so froxels that pass
+		// close to a light keep its bright core rather than point sampling it
+		vec3 lo = light.pos_v - pos_nearplane;
+		float sl = dot(lo, dir_v);
+		float b = sqrt(max(dot(lo, lo) - sl * sl, 1e-6));
+		float inv_r2 = (atan((s1 - sl) / b) - atan((s0 - sl) / b)) / (b * (s1 - s0));
+
+		vec3 e0 = light.flux * inv_r2 * transmittance(dl) * light_window(dl, light.radius);
+		l += e0 * beta_sc * phase_m(dot(ld / max(dl, 1e-4), dir_v));
+	}
+
+	gl_FragColor.rgb = l;
+	gl_FragColor.a = beta_ex.x;
+}
+
+#elif defined(FROXEL_INTEGRATE_PASS)
+
+// Integrates the froxel scattering front to back along the view ray up to
+// the far side of slice uFroxelSlice, so the deferred pass needs one lookup.
+// Slices are integrated in order, each adding its own scattering to the
+// integral up to the slice before (uFroxelIntegral), and writing the result
+// both to its slice of the volume (0) and for the next slice to read (1).
+// Like the other in-scattering modes it stops at inscatter_range along the
+// ray from the near plane, whatever depth the slices reach
+void main() {
+	vec3 pos_nearplane, dir_v;
+	screen_ray(vTextureCoord, pos_nearplane, dir_v);
+	// length along the ray per unit of depth
+	float ray_scale = 1.0 / -dir_v.z;
+
+	ivec2 texel = ivec2(gl_FragCoord.xy);
+	int k = uFroxelSlice;
+	vec4 before = k > 0 ? texelFetch(uFroxelIntegral, texel, 0) : vec4(0.0, 0.0, 0.0, 1.0);
+
+	vec4 scatter = texelFetch(uFroxelScatter, ivec3(texel, k), 0);
+	float s0 = clamp((froxel_depth(float(k)) + pos_nearplane.z) * ray_scale, 0.0, inscatter_range);
+	float s1 = clamp((froxel_depth(float(k + 1)) + pos_nearplane.z) * ray_scale, 0.0, inscatter_range);
+	float length_k = s1 - s0;
+	float t_k = exp(-scatter.a * length_k);
+
+	// scattering integrated over the slice, attenuated within it
+	vec3 l_k = scatter.a > 0.0 ? scatter.rgb * (1.0 - t_k) / scatter.a : scatter.rgb * length_k;
+	vec4 integral = vec4(before.rgb + before.a * l_k, before.a * t_k);
+
+	gl_FragData[0] = integral;
+	gl_FragData[1] = integral;
+}
+
+#elif defined(HIZ_BUILD_PASS)
+
+// One level of the Hi-Z pyramid from the level above (or the scene depth),
+// bound as uHiZ with only that level visible. Where the level above has an
+// odd size the last texel also covers the extra row or column
+void main() {
+	ivec2 src_size = textureSize(uHiZ, 0);
+	ivec2 first = ivec2(gl_FragCoord.xy) * 2;
+	ivec2 last = min(first + 1 + ivec2(equal(first + 3, src_size)), src_size - 1);
+
+	float d = 0.0;
+	for (int y = first.y; y <= last.y; ++y) {
+		for (int x = first.x; x <= last.x; ++x) {
+			d = max(d, texelFetch(uHiZ, ivec2(x, y), 0).r);
+		}
+	}
+	gl_FragColor = vec4(d);
+}
+
+#elif defined(HIZ_TEST_PASS)
+
+// Visibility of object gl_FragCoord.y * hiz_objects_per_row + gl_FragCoord.x,
+// 0 if its bounds are behind the furthest depth over the screen rectangle
+// they cover, 1 if not or if that can't be told. Must match hiz_buffer in
+// cgra_hiz.hpp
+void main() {
+	ivec2 texel = ivec2(gl_FragCoord.xy);
+	int object = texel.y * hiz_objects_per_row + texel.x;
+	gl_FragColor = vec4(1.0);
+	if (object >= uNumObjects) return;
+
+	vec3 bmin = texelFetch(uObjectBounds, ivec2(2 * texel.x, texel.y), 0).xyz;
+	vec3 bmax = texelFetch(uObjectBounds, ivec2(2 * texel.x + 1, texel.y), 0).xyz;
+
+	// screen rectangle and nearest depth of the box corners, clip w being
+	// the view depth
+	vec2 uv_min = vec2(1.0), uv_max = vec2(0.0);
+	float depth_v = uZFar;
+	for (int k = 0; k < 8; ++k) {
+		vec3 p = vec3((k & 1) != 0 ? bmax.x : bmin.x, (k & 2) != 0 ? bmax.y : bmin.y, (k & 4) != 0 ? bmax.z : bmin.z);
+		vec4 clip = uViewProjection * vec4(p, 1.0);
+		if (clip.w < uZNear) return; // crosses the near plane
+		vec2 uv = clip.xy / clip.w * 0.5 + 0.5;
+		uv_min = min(uv_min, uv);
+		uv_max = max(uv_max, uv);
+		depth_v = min(depth_v, clip.w);
+	}
+	// off screen, so only frustum culling can say
+	if (any(greaterThan(uv_min, vec2(1.0))) || any(lessThan(uv_max, vec2(0.0)))) return;
+	uv_min = clamp(uv_min, 0.0, 1.0);
+	uv_max = clamp(uv_max, 0.0, 1.0);
+
+	// the level where the rectangle is at most a texel across, so it
+	// covers at most 2x2 texels
+	ivec2 p0 = min(ivec2(uv_min * vec2(uDepthSize)), uDepthSize - 1);
+	ivec2 p1 = min(ivec2(uv_max * vec2(uDepthSize)), uDepthSize - 1);
+	int extent = max(p1.x - p0.x, p1.y - p0.y) + 1;
+	int level = clamp(int(ceil(log2(float(extent)))) - 1, 0, uHiZLevels - 1);
+	// sized from uDepthSize rather than textureSize, which doesn't report
+	// the level sizes reliably after their base level has been moved
+	ivec2 size = max((uDepthSize / 2) >> level, ivec2(1));
+	ivec2 t0 = min(p0 >> (level + 1), size - 1);
+	ivec2 t1 = min(p1 >> (level + 1), size - 1);
+
+	float furthest = 0.0;
+	for (int y = t0.y; y <= t1.y; ++y) {
+		for (int x = t0.x; x <= t1.x; ++x) {
+			furthest = max(furthest, texelFetch(uHiZ, ivec2(x, y), level).r);
+		}
+	}
+
+	const float c = 0.01;
+	float fc = 1.0 / log(uZFar * c + 1.0);
+	if (log(depth_v * c + 1.0) * fc > furthest) gl_FragColor = vec4(0.0);
+}
+
+#elif defined(INSCATTER_PASS)
+
+void main() {
+	float depth_v;
+	vec3 pos_nearplane, dir_v, pos_v;
+	view_ray(depth_v, pos_nearplane, dir_v, pos_v);
+
+	gl_FragColor.rgb = inscatter_all(pos_nearplane, dir_v, length(pos_v));
+	gl_FragColor.a = min(depth_v, inscatter_max_depth);
+}
+
+#else
+
+void main() {
+	float depth_v;
+	vec3 pos_nearplane, dir_v, pos_v;
+	view_ray(depth_v, pos_nearplane, dir_v, pos_v);
+
 	// view-space normal
-	// need to renormalize because normals are stored in lower precision
-	vec3 norm_v = normalize(texture2D(uNormal, vTextureCoord).xyz);
+	vec3 norm_v = read_normal();
 
 	// fragment material properties
 	// 
-	vec3 diffuse = texture2D(uDiffuse, vTextureCoord).rgb;
+	vec3 diffuse = read_diffuse();
 	bool emmisive = texture2D(uDiffuse, vTextureCoord).a > 0.5; //hack
-	vec3 specular = texture2D(uSpecular, vTextureCoord).rgb;
-	float shininess = texture2D(uSpecular, vTextureCoord).a;
+	vec3 specular = read_specular();
+	float shininess = read_shininess();
 
 
 	if (emmisive) {
@@ -155,21 +591,29 @@ void main() {
 		// ambient hack to make everything NOT black
 		l += diffuse * 0.05;
 
-		for (int i = 0; i < uNumLights; ++i) {
-			// direction and distance from fragment to light
-			vec3 ldir_v = uLights[i].pos_v - pos_v;
-			float d = length(ldir_v);
-			ldir_v = normalize(ldir_v);
-			
-			// Irradiance from light
-			vec3 e = uLights[i].flux / pow(d, 2.0) * transmittance(d);
-			e *= max(0.0, dot(ldir_v, norm_v));
-
-			// Add the result of radiance from this light
-			l += lambertPhong(e, ldir_v, norm_v, -dir_v, diffuse, specular, shininess);
-
+		if (uLightVolumes) {
+			l += texelFetch(uLightAccum, ivec2(gl_FragCoord.xy), 0).rgb;
+
+		} else if (uClustered) {
+			// surface lighting only needs the lights near this depth
+			uvec2 range = cluster_range(cluster_tile(), cluster_slice(depth_v));
+			for (uint i = 0u; i < range.y; ++i) {
+				l += surface_radiance(get_light(cluster_light(range.x + i)), pos_v, norm_v, dir_v, diffuse, specular, shininess);
+			}
+
+		} else {
+			for (int i = 0; i < uNumLights; ++i) {
+				// Add the result of radiance from this light
+				l += surface_radiance(get_light(i), pos_v, norm_v, dir_v, diffuse, specular, shininess);
+			}
+		}
 
-			l += inscatter(pos_nearplane, dir_v, length(pos_v), uLights[i]);
+		if (uInscatterMode == inscatter_froxels) {
+			l += froxel_inscatter(depth_v);
+		} else if (uInscatterMode == inscatter_low_res) {
+			l += upsample_inscatter(depth_v);
+		} else {
+			l += inscatter_all(pos_nearplane, dir_v, length(pos_v));
 		}
 
 		// simple tonemapping for HDR
@@ -179,3 +623,5 @@ void main() {
 	}
 
 }
+
+#endif
@@ -1,4 +1,4 @@
-#version 120
+#version 130
 
 uniform float uZFar;
 
@@ -7,9 +7,27 @@ uniform sampler2D uNormal;
 uniform sampler2D uDiffuse;
 uniform sampler2D uSpecular;
 
+#if defined(LIGHT_STENCIL_PASS) || defined(LIGHT_VOLUME_PASS)
+
+// Light volume, a sphere around the light (see renderLightVolumes)
+uniform mat4 uProjectionMatrix;
+uniform mat4 uModelViewMatrix;
+
+varying float vDepth;
+
+void main() {
+	vec4 pos_v = uModelViewMatrix * gl_Vertex;
+	vDepth = -pos_v.z;
+	gl_Position = uProjectionMatrix * pos_v;
+}
+
+#else
+
 varying vec2 vTextureCoord;
 
 void main() {
 	vTextureCoord = gl_Vertex.xy * 0.5 + 0.5;
 	gl_Position = gl_Vertex;
 }
+
+#endif
@@ -10,6 +10,13 @@ uniform float uShininess;
 varying vec3 vPosition;
 varying vec3 vNormal;
 
+#ifdef INSTANCED
+varying vec3 vInstanceColor;
+#define DIFFUSE vInstanceColor
+#else
+#define DIFFUSE uDiffuse
+#endif
+
 // depth_v should be +ve
 // so like: write_depth(-vPosition.z);
 void write_log_depth(float depth_v) {
@@ -22,18 +29,47 @@ void write_depth(float depth_v) {
 	gl_FragDepth = depth_v/uZFar;
 }
 
+#ifdef COMPACT_GBUFFER
+
+// Compact G-buffer (see deferred_shader.frag for decoding)
+// Normals are octahedral encoded into RG16, colours are square root encoded
+// into 8 bits to keep precision in the darks, and shininess is log2 encoded
+const float max_log_shininess = 14.0;
+
+vec2 oct_wrap(vec2 v) {
+	return (1.0 - abs(v.yx)) * vec2(v.x >= 0.0 ? 1.0 : -1.0, v.y >= 0.0 ? 1.0 : -1.0);
+}
+
+vec2 encode_normal(vec3 n) {
+	n /= abs(n.x) + abs(n.y) + abs(n.z);
+	vec2 e = n.z >= 0.0 ? n.xy : oct_wrap(n.xy);
+	return e * 0.5 + 0.5;
+}
+
+#endif
+
 void main() {
 	// write_depth(-vPosition.z);
 	write_log_depth(-vPosition.z);
-	
+
+#ifdef COMPACT_GBUFFER
+	gl_FragData[0].rg = encode_normal(normalize(vNormal));
+
+	gl_FragData[1].rgb = sqrt(DIFFUSE);
+	gl_FragData[1].a = float(uEmissive);
+
+	gl_FragData[2].rgb = sqrt(uSpecular);
+	gl_FragData[2].a = log2(max(uShininess, 1.0)) / max_log_shininess;
+#else
 	// Normal
 	gl_FragData[0].rgb = normalize(vNormal);
 
 	// Diffuse and emissive flag
-	gl_FragData[1].rgb = uDiffuse;
+	gl_FragData[1].rgb = DIFFUSE;
 	gl_FragData[1].a = float(uEmissive);
 
 	// Specular and shininess
 	gl_FragData[2].rgb = uSpecular;
 	gl_FragData[2].a = uShininess;
+#endif
 }
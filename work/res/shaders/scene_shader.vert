@@ -5,11 +5,30 @@ uniform vec3 uDiffuse;
 uniform vec3 uSpecular;
 uniform float uShininess;
 
+uniform mat4 uProjectionMatrix;
+uniform mat4 uModelViewMatrix;
+uniform mat3 uNormalMatrix;
+
 varying vec3 vPosition;
 varying vec3 vNormal;
 
+#ifdef INSTANCED
+// Per instance position and uniform scale in model space, and diffuse
+// colour (bound to the attributes in cgra_geometry.hpp)
+attribute vec4 aInstancePosScale;
+attribute vec4 aInstanceColor;
+
+varying vec3 vInstanceColor;
+#endif
+
 void main() {
-	vNormal = gl_NormalMatrix * gl_Normal;
-	vPosition = (gl_ModelViewMatrix * gl_Vertex).xyz;
-	gl_Position = gl_ModelViewProjectionMatrix * gl_Vertex;
+#ifdef INSTANCED
+	vec4 position = uModelViewMatrix * vec4(gl_Vertex.xyz * aInstancePosScale.w + aInstancePosScale.xyz, 1.0);
+	vInstanceColor = aInstanceColor.rgb;
+#else
+	vec4 position = uModelViewMatrix * gl_Vertex;
+#endif
+	vNormal = uNormalMatrix * gl_Normal;
+	vPosition = position.xyz;
+	gl_Position = uProjectionMatrix * position;
 }
@@ -0,0 +1,161 @@
+//---------------------------------------------------------------------------
+//
+// Copyright (c) 2016 Taehyun Rhee, Joshua Scott, Ben Allen
+//
+// This software is provided 'as-is' for assignment of COMP308 in ECS,
+// Victoria University of Wellington, without any express or implied warranty. 
+// In no event will the authors be held liable for any damages arising from
+// the use of this software.
+//
+// The contents of this file may not be copied or duplicated in any form
+// without the prior permission of its owner.
+//
+//----------------------------------------------------------------------------
+
+//----------------------------------------------------------------------------
+//
+// Airlight (single scattering from a point light)
+//
+// Light scattered towards the eye along a view ray from a point light in a
+// homogeneous medium. For a ray from o in direction d, a light at distance
+// b from the ray, closest to it at s_l along the ray, and a point at
+// s = s_l + b tan(g), the integral
+//
+//   flux * beta_sc * int exp(-beta_ex (s + r)) phase(mu) / r^2 ds
+//
+// becomes, with r = b / cos(g) and mu = -sin(g),
+//
+//   flux * beta_sc * exp(-beta_ex s_l) / b * (F(beta_ex b, g1) - F(beta_ex b, g0))
+//
+//   F(k, g) = int_{-pi/2}^{g} phase(-sin x) exp(-k (1 + sin x) / cos x) dx
+//
+// F only depends on the medium, so it is tabulated once on the CPU and
+// looked up in the shader, two lookups per light whatever the ray length.
+//
+// The medium must match deferred_shader.frag, and beta_ex is assumed to be
+// the same for every channel.
+//
+//----------------------------------------------------------------------------
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "cgra_math.hpp"
+
+namespace cgra {
+
+	class airlight_table {
+	public:
+		// Scattering and extinction coefficients, and the Mie phase function
+		// asymmetry
+		static constexpr float beta_sc = 0.02f;
+		static constexpr float beta_ex = 1.1f * beta_sc;
+		static constexpr float phase_g = 0.75f;
+
+		// Rays closer than this to a light are treated as this far away, so
+		// rays through a light don't blow up
+		static constexpr float min_distance = 0.1f;
+
+		// Table size, gamma across (width) and k down (height)
+		// k is stored as sqrt(k / (k + 1)) up to max_k, past it the light is
+		// so attenuated that it is clamped. Small k (rays close to the light)
+		// get more rows, as F changes fastest with k there
+		static const int gamma_size = 512;
+		static const int k_size = 128;
+		static constexpr float max_k = 16.f;
+
+	private:
+		std::vector<float> m_table;
+
+	public:
+		airlight_table() : m_table(gamma_size * k_size) {
+			// substeps per table cell, integrated with Simpson's rule
+			const int substeps = 16;
+			for (int j = 0; j < k_size; ++j) {
+				double k = kForRow(j);
+				auto f = [=](double x) {
+					double c = std::cos(x);
+					if (c <= 0) return 0.0;
+					return phase(-std::sin(x)) * std::exp(-k * (1 + std::sin(x)) / c);
+				};
+				double sum = 0;
+				m_table[j * gamma_size] = 0.f;
+				for (int i = 1; i < gamma_size; ++i) {
+					double g0 = gammaForColumn(i - 1);
+					double dx = (gammaForColumn(i) - g0) / substeps;
+					for (int n = 0; n < substeps; ++n) {
+						double x0 = g0 + n * dx;
+						sum += dx / 6 * (f(x0) + 4 * f(x0 + 0.5 * dx) + f(x0 + dx));
+					}
+					m_table[j * gamma_size + i] = float(sum);
+				}
+			}
+		}
+
+		// Mie phase function, for the cosine of the angle between the
+		// directions to the light and to the eye
+		static double phase(double mu) {
+			const double g = phase_g;
+			return 3 * (1 - g * g) * (1 + mu * mu) / (8 * math::pi() * (2 + g * g) * std::pow(1 + g * g - 2 * g * mu, 1.5));
+		}
+
+		// Row major, gamma_size by k_size
+		const float * data() const { return m_table.data(); }
+
+		// F(k, gamma) with the same bilinear filtering as the GPU
+		float lookup(float k, float gamma) const {
+			float u = std::min(std::sqrt(k / (k + 1) / (max_k / (max_k + 1))), 1.f) * (k_size - 1);
+			float v = std::min(std::max(float(gamma / math::pi() + 0.5), 0.f), 1.f) * (gamma_size - 1);
+			int j = std::min(int(u), k_size - 2);
+			int i = std::min(int(v), gamma_size - 2);
+			float fu = u - j, fv = v - i;
+			const float *r0 = &m_table[j * gamma_size + i];
+			const float *r1 = r0 + gamma_size;
+			return (1 - fu) * ((1 - fv) * r0[0] + fv * r0[1]) + fu * ((1 - fv) * r1[0] + fv * r1[1]);
+		}
+
+		// In-scattered radiance from a light along a ray of some length, dir
+		// must be normalized
+		vec3 inscatter(const vec3 &origin, const vec3 &dir, float length, const vec3 &light_pos, const vec3 &flux) const {
+			vec3 lo = light_pos - origin;
+			float sl = dot(lo, dir);
+			float b = std::max(std::sqrt(std::max(dot(lo, lo) - sl * sl, 0.f)), float(min_distance));
+			float g0 = std::atan(-sl / b);
+			float g1 = std::atan((length - sl) / b);
+			float f = lookup(beta_ex * b, g1) - lookup(beta_ex * b, g0);
+			return flux * (beta_sc * std::exp(-beta_ex * sl) * f / b);
+		}
+
+		// The same integral marched in small steps, for checking the table
+		// Steps shrink near the light, where the integrand peaks
+		static vec3 inscatterReference(const vec3 &origin, const vec3 &dir, float length, const vec3 &light_pos, const vec3 &flux) {
+			vec3 lo = light_pos - origin;
+			double sl = dot(lo, dir);
+			double b2 = std::max(double(dot(lo, lo)) - sl * sl, double(min_distance) * min_distance);
+			double sum = 0;
+			for (double s = 0; s < length; ) {
+				double r = std::sqrt(b2 + (s - sl) * (s - sl));
+				double ds = std::min(std::max(0.002 * r, 1e-4), length - s);
+				double sm = s + 0.5 * ds;
+				double rm = std::sqrt(b2 + (sm - sl) * (sm - sl));
+				sum += std::exp(-beta_ex * (sm + rm)) * phase((sl - sm) / rm) / (rm * rm) * ds;
+				s += ds;
+			}
+			return flux * float(beta_sc * sum);
+		}
+
+	private:
+		static double gammaForColumn(int i) {
+			return math::pi() * (double(i) / (gamma_size - 1) - 0.5);
+		}
+
+		static double kForRow(int j) {
+			double u = double(j) / (k_size - 1);
+			u = u * u * (max_k / (max_k + 1));
+			return u / (1 - u);
+		}
+	};
+}
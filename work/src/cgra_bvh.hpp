@@ -0,0 +1,196 @@
+//---------------------------------------------------------------------------
+//
+// Copyright (c) 2016 Taehyun Rhee, Joshua Scott, Ben Allen
+//
+// This software is provided 'as-is' for assignment of COMP308 in ECS,
+// Victoria University of Wellington, without any express or implied warranty. 
+// In no event will the authors be held liable for any damages arising from
+// the use of this software.
+//
+// The contents of this file may not be copied or duplicated in any form
+// without the prior permission of its owner.
+//
+//----------------------------------------------------------------------------
+
+//----------------------------------------------------------------------------
+//
+// Frustum culling with a bounding volume hierarchy
+//
+// The BVH is a binary tree of bounding boxes over a set of static objects,
+// built top down by splitting each node's objects at the median along its
+// longest axis. Every node covers a contiguous range of the object order,
+// so a node that is entirely inside the frustum contributes its whole range
+// without visiting its children, and a node entirely outside is skipped.
+// Only nodes crossing the frustum boundary are opened, so the cost grows
+// with the number of objects near the boundary rather than with the scene.
+//
+// Objects in leaves that cross the boundary are tested individually, so
+// the result is exactly the objects whose boxes aren't outside a plane.
+//
+//----------------------------------------------------------------------------
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "cgra_geometry.hpp"
+#include "cgra_math.hpp"
+
+namespace cgra {
+
+	// Six planes facing in, extracted from a view-projection matrix (Gribb
+	// and Hartmann), in the space the matrix transforms from
+	class frustum {
+	public:
+		enum result { outside, intersecting, inside };
+
+	private:
+		vec4 m_planes[6];
+
+	public:
+		frustum() { }
+
+		explicit frustum(const mat4 &view_proj) {
+			// rows of the matrix, which is column major
+			vec4 row[4];
+			for (int i = 0; i < 4; ++i) {
+				row[i] = vec4(view_proj[0][i], view_proj[1][i], view_proj[2][i], view_proj[3][i]);
+			}
+			for (int i = 0; i < 3; ++i) {
+				m_planes[2 * i] = row[3] + row[i];
+				m_planes[2 * i + 1] = row[3] - row[i];
+			}
+			for (vec4 &p : m_planes) {
+				// With a very distant far plane its normal can round to
+				// nothing, so it never culls anything
+				float l = length(vec3(p));
+				p = l > 1e-6f ? p / l : vec4(0, 0, 0, 1);
+			}
+		}
+
+		const vec4 & plane(int i) const { return m_planes[i]; }
+
+		result test(const aabb &b) const {
+			result r = inside;
+			for (const vec4 &p : m_planes) {
+				// the corners furthest along and against the plane normal
+				vec3 far_corner(p.x > 0 ? b.max.x : b.min.x, p.y > 0 ? b.max.y : b.min.y, p.z > 0 ? b.max.z : b.min.z);
+				vec3 near_corner(p.x > 0 ? b.min.x : b.max.x, p.y > 0 ? b.min.y : b.max.y, p.z > 0 ? b.min.z : b.max.z);
+				if (dot(vec3(p), far_corner) + p.w < 0) return outside;
+				if (dot(vec3(p), near_corner) + p.w < 0) r = intersecting;
+			}
+			return r;
+		}
+	};
+
+
+	// Work done by one bvh::cull
+	struct bvh_cull_stats {
+		int nodes_tested = 0;
+		int objects_tested = 0; // individually, in leaves crossing the frustum
+		int visible = 0;
+		int culled = 0;
+	};
+
+
+	class bvh {
+	public:
+		static const int max_leaf_size = 4;
+
+		// Covers m_order[begin, end). Internal nodes have children at left
+		// and left + 1, leaves have left == 0 (the root is never a child)
+		struct node {
+			aabb bounds;
+			uint32_t begin, end;
+			uint32_t left;
+		};
+
+	private:
+		std::vector<node> m_nodes;
+		std::vector<uint32_t> m_order;
+		std::vector<aabb> m_bounds;
+
+	public:
+		void build(const std::vector<aabb> &bounds) {
+			m_bounds = bounds;
+			m_nodes.clear();
+			m_order.resize(bounds.size());
+			for (size_t i = 0; i < m_order.size(); ++i) m_order[i] = uint32_t(i);
+			if (bounds.empty()) return;
+
+			m_nodes.reserve(2 * bounds.size() / max_leaf_size + 1);
+			m_nodes.push_back(node { aabb(), 0, uint32_t(bounds.size()), 0 });
+			split(0);
+		}
+
+		// Appends the index of every object not outside the frustum
+		void cull(const frustum &f, std::vector<uint32_t> &visible, bvh_cull_stats *stats = nullptr) const {
+			bvh_cull_stats s;
+			size_t first_visible = visible.size();
+
+			if (!m_nodes.empty()) {
+				uint32_t stack[64];
+				int top = 0;
+				stack[top++] = 0;
+				while (top > 0) {
+					const node &n = m_nodes[stack[--top]];
+					s.nodes_tested++;
+					frustum::result r = f.test(n.bounds);
+					if (r == frustum::outside) continue;
+					if (r == frustum::inside) {
+						visible.insert(visible.end(), m_order.begin() + n.begin, m_order.begin() + n.end);
+					} else if (n.left == 0) {
+						for (uint32_t i = n.begin; i < n.end; ++i) {
+							s.objects_tested++;
+							if (f.test(m_bounds[m_order[i]]) != frustum::outside) visible.push_back(m_order[i]);
+						}
+					} else {
+						stack[top++] = n.left + 1;
+						stack[top++] = n.left;
+					}
+				}
+			}
+
+			s.visible = int(visible.size() - first_visible);
+			s.culled = int(m_bounds.size()) - s.visible;
+			if (stats) *stats = s;
+		}
+
+		size_t nodeCount() const { return m_nodes.size(); }
+
+		size_t size() const { return m_bounds.size(); }
+
+	private:
+		// Median splits keep the tree balanced, so its depth is about
+		// log2(n / max_leaf_size) and the cull stack can't overflow
+		void split(uint32_t index) {
+			node n = m_nodes[index];
+			aabb centers;
+			for (uint32_t i = n.begin; i < n.end; ++i) {
+				n.bounds.extend(m_bounds[m_order[i]]);
+				vec3 c = m_bounds[m_order[i]].center();
+				centers.extend(aabb { c, c });
+			}
+
+			if (n.end - n.begin > uint32_t(max_leaf_size)) {
+				vec3 size = centers.max - centers.min;
+				int axis = size.x > size.y ? (size.x > size.z ? 0 : 2) : (size.y > size.z ? 1 : 2);
+				uint32_t mid = n.begin + (n.end - n.begin) / 2;
+				std::nth_element(m_order.begin() + n.begin, m_order.begin() + mid, m_order.begin() + n.end, [&](uint32_t a, uint32_t b) {
+					return m_bounds[a].center()[axis] < m_bounds[b].center()[axis];
+				});
+
+				n.left = uint32_t(m_nodes.size());
+				m_nodes.push_back(node { aabb(), n.begin, mid, 0 });
+				m_nodes.push_back(node { aabb(), mid, n.end, 0 });
+				split(n.left);
+				split(n.left + 1);
+			}
+
+			m_nodes[index] = n;
+		}
+	};
+}
@@ -0,0 +1,75 @@
+//---------------------------------------------------------------------------
+//
+// Copyright (c) 2016 Taehyun Rhee, Joshua Scott, Ben Allen
+//
+// This software is provided 'as-is' for assignment of COMP308 in ECS,
+// Victoria University of Wellington, without any express or implied warranty. 
+// In no event will the authors be held liable for any damages arising from
+// the use of this software.
+//
+// The contents of this file may not be copied or duplicated in any form
+// without the prior permission of its owner.
+//
+//----------------------------------------------------------------------------
+
+//----------------------------------------------------------------------------
+//
+// Camera
+//
+// Holds the view and projection matrices for a frame, built on the CPU with
+// cgra::mat4 rather than on the GL matrix stack. They are computed once per
+// frame and passed to shaders as uniforms, so nothing has to be read back
+// from the driver, and the same matrices are available for culling.
+//
+// Matrices are column-major, as OpenGL expects, so dataPointer() can be
+// passed straight to glUniformMatrix4fv.
+//
+//----------------------------------------------------------------------------
+
+#pragma once
+
+#include "cgra_math.hpp"
+
+namespace cgra {
+
+	class camera {
+	private:
+		mat4 m_proj { 1 };
+		mat4 m_proj_inv { 1 };
+		mat4 m_view { 1 };
+		float m_znear = 0.1f;
+		float m_zfar = 1000.f;
+
+	public:
+		// fovy in degrees, aspect is w/h
+		void setPerspective(float fovy, float aspect, float znear, float zfar) {
+			m_proj = mat4::perspectiveProjection(radians(fovy), aspect, znear, zfar);
+			m_proj_inv = inverse(m_proj);
+			m_znear = znear;
+			m_zfar = zfar;
+		}
+
+		void setView(const mat4 &view) { m_view = view; }
+
+		// View for a camera orbiting the origin at a distance, angles in degrees
+		// Same as glTranslatef(0, 0, -distance), glRotatef(pitch, 1, 0, 0),
+		// glRotatef(yaw, 0, 1, 0)
+		void setOrbit(float pitch, float yaw, float distance) {
+			m_view = mat4::translate(0, 0, -distance) * mat4::rotateX(radians(pitch)) * mat4::rotateY(radians(yaw));
+		}
+
+		const mat4 & projection() const { return m_proj; }
+		const mat4 & projectionInverse() const { return m_proj_inv; }
+		const mat4 & view() const { return m_view; }
+		float nearPlane() const { return m_znear; }
+		float farPlane() const { return m_zfar; }
+
+		mat4 modelView(const mat4 &model) const { return m_view * model; }
+
+		// Matrix for transforming normals by a model-view matrix
+		static mat3 normalMatrix(const mat4 &model_view) {
+			mat3 m { vec3(model_view[0]), vec3(model_view[1]), vec3(model_view[2]) };
+			return transpose(inverse(m));
+		}
+	};
+}
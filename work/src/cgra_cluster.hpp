@@ -0,0 +1,215 @@
+//---------------------------------------------------------------------------
+//
+// Copyright (c) 2016 Taehyun Rhee, Joshua Scott, Ben Allen
+//
+// This software is provided 'as-is' for assignment of COMP308 in ECS,
+// Victoria University of Wellington, without any express or implied warranty. 
+// In no event will the authors be held liable for any damages arising from
+// the use of this software.
+//
+// The contents of this file may not be copied or duplicated in any form
+// without the prior permission of its owner.
+//
+//----------------------------------------------------------------------------
+
+//----------------------------------------------------------------------------
+//
+// Clustered light assignment
+//
+// Divides the view frustum into a grid of clusters: tiles_x by tiles_y screen
+// tiles, each cut into depth slices that are spaced exponentially between a
+// near and far depth (anything past the far depth falls in the last slice).
+// Each light, given as a view-space sphere, is appended to every cluster its
+// bounds overlap. The result is a flat list of light indices plus an
+// (offset, count) range for each cluster, ready to upload as textures.
+//
+// There is one extra layer of clusters after the last slice: the 'column'
+// of each tile, holding every light that overlaps the tile at any depth.
+// Effects that integrate along the whole view ray (like in-scattering) need
+// this, not just the lights near the surface.
+//
+// This has no OpenGL dependency so it can be driven and checked on its own.
+//
+//----------------------------------------------------------------------------
+
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <vector>
+
+#include "cgra_math.hpp"
+
+namespace cgra {
+
+	class light_cluster_grid {
+	private:
+		// inclusive cluster bounds of a single light
+		struct light_bounds {
+			int x0, x1, y0, y1, s0, s1;
+		};
+
+		ivec3 m_dims;
+		float m_znear = 0.1f;
+		float m_zfar = 1000.f;
+		float m_slice_scale = 0;
+
+		std::vector<light_bounds> m_bounds;
+		std::vector<uvec2> m_ranges; // (offset, count) per cluster
+		std::vector<unsigned> m_indices;
+
+	public:
+		light_cluster_grid(int tiles_x = 16, int tiles_y = 9, int slices = 24) : m_dims(tiles_x, tiles_y, slices) {
+			assert(tiles_x > 0 && tiles_y > 0 && slices > 0);
+			m_ranges.resize(clusterCount());
+			setDepthRange(m_znear, m_zfar);
+		}
+
+		// depths are positive distances in front of the viewer
+		void setDepthRange(float znear, float zfar) {
+			assert(znear > 0 && zfar > znear);
+			m_znear = znear;
+			m_zfar = zfar;
+			m_slice_scale = m_dims.z / std::log(zfar / znear);
+		}
+
+		// (tiles_x, tiles_y, slices), not counting the column layer
+		ivec3 dimensions() const { return m_dims; }
+
+		float nearDepth() const { return m_znear; }
+
+		// multiply log(depth / near) by this to get the slice
+		float sliceScale() const { return m_slice_scale; }
+
+		// number of clusters including the column layer
+		int clusterCount() const { return m_dims.x * m_dims.y * (m_dims.z + 1); }
+
+		int sliceIndex(float depth) const {
+			if (depth <= m_znear) return 0;
+			int s = int(std::floor(std::log(depth / m_znear) * m_slice_scale));
+			return std::min(s, m_dims.z - 1);
+		}
+
+		// slice == dimensions().z gives the column of the tile
+		int clusterIndex(int x, int y, int slice) const {
+			assert(x >= 0 && x < m_dims.x && y >= 0 && y < m_dims.y && slice >= 0 && slice <= m_dims.z);
+			return (slice * m_dims.y + y) * m_dims.x + x;
+		}
+
+		// (offset, count) into indices() for every cluster, laid out as
+		// tiles_x wide by tiles_y * (slices + 1) high
+		const std::vector<uvec2> & ranges() const { return m_ranges; }
+
+		const std::vector<unsigned> & indices() const { return m_indices; }
+
+		// the light indices assigned to one cluster
+		std::vector<unsigned> lightsInCluster(int x, int y, int slice) const {
+			uvec2 r = m_ranges[clusterIndex(x, y, slice)];
+			return std::vector<unsigned>(m_indices.begin() + r.x, m_indices.begin() + r.x + r.y);
+		}
+
+
+		// Assigns count lights to clusters. pos_v are view-space positions (the
+		// viewer looks down -z), radius is how far each light's influence reaches,
+		// and proj is the projection matrix used to render the view.
+		// Storage is reused between calls so steady-state builds don't allocate.
+		void build(const mat4 &proj, const vec3 *pos_v, const float *radius, size_t count) {
+			m_bounds.clear();
+			std::fill(m_ranges.begin(), m_ranges.end(), uvec2(0, 0));
+
+			// find the cluster range each light covers and count the
+			// number of lights in every cluster
+			for (size_t i = 0; i < count; ++i) {
+				light_bounds b;
+				if (!lightBounds(proj, pos_v[i], radius[i], b)) {
+					b = light_bounds { 1, 0, 1, 0, 1, 0 }; // empty
+				} else {
+					for (int y = b.y0; y <= b.y1; ++y) {
+						for (int x = b.x0; x <= b.x1; ++x) {
+							for (int s = b.s0; s <= b.s1; ++s) {
+								m_ranges[clusterIndex(x, y, s)].y++;
+							}
+							m_ranges[clusterIndex(x, y, m_dims.z)].y++;
+						}
+					}
+				}
+				m_bounds.push_back(b);
+			}
+
+			// prefix sum the counts into offsets
+			unsigned total = 0;
+			for (uvec2 &r : m_ranges) {
+				r.x = total;
+				total += r.y;
+				r.y = 0;
+			}
+			m_indices.resize(total);
+
+			// fill in the light indices, in ascending order per cluster
+			for (size_t i = 0; i < count; ++i) {
+				const light_bounds &b = m_bounds[i];
+				for (int y = b.y0; y <= b.y1; ++y) {
+					for (int x = b.x0; x <= b.x1; ++x) {
+						for (int s = b.s0; s <= b.s1; ++s) {
+							uvec2 &r = m_ranges[clusterIndex(x, y, s)];
+							m_indices[r.x + r.y++] = unsigned(i);
+						}
+						uvec2 &r = m_ranges[clusterIndex(x, y, m_dims.z)];
+						m_indices[r.x + r.y++] = unsigned(i);
+					}
+				}
+			}
+		}
+
+	private:
+		// Conservative cluster bounds of a sphere, false if it can't be seen
+		bool lightBounds(const mat4 &proj, const vec3 &c, float r, light_bounds &b) const {
+			float dmin = -c.z - r;
+			float dmax = -c.z + r;
+
+			// entirely behind the near plane
+			if (dmax < m_znear) return false;
+
+			b.s0 = sliceIndex(dmin);
+			b.s1 = sliceIndex(dmax);
+
+			// crossing the near plane, assume it covers the whole screen
+			if (dmin <= m_znear) {
+				b.x0 = 0; b.x1 = m_dims.x - 1;
+				b.y0 = 0; b.y1 = m_dims.y - 1;
+				return true;
+			}
+
+			// project the corners of the sphere's bounding box, which is
+			// entirely in front of the viewer, and take their 2D bounds
+			vec2 ndc_min(inf<float>()), ndc_max(-inf<float>());
+			for (int k = 0; k < 8; ++k) {
+				vec4 corner(
+					c.x + ((k & 1) ? r : -r),
+					c.y + ((k & 2) ? r : -r),
+					c.z + ((k & 4) ? r : -r),
+					1);
+				vec4 p = proj * corner;
+				vec2 ndc(p.x / p.w, p.y / p.w);
+				ndc_min = min(ndc_min, ndc);
+				ndc_max = max(ndc_max, ndc);
+			}
+
+			// off screen
+			if (ndc_max.x < -1 || ndc_max.y < -1 || ndc_min.x > 1 || ndc_min.y > 1) return false;
+
+			// ndc to tile coordinates
+			b.x0 = tileIndex(ndc_min.x, m_dims.x);
+			b.x1 = tileIndex(ndc_max.x, m_dims.x);
+			b.y0 = tileIndex(ndc_min.y, m_dims.y);
+			b.y1 = tileIndex(ndc_max.y, m_dims.y);
+			return true;
+		}
+
+		static int tileIndex(float ndc, int tiles) {
+			int t = int(std::floor((ndc * 0.5f + 0.5f) * tiles));
+			return std::max(0, std::min(t, tiles - 1));
+		}
+	};
+}
@@ -0,0 +1,94 @@
+//---------------------------------------------------------------------------
+//
+// Copyright (c) 2016 Taehyun Rhee, Joshua Scott, Ben Allen
+//
+// This software is provided 'as-is' for assignment of COMP308 in ECS,
+// Victoria University of Wellington, without any express or implied warranty. 
+// In no event will the authors be held liable for any damages arising from
+// the use of this software.
+//
+// The contents of this file may not be copied or duplicated in any form
+// without the prior permission of its owner.
+//
+//----------------------------------------------------------------------------
+
+//----------------------------------------------------------------------------
+//
+// Sorted draw lists
+//
+// Each draw is a 64 bit key and the index of whatever it draws. Sorting by
+// key groups draws by program, then material, then mesh, then front to back
+// depth, so whoever submits the list only has to change state at the
+// boundaries between groups:
+//
+//   63     60 59          40 39          20 19           0
+//   | program |  material   |    mesh     |    depth     |
+//
+// The submitter tracks what is bound and counts the changes it makes in
+// draw_list_stats, which should grow with the number of distinct programs,
+// materials and meshes, not with the number of draws.
+//
+//----------------------------------------------------------------------------
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+namespace cgra {
+
+	// State changes made submitting a draw list, reset every frame
+	struct draw_list_stats {
+		int draws = 0;
+		int program_changes = 0;
+		int material_changes = 0;
+		int mesh_changes = 0;
+	};
+
+
+	class draw_list {
+	public:
+		static const int program_bits = 4;
+		static const int material_bits = 20;
+		static const int mesh_bits = 20;
+		static const int depth_bits = 20;
+
+		struct item {
+			uint64_t key;
+			uint32_t index;
+
+			bool operator<(const item &other) const {
+				return key < other.key || (key == other.key && index < other.index);
+			}
+		};
+
+	private:
+		std::vector<item> m_items;
+
+	public:
+		// depth is in [0, 1], nearest first, and is quantized
+		// Ids past the end of their field wrap, which only costs extra
+		// state changes
+		static uint64_t makeKey(uint32_t program, uint32_t material, uint32_t mesh, float depth) {
+			const uint32_t max_depth = (1u << depth_bits) - 1;
+			uint64_t d = uint64_t(std::min(std::max(depth, 0.f), 1.f) * max_depth);
+			return (uint64_t(program & ((1u << program_bits) - 1)) << (depth_bits + mesh_bits + material_bits))
+				| (uint64_t(material & ((1u << material_bits) - 1)) << (depth_bits + mesh_bits))
+				| (uint64_t(mesh & ((1u << mesh_bits) - 1)) << depth_bits)
+				| d;
+		}
+
+		// The allocation is kept, so a list rebuilt every frame only
+		// allocates when it grows
+		void clear() { m_items.clear(); }
+
+		void add(uint64_t key, uint32_t index) { m_items.push_back({ key, index }); }
+
+		void sort() { std::sort(m_items.begin(), m_items.end()); }
+
+		const std::vector<item> & items() const { return m_items; }
+
+		size_t size() const { return m_items.size(); }
+	};
+}
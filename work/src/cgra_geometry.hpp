@@ -14,38 +14,151 @@
 
 #pragma once
 
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <limits>
+#include <map>
+#include <tuple>
+#include <vector>
+
 #include "cgra_math.hpp"
+#include "cgra_raster.hpp"
+#include "cgra_vertex_cache.hpp"
 #include "opengl.hpp"
 
 namespace cgra {
 
-	inline void cgraSphere(float radius, int slices = 10, int stacks = 10, bool wire = false) {
-		assert(slices > 0 && stacks > 0 && radius > 0);
+	// Interleaved vertex format shared by every generated mesh
+	struct mesh_vertex {
+		vec3 pos;
+		vec3 norm;
+		vec2 uv;
+	};
 
-		// set wire mode if needed
-		if (wire) glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
-		else glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+	// Axis aligned bounding box, empty (min > max) by default
+	struct aabb {
+		vec3 min { std::numeric_limits<float>::infinity() };
+		vec3 max { -std::numeric_limits<float>::infinity() };
+
+		vec3 center() const { return (min + max) * 0.5f; }
+		vec3 halfSize() const { return (max - min) * 0.5f; }
+
+		void extend(const aabb &other) {
+			min = vec3(std::min(min.x, other.min.x), std::min(min.y, other.min.y), std::min(min.z, other.min.z));
+			max = vec3(std::max(max.x, other.max.x), std::max(max.y, other.max.y), std::max(max.z, other.max.z));
+		}
+	};
+
+	// Bounds of a transformed box, the box around the transformed box
+	// (Arvo's method, as the extent along each axis is a sum of the
+	// transformed half size vectors)
+	inline aabb transformBounds(const aabb &b, const mat4 &m) {
+		vec3 c = b.center(), h = b.halfSize();
+		vec3 tc(m * vec4(c, 1));
+		vec3 th;
+		for (int i = 0; i < 3; ++i) {
+			th[i] = std::abs(m[0][i]) * h.x + std::abs(m[1][i]) * h.y + std::abs(m[2][i]) * h.z;
+		}
+		aabb r;
+		r.min = tc - th;
+		r.max = tc + th;
+		return r;
+	}
+
+
+	// CPU side mesh, indexed triangle list
+	struct mesh_data {
+		std::vector<mesh_vertex> vertices;
+		std::vector<GLuint> indices;
+	};
+
+	// GPU side mesh, owns a VBO, IBO and the VAO that binds them for the
+	// lifetime of the program
+	struct gl_mesh {
+		GLuint vao = 0;
+		GLuint vbo = 0;
+		GLuint ibo = 0;
+		GLsizei index_count = 0;
+	};
+
+	// Running totals for the mesh cache. After the first frame builds and
+	// trig_calls should stay constant; only draws should keep increasing.
+	struct mesh_stats {
+		unsigned long long builds = 0;     // meshes generated and uploaded (the only heap allocations)
+		unsigned long long trig_calls = 0; // sin/cos/atan evaluations during generation
+		unsigned long long draws = 0;      // indexed draw calls issued, instanced or not
+		unsigned long long instances = 0;  // meshes drawn by instanced draw calls
+		unsigned long long triangles = 0;  // triangles submitted, counting every instance
+
+		// Simulated vertex cache misses for every mesh built, as generated and
+		// after optimizeVertexCache (see cgra_vertex_cache.hpp), over its triangles
+		unsigned long long cache_misses_generated = 0;
+		unsigned long long cache_misses = 0;
+		unsigned long long triangles_built = 0;
+
+		double acmrGenerated() const { return triangles_built ? double(cache_misses_generated) / triangles_built : 0; }
+		double acmr() const { return triangles_built ? double(cache_misses) / triangles_built : 0; }
+	};
+
+
+	// Per instance data for instanced_mesh, a uniform scale and position
+	// applied to the mesh's vertices, and a colour
+	struct mesh_instance {
+		vec4 pos_scale;
+		vec4 color;
+	};
+
+	// Vertex attributes the instance data is bound to
+	// Shaders must bind their instance attributes to these before linking.
+	// 6 and 7 don't alias any fixed-function attribute on any driver
+	const GLuint instance_pos_scale_attrib = 6;
+	const GLuint instance_color_attrib = 7;
+
+
+	namespace detail {
+
+		// Appends the triangles of a strip between two rows of vertices,
+		// with the same winding glBegin(GL_TRIANGLE_STRIP) would produce
+		inline void appendStripTriangles(std::vector<GLuint> &indices, GLuint high_row, GLuint low_row, int count) {
+			for (int i = 0; i < count - 1; ++i) {
+				GLuint h0 = high_row + i, h1 = h0 + 1;
+				GLuint l0 = low_row + i, l1 = l0 + 1;
+				indices.insert(indices.end(), { h0, l0, h1 });
+				indices.insert(indices.end(), { h1, l0, l1 });
+			}
+		}
+
+		// Appends the triangles of a fan around center over count rim vertices
+		inline void appendFanTriangles(std::vector<GLuint> &indices, GLuint center, GLuint rim, int count) {
+			for (int i = 0; i < count - 1; ++i) {
+				indices.insert(indices.end(), { center, rim + i, rim + i + 1 });
+			}
+		}
+	}
+
+
+	inline mesh_data sphereMeshData(float radius, int slices = 10, int stacks = 10, unsigned long long *trig_calls = nullptr) {
+		assert(slices > 0 && stacks > 0 && radius > 0);
 
 		int dualslices = slices * 2;
+		int row = dualslices + 1;
 
 		// precompute sin/cos values for the range of phi
-		std::vector<float> u_texture_vector;
-		std::vector<float> sin_phi_vector;
-		std::vector<float> cos_phi_vector;
+		std::vector<float> sin_phi_vector(row);
+		std::vector<float> cos_phi_vector(row);
 
 		for (int slice_count = 0; slice_count <= dualslices; ++slice_count) {
 			float u = float(slice_count) / dualslices;
-			u_texture_vector.push_back(u);
-
 			float phi = 2 * math::pi() * u;
-			sin_phi_vector.push_back(std::sin(phi));
-			cos_phi_vector.push_back(std::cos(phi));
+			sin_phi_vector[slice_count] = std::sin(phi);
+			cos_phi_vector[slice_count] = std::cos(phi);
 		}
 
-
-		// precompute the normalized coordinates of sphere
-		std::vector<vec3> verts;
-		std::vector<vec2> uvs;
+		// compute the normalized coordinates of sphere
+		mesh_data mesh;
+		mesh.vertices.reserve(row * (stacks + 1));
+		mesh.indices.reserve(6 * dualslices * stacks);
 
 		for (int stack_count = 0; stack_count <= stacks; ++stack_count) {
 			float v = float(stack_count) / stacks;
@@ -54,155 +167,493 @@ namespace cgra {
 			float cos_theta = std::cos(theta);
 
 			for (int slice_count = 0; slice_count <= dualslices; ++slice_count) {
-				uvs.push_back(vec2(u_texture_vector[slice_count], v));
-				verts.push_back(vec3(
+				vec3 n(
 					sin_theta*cos_phi_vector[slice_count],
 					sin_theta*sin_phi_vector[slice_count],
-					cos_theta));
+					cos_theta);
+				mesh.vertices.push_back({ n * radius, n, vec2(float(slice_count) / dualslices, v) });
 			}
 		}
 
-		// use triangle strips to display each stack of the sphere
+		// one strip's worth of triangles between each pair of stacks
 		for (int stack_count = 0; stack_count < stacks; ++stack_count) {
-			glBegin(GL_TRIANGLE_STRIP);
-
-			for (int slice_count = 0; slice_count <= dualslices; ++slice_count) {
-
-				vec2 &th = uvs[slice_count + stack_count*(dualslices + 1)];
-				vec2 &tl = uvs[slice_count + (stack_count + 1)*(dualslices + 1)];
-
-				vec3 &nh = verts[slice_count + stack_count*(dualslices + 1)];
-				vec3 &nl = verts[slice_count + (stack_count + 1)*(dualslices + 1)];
-
-				vec3 ph = nh*radius;
-				vec3 pl = nl*radius;
-
-				glTexCoord2f(th.x, th.y);
-				glNormal3f(nh.x, nh.y, nh.z);
-				glVertex3f(ph.x, ph.y, ph.z);
-
-				glTexCoord2f(tl.x, tl.y);
-				glNormal3f(nl.x, nl.y, nl.z);
-				glVertex3f(pl.x, pl.y, pl.z);
-			}
-
-			glEnd();
+			detail::appendStripTriangles(mesh.indices, stack_count * row, (stack_count + 1) * row, row);
 		}
 
-		// reset mode
-		glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+		if (trig_calls) *trig_calls += 2 * (dualslices + 1) + 2 * (stacks + 1);
+		return mesh;
 	}
 
 
-	inline void cgraCylinder(float base_radius, float top_radius, float height, int slices = 10, int stacks = 10, bool wire = false) {
-		assert(slices > 0 && stacks > 0 && (base_radius > 0 || base_radius > 0) && height > 0);
-
-		// set wire mode if needed
-		if (wire) glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
-		else glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+	inline mesh_data cylinderMeshData(float base_radius, float top_radius, float height, int slices = 10, int stacks = 10, unsigned long long *trig_calls = nullptr) {
+		assert(slices > 0 && stacks > 0 && (base_radius > 0 || top_radius > 0) && height > 0);
 
 		int dualslices = slices * 2;
+		int row = dualslices + 1;
 
 		// precompute sin/cos values for the range of phi
-		std::vector<float> u_texture_vector;
-		std::vector<float> sin_phi_vector;
-		std::vector<float> cos_phi_vector;
+		std::vector<float> sin_phi_vector(row);
+		std::vector<float> cos_phi_vector(row);
 
 		for (int slice_count = 0; slice_count <= dualslices; ++slice_count) {
 			float u = float(slice_count) / dualslices;
-			u_texture_vector.push_back(u);
-
 			float phi = 2 * math::pi() * u;
-			sin_phi_vector.push_back(std::sin(phi));
-			cos_phi_vector.push_back(std::cos(phi));
+			sin_phi_vector[slice_count] = std::sin(phi);
+			cos_phi_vector[slice_count] = std::cos(phi);
 		}
 
-
-		// precompute the coordinates and normals of cylinder
-		std::vector<vec3> verts;
-		std::vector<vec3> norms;
-		std::vector<vec2> uvs;
-
 		// thanks ben, you shall forever be immortalized
 		float bens_theta = math::pi() / 2 * std::atan((base_radius - top_radius) / height);
 		float sin_bens_theta = std::sin(bens_theta);
 		float cos_bens_theta = std::cos(bens_theta);
 
+		// compute the coordinates and normals of cylinder
+		mesh_data mesh;
+		mesh.vertices.reserve(row * (stacks + 3) + 2);
+		mesh.indices.reserve(6 * dualslices * stacks + 6 * dualslices);
+
 		for (int stack_count = 0; stack_count <= stacks; ++stack_count) {
 			float t = float(stack_count) / stacks;
 			float z = height * t;
 			float width = base_radius + (top_radius - base_radius) * t;
 
 			for (int slice_count = 0; slice_count <= dualslices; ++slice_count) {
-
-				verts.push_back(vec3(
+				vec3 p(
 					width * cos_phi_vector[slice_count],
 					width * sin_phi_vector[slice_count],
-					z));
-
-				norms.push_back(vec3(
+					z);
+				vec3 n(
 					cos_bens_theta * cos_phi_vector[slice_count],
 					cos_bens_theta * sin_phi_vector[slice_count],
-					sin_bens_theta));
-
-				uvs.push_back(vec2(u_texture_vector[slice_count], t));
+					sin_bens_theta);
+				mesh.vertices.push_back({ p, n, vec2(float(slice_count) / dualslices, t) });
 			}
 		}
 
-		// use triangle strips to display each stack of the cylinder
+		// one strip's worth of triangles between each pair of stacks
 		for (int stack_count = 0; stack_count < stacks; ++stack_count) {
-			glBegin(GL_TRIANGLE_STRIP);
+			detail::appendStripTriangles(mesh.indices, stack_count * row, (stack_count + 1) * row, row);
+		}
 
+		// cap off the top and bottom of the cylinder
+		// caps need their own vertices as they have a flat normal
+		if (base_radius > 0) {
+			GLuint center = GLuint(mesh.vertices.size());
+			mesh.vertices.push_back({ vec3(0, 0, 0), vec3(0, 0, -1), vec2(0, 0) });
 			for (int slice_count = 0; slice_count <= dualslices; ++slice_count) {
+				mesh.vertices.push_back({ mesh.vertices[slice_count].pos, vec3(0, 0, -1), vec2(0, 0) });
+			}
+			detail::appendFanTriangles(mesh.indices, center, center + 1, row);
+		}
 
-				vec2 &th = uvs[slice_count + stack_count*(dualslices + 1)];
-				vec2 &tl = uvs[slice_count + (stack_count + 1)*(dualslices + 1)];
+		if (top_radius > 0) {
+			GLuint center = GLuint(mesh.vertices.size());
+			mesh.vertices.push_back({ vec3(0, 0, height), vec3(0, 0, 1), vec2(1, 1) });
+			for (int slice_count = dualslices; slice_count >= 0; --slice_count) {
+				mesh.vertices.push_back({ mesh.vertices[slice_count + stacks * row].pos, vec3(0, 0, 1), vec2(1, 1) });
+			}
+			detail::appendFanTriangles(mesh.indices, center, center + 1, row);
+		}
 
-				vec3 &ph = verts[slice_count + stack_count*(dualslices + 1)];
-				vec3 &pl = verts[slice_count + (stack_count + 1)*(dualslices + 1)];
+		if (trig_calls) *trig_calls += 2 * (dualslices + 1) + 3;
+		return mesh;
+	}
 
-				vec3 &nh = norms[slice_count + stack_count*(dualslices + 1)];
-				vec3 &nl = norms[slice_count + (stack_count + 1)*(dualslices + 1)];
 
-				glTexCoord2f(th.x, th.y);
-				glNormal3f(nh.x, nh.y, nh.z);
-				glVertex3f(ph.x, ph.y, ph.z);
+	// Square in the xz plane facing +y, with the same triangles the floor
+	// used to be drawn with in immediate mode
+	inline mesh_data planeMeshData(float half_size) {
+		assert(half_size > 0);
+		float s = half_size;
+		mesh_data mesh;
+		mesh.vertices = {
+			{ vec3(-s, 0, -s), vec3(0, 1, 0), vec2(0, 0) },
+			{ vec3( s, 0, -s), vec3(0, 1, 0), vec2(1, 0) },
+			{ vec3(-s, 0,  s), vec3(0, 1, 0), vec2(0, 1) },
+			{ vec3( s, 0,  s), vec3(0, 1, 0), vec2(1, 1) },
+		};
+		mesh.indices = { 0, 1, 2, 1, 3, 2 };
+		return mesh;
+	}
+
+
+	// Single triangle that covers clip space from -1 to 1, for screen space
+	// passes. One triangle rather than a quad avoids shading the pixels
+	// along the diagonal twice
+	inline mesh_data screenTriangleMeshData() {
+		mesh_data mesh;
+		mesh.vertices = {
+			{ vec3(-1, -1, 0), vec3(0, 0, 1), vec2(0, 0) },
+			{ vec3( 3, -1, 0), vec3(0, 0, 1), vec2(2, 0) },
+			{ vec3(-1,  3, 0), vec3(0, 0, 1), vec2(0, 2) },
+		};
+		mesh.indices = { 0, 1, 2 };
+		return mesh;
+	}
+
+
+	// Uploads mesh data into a new static VBO/IBO pair, and a VAO that
+	// binds them to the fixed-function vertex arrays (gl_Vertex, gl_Normal,
+	// gl_MultiTexCoord0), which the compatibility profile keeps in the VAO
+	inline gl_mesh uploadMesh(const mesh_data &data) {
+		gl_mesh mesh;
+		glGenVertexArrays(1, &mesh.vao);
+		glGenBuffers(1, &mesh.vbo);
+		glGenBuffers(1, &mesh.ibo);
+
+		glBindVertexArray(mesh.vao);
+
+		glBindBuffer(GL_ARRAY_BUFFER, mesh.vbo);
+		glBufferData(GL_ARRAY_BUFFER, data.vertices.size() * sizeof(mesh_vertex), &data.vertices[0], GL_STATIC_DRAW);
+
+		glEnableClientState(GL_VERTEX_ARRAY);
+		glEnableClientState(GL_NORMAL_ARRAY);
+		glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+		glVertexPointer(3, GL_FLOAT, sizeof(mesh_vertex), (void *) offsetof(mesh_vertex, pos));
+		glNormalPointer(GL_FLOAT, sizeof(mesh_vertex), (void *) offsetof(mesh_vertex, norm));
+		glTexCoordPointer(2, GL_FLOAT, sizeof(mesh_vertex), (void *) offsetof(mesh_vertex, uv));
 
-				glTexCoord2f(tl.x, tl.y);
-				glNormal3f(nl.x, nl.y, nl.z);
-				glVertex3f(pl.x, pl.y, pl.z);
+		// the index buffer binding is part of the VAO
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.ibo);
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, data.indices.size() * sizeof(GLuint), &data.indices[0], GL_STATIC_DRAW);
+
+		glBindVertexArray(0);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+		mesh.index_count = GLsizei(data.indices.size());
+		return mesh;
+	}
+
+
+	// Draws a mesh with a single indexed call
+	inline void drawMesh(const gl_mesh &mesh) {
+		glBindVertexArray(mesh.vao);
+		glDrawElements(GL_TRIANGLES, mesh.index_count, GL_UNSIGNED_INT, nullptr);
+		glBindVertexArray(0);
+	}
+
+
+	// A mesh drawn many times with one glDrawElementsInstanced call, with
+	// mesh_instance data per instance from its own buffer. It has its own
+	// VAO binding the mesh's buffers and the instance buffer together.
+	// The mesh must outlive it, which cached meshes do.
+	// Nothing touches GL until setMesh(), so it can be a global.
+	class instanced_mesh {
+	private:
+		const gl_mesh *m_mesh = nullptr;
+		GLuint m_vao = 0;
+		GLuint m_instance_vbo = 0;
+		GLsizei m_count = 0;
+
+	public:
+		instanced_mesh() { }
+
+		instanced_mesh(const instanced_mesh &) = delete;
+		instanced_mesh & operator=(const instanced_mesh &) = delete;
+
+		void setMesh(const gl_mesh &mesh) {
+			if (&mesh == m_mesh) return;
+			m_mesh = &mesh;
+
+			if (!m_vao) glGenVertexArrays(1, &m_vao);
+			if (!m_instance_vbo) glGenBuffers(1, &m_instance_vbo);
+
+			glBindVertexArray(m_vao);
+
+			glBindBuffer(GL_ARRAY_BUFFER, mesh.vbo);
+			glEnableClientState(GL_VERTEX_ARRAY);
+			glEnableClientState(GL_NORMAL_ARRAY);
+			glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+			glVertexPointer(3, GL_FLOAT, sizeof(mesh_vertex), (void *) offsetof(mesh_vertex, pos));
+			glNormalPointer(GL_FLOAT, sizeof(mesh_vertex), (void *) offsetof(mesh_vertex, norm));
+			glTexCoordPointer(2, GL_FLOAT, sizeof(mesh_vertex), (void *) offsetof(mesh_vertex, uv));
+			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.ibo);
+
+			glBindBuffer(GL_ARRAY_BUFFER, m_instance_vbo);
+			glEnableVertexAttribArray(instance_pos_scale_attrib);
+			glEnableVertexAttribArray(instance_color_attrib);
+			glVertexAttribPointer(instance_pos_scale_attrib, 4, GL_FLOAT, GL_FALSE, sizeof(mesh_instance), (void *) offsetof(mesh_instance, pos_scale));
+			glVertexAttribPointer(instance_color_attrib, 4, GL_FLOAT, GL_FALSE, sizeof(mesh_instance), (void *) offsetof(mesh_instance, color));
+			glVertexAttribDivisor(instance_pos_scale_attrib, 1);
+			glVertexAttribDivisor(instance_color_attrib, 1);
+
+			glBindVertexArray(0);
+			glBindBuffer(GL_ARRAY_BUFFER, 0);
+		}
+
+		// Replaces the instances, reallocating the buffer every time so the
+		// driver doesn't have to wait for draws still using the old data
+		void upload(const mesh_instance *instances, size_t count) {
+			glBindBuffer(GL_ARRAY_BUFFER, m_instance_vbo);
+			glBufferData(GL_ARRAY_BUFFER, count * sizeof(mesh_instance), instances, GL_STREAM_DRAW);
+			glBindBuffer(GL_ARRAY_BUFFER, 0);
+			m_count = GLsizei(count);
+		}
+
+		GLsizei count() const { return m_count; }
+
+		// Triangles per instance
+		GLsizei triangleCount() const { return m_mesh ? m_mesh->index_count / 3 : 0; }
+
+		void draw() const {
+			if (!m_mesh || m_count == 0) return;
+			glBindVertexArray(m_vao);
+			glDrawElementsInstanced(GL_TRIANGLES, m_mesh->index_count, GL_UNSIGNED_INT, nullptr, m_count);
+			glBindVertexArray(0);
+		}
+	};
+
+
+	// Meshes are generated and uploaded the first time a shape with a given
+	// set of parameters is requested, and reused for every draw after that.
+	// Lookups don't allocate, so steady-state frames do no generation work.
+	class mesh_cache {
+	public:
+		enum class shape { sphere, cylinder, plane, screen_triangle };
+
+		struct key {
+			shape s;
+			float radius0, radius1, height;
+			int slices, stacks;
+
+			bool operator<(const key &other) const {
+				return std::tie(s, radius0, radius1, height, slices, stacks)
+					< std::tie(other.s, other.radius0, other.radius1, other.height, other.slices, other.stacks);
 			}
+		};
+
+	private:
+		std::map<key, gl_mesh> m_meshes;
+		mesh_stats m_stats;
+
+		// Reorders a new mesh's triangles for the vertex cache, counting
+		// the simulated misses before and after, and uploads it
+		gl_mesh build(mesh_data data) {
+			size_t vertex_count = data.vertices.size();
+			m_stats.cache_misses_generated += vertexCacheMisses(data.indices, vertex_count);
+			optimizeVertexCache(data.indices, vertex_count);
+			m_stats.cache_misses += vertexCacheMisses(data.indices, vertex_count);
+			m_stats.triangles_built += data.indices.size() / 3;
+			m_stats.builds++;
+			return uploadMesh(data);
+		}
 
-			glEnd();
+	public:
+		const gl_mesh & sphere(float radius, int slices, int stacks) {
+			key k { shape::sphere, radius, 0, 0, slices, stacks };
+			auto it = m_meshes.find(k);
+			if (it == m_meshes.end()) {
+				it = m_meshes.emplace(k, build(sphereMeshData(radius, slices, stacks, &m_stats.trig_calls))).first;
+			}
+			return it->second;
 		}
 
-		// cap off the top and bottom of the cylinder
-		if (base_radius > 0) {
-			glBegin(GL_TRIANGLE_FAN);
-			glTexCoord2f(0, 0);
-			glNormal3f(0, 0, -1);
-			glVertex3f(0, 0, 0);
+		const gl_mesh & cylinder(float base_radius, float top_radius, float height, int slices, int stacks) {
+			key k { shape::cylinder, base_radius, top_radius, height, slices, stacks };
+			auto it = m_meshes.find(k);
+			if (it == m_meshes.end()) {
+				it = m_meshes.emplace(k, build(cylinderMeshData(base_radius, top_radius, height, slices, stacks, &m_stats.trig_calls))).first;
+			}
+			return it->second;
+		}
 
-			for (int slice_count = 0; slice_count <= dualslices; ++slice_count) {
-				vec3 &p = verts[slice_count];
-				glVertex3f(p.x, p.y, p.z);
+		const gl_mesh & plane(float half_size) {
+			key k { shape::plane, half_size, 0, 0, 0, 0 };
+			auto it = m_meshes.find(k);
+			if (it == m_meshes.end()) {
+				it = m_meshes.emplace(k, build(planeMeshData(half_size))).first;
 			}
-			glEnd();
+			return it->second;
 		}
 
-		if (top_radius > 0) {
-			glBegin(GL_TRIANGLE_FAN);
-			glTexCoord2f(1, 1);
-			glNormal3f(0, 0, 1);
-			glVertex3f(0, 0, height);
+		const gl_mesh & screenTriangle() {
+			key k { shape::screen_triangle, 0, 0, 0, 0, 0 };
+			auto it = m_meshes.find(k);
+			if (it == m_meshes.end()) {
+				it = m_meshes.emplace(k, build(screenTriangleMeshData())).first;
+			}
+			return it->second;
+		}
 
-			for (int slice_count = dualslices; slice_count >= 0; --slice_count) {
-				vec3 &p = verts[slice_count + (stacks)*(dualslices + 1)];
-				glVertex3f(p.x, p.y, p.z);
+		// Model space bounds of the mesh a key describes, without building it
+		static aabb bounds(const key &k) {
+			aabb b;
+			switch (k.s) {
+			case shape::sphere:
+				b.min = vec3(-k.radius0);
+				b.max = vec3(k.radius0);
+				break;
+			case shape::cylinder: {
+				// along +z from the base
+				float r = std::max(k.radius0, k.radius1);
+				b.min = vec3(-r, -r, 0);
+				b.max = vec3(r, r, k.height);
+				break;
+			}
+			case shape::plane:
+				b.min = vec3(-k.radius0, 0, -k.radius0);
+				b.max = vec3(k.radius0, 0, k.radius0);
+				break;
+			default:
+				b.min = vec3(-1, -1, 0);
+				b.max = vec3(3, 3, 0);
+				break;
+			}
+			return b;
+		}
+
+		// Key for a coarser mesh of the same shape to draw as a software
+		// occluder (see cgra_raster.hpp). Its slice and stack counts divide
+		// the original's, so its vertices are a subset of the original's and
+		// (the shapes being convex) it lies inside the original
+		static key occluderKey(const key &k, int max_slices = 4, int max_stacks = 4) {
+			auto coarser = [](int n, int most) {
+				int d = std::max(1, std::min(n, most));
+				while (n % d != 0) d--;
+				return d;
+			};
+			key o = k;
+			switch (k.s) {
+			case shape::sphere:
+				o.slices = coarser(k.slices, max_slices);
+				o.stacks = coarser(k.stacks, max_stacks);
+				break;
+			case shape::cylinder:
+				// straight sides, so the rings between the ends add nothing
+				o.slices = coarser(k.slices, max_slices);
+				o.stacks = 1;
+				break;
+			default:
+				break;
+			}
+			return o;
+		}
+
+		// Key for level of detail level of a shape (see cgra_lod.hpp), with
+		// the slices and stacks halved once per level. Shapes keep at least
+		// 3 slices (a hexagonal outline) and spheres 2 stacks, but cylinders
+		// go down to 1 stack. Planes have nothing to simplify
+		static key lodKey(const key &k, int level) {
+			key o = k;
+			if (k.s != shape::sphere && k.s != shape::cylinder) return o;
+			for (int l = 0; l < level; ++l) {
+				o.slices = std::max(std::min(k.slices, 3), o.slices / 2);
+				o.stacks = std::max(std::min(k.stacks, k.s == shape::cylinder ? 1 : 2), o.stacks / 2);
 			}
-			glEnd();
+			return o;
+		}
+
+		// Scale that shrinks a shape's mesh inside all of its first levels
+		// of detail, so an occluder scaled by it stays conservative whichever
+		// level is drawn. Finer levels lie outside the coarsest one's
+		// inscribed sphere (or, for cylinders, inscribed circle on each
+		// ring), so the scale is that over the original's radius
+		static vec3 lodInset(const key &k, int levels) {
+			key c = lodKey(k, std::max(0, levels - 1));
+			float slice = math::pi() / (2 * c.slices); // half the angle between slices
+			switch (k.s) {
+			case shape::sphere: {
+				// every triangle's corners lie within the half diagonal of a quad
+				float stack = math::pi() / (2 * c.stacks);
+				return vec3(std::cos(std::sqrt(slice * slice + stack * stack)));
+			}
+			case shape::cylinder:
+				return vec3(std::cos(slice), std::cos(slice), 1);
+			default:
+				return vec3(1);
+			}
+		}
+
+		// Any shape by its key, for meshes described by data (see cgra_scene.hpp)
+		const gl_mesh & get(const key &k) {
+			switch (k.s) {
+			case shape::sphere: return sphere(k.radius0, k.slices, k.stacks);
+			case shape::cylinder: return cylinder(k.radius0, k.radius1, k.height, k.slices, k.stacks);
+			case shape::plane: return plane(k.radius0);
+			default: return screenTriangle();
+			}
+		}
+
+		void draw(const gl_mesh &mesh) {
+			drawMesh(mesh);
+			m_stats.draws++;
+			m_stats.triangles += mesh.index_count / 3;
 		}
 
+		// Draws a mesh whose VAO the caller has already bound, for draw lists
+		// that bind each mesh once for a run of draws (see cgra_draw_list.hpp)
+		void drawBound(const gl_mesh &mesh) {
+			glDrawElements(GL_TRIANGLES, mesh.index_count, GL_UNSIGNED_INT, nullptr);
+			m_stats.draws++;
+			m_stats.triangles += mesh.index_count / 3;
+		}
+
+		// Counted with the cached meshes, so the stats cover every draw
+		void draw(const instanced_mesh &mesh) {
+			if (mesh.count() == 0) return;
+			mesh.draw();
+			m_stats.draws++;
+			m_stats.instances += mesh.count();
+			m_stats.triangles += (unsigned long long) mesh.triangleCount() * mesh.count();
+		}
+
+		const mesh_stats & stats() const { return m_stats; }
+
+		size_t size() const { return m_meshes.size(); }
+	};
+
+	// Positions and indices of the mesh a key describes, for the software
+	// occlusion rasterizer. Pass it mesh_cache::occluderKey(k) for a cheap
+	// occluder that stays inside the mesh drawn for k. Positions are scaled
+	// by scale, mesh_cache::lodInset for an occluder inside every level
+	inline occluder_mesh occluderMeshData(const mesh_cache::key &k, const vec3 &scale = vec3(1)) {
+		mesh_data data;
+		switch (k.s) {
+		case mesh_cache::shape::sphere: data = sphereMeshData(k.radius0, k.slices, k.stacks); break;
+		case mesh_cache::shape::cylinder: data = cylinderMeshData(k.radius0, k.radius1, k.height, k.slices, k.stacks); break;
+		case mesh_cache::shape::plane: data = planeMeshData(k.radius0); break;
+		default: data = screenTriangleMeshData(); break;
+		}
+
+		occluder_mesh mesh;
+		for (const mesh_vertex &v : data.vertices) mesh.positions.push_back(v.pos * scale);
+		mesh.indices.assign(data.indices.begin(), data.indices.end());
+		mesh.findAdjacent();
+		return mesh;
+	}
+
+	// Global cache used by the cgraSphere/cgraCylinder/cgraCone/cgraPlane helpers
+	inline mesh_cache & meshCache() {
+		static mesh_cache cache;
+		return cache;
+	}
+
+
+	inline void cgraSphere(float radius, int slices = 10, int stacks = 10, bool wire = false) {
+		assert(slices > 0 && stacks > 0 && radius > 0);
+
+		// set wire mode if needed
+		if (wire) glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+		else glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+
+		mesh_cache &cache = meshCache();
+		cache.draw(cache.sphere(radius, slices, stacks));
+
+		// reset mode
+		glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+	}
+
+
+	inline void cgraCylinder(float base_radius, float top_radius, float height, int slices = 10, int stacks = 10, bool wire = false) {
+		assert(slices > 0 && stacks > 0 && (base_radius > 0 || top_radius > 0) && height > 0);
+
+		// set wire mode if needed
+		if (wire) glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+		else glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+
+		mesh_cache &cache = meshCache();
+		cache.draw(cache.cylinder(base_radius, top_radius, height, slices, stacks));
+
 		// reset mode
 		glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
 	}
@@ -211,4 +662,16 @@ namespace cgra {
 	inline void cgraCone(float base_radius, float height, int slices = 10, int stacks = 10, bool wire = false) {
 		cgraCylinder(base_radius, 0, height, slices, stacks, wire);
 	}
-}
\ No newline at end of file
+
+
+	inline void cgraPlane(float half_size) {
+		mesh_cache &cache = meshCache();
+		cache.draw(cache.plane(half_size));
+	}
+
+
+	inline void cgraScreenTriangle() {
+		mesh_cache &cache = meshCache();
+		cache.draw(cache.screenTriangle());
+	}
+}
@@ -0,0 +1,95 @@
+//---------------------------------------------------------------------------
+//
+// Copyright (c) 2016 Taehyun Rhee, Joshua Scott, Ben Allen
+//
+// This software is provided 'as-is' for assignment of COMP308 in ECS,
+// Victoria University of Wellington, without any express or implied warranty. 
+// In no event will the authors be held liable for any damages arising from
+// the use of this software.
+//
+// The contents of this file may not be copied or duplicated in any form
+// without the prior permission of its owner.
+//
+//----------------------------------------------------------------------------
+
+//----------------------------------------------------------------------------
+//
+// Hierarchical depth (Hi-Z) occlusion test on the CPU
+//
+// One level of the Hi-Z pyramid read back from the GPU, with the camera it
+// was rendered with. Each texel is the furthest log encoded depth over the
+// pixels it covers, so a box whose nearest point is further than every
+// texel under its screen rectangle is hidden. Texel t of level l covers
+// pixels t * 2^(l+1) onwards, the last texel in a row or column also
+// covering any pixels left over.
+//
+// The same test as HIZ_TEST_PASS in deferred_shader.frag, except that it
+// only has one, coarser, level to look at.
+//
+//----------------------------------------------------------------------------
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "cgra_geometry.hpp"
+#include "cgra_math.hpp"
+
+namespace cgra {
+
+	class hiz_buffer {
+	public:
+		int width = 0;
+		int height = 0;
+		int level = 0; // of the pyramid, level 0 being half the screen size
+		ivec2 screen_size;
+		std::vector<float> depth; // row major, bottom row first
+		mat4 view_proj { 1 };
+		float znear = 0.1f;
+		float zfar = 1000.f;
+
+		bool valid() const { return width > 0 && height > 0 && depth.size() == size_t(width) * height; }
+
+		// Same encoding as the scene shader writes, for a view depth
+		static float encodeDepth(float depth_v, float zfar) {
+			const float c = 0.01f;
+			return std::log(depth_v * c + 1) / std::log(zfar * c + 1);
+		}
+
+		// False only if the box is certainly hidden
+		bool visible(const aabb &b) const {
+			if (!valid()) return true;
+
+			vec2 uv_min(1), uv_max(0);
+			float depth_v = zfar;
+			for (int k = 0; k < 8; ++k) {
+				vec3 p((k & 1) ? b.max.x : b.min.x, (k & 2) ? b.max.y : b.min.y, (k & 4) ? b.max.z : b.min.z);
+				vec4 clip = view_proj * vec4(p, 1);
+				if (clip.w < znear) return true; // crosses the near plane
+				vec2 uv = vec2(clip.x, clip.y) / clip.w * 0.5f + 0.5f;
+				uv_min = vec2(std::min(uv_min.x, uv.x), std::min(uv_min.y, uv.y));
+				uv_max = vec2(std::max(uv_max.x, uv.x), std::max(uv_max.y, uv.y));
+				depth_v = std::min(depth_v, clip.w);
+			}
+
+			// off screen, so only frustum culling can say
+			if (uv_min.x > 1 || uv_min.y > 1 || uv_max.x < 0 || uv_max.y < 0) return true;
+
+			int shift = level + 1;
+			int x0 = std::min(std::min(int(std::max(uv_min.x, 0.f) * screen_size.x), screen_size.x - 1) >> shift, width - 1);
+			int y0 = std::min(std::min(int(std::max(uv_min.y, 0.f) * screen_size.y), screen_size.y - 1) >> shift, height - 1);
+			int x1 = std::min(std::min(int(std::min(uv_max.x, 1.f) * screen_size.x), screen_size.x - 1) >> shift, width - 1);
+			int y1 = std::min(std::min(int(std::min(uv_max.y, 1.f) * screen_size.y), screen_size.y - 1) >> shift, height - 1);
+
+			float nearest = encodeDepth(depth_v, zfar);
+			for (int y = y0; y <= y1; ++y) {
+				for (int x = x0; x <= x1; ++x) {
+					if (depth[y * width + x] >= nearest) return true;
+				}
+			}
+			return false;
+		}
+	};
+}
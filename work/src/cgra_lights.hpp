@@ -0,0 +1,258 @@
+//---------------------------------------------------------------------------
+//
+// Copyright (c) 2016 Taehyun Rhee, Joshua Scott, Ben Allen
+//
+// This software is provided 'as-is' for assignment of COMP308 in ECS,
+// Victoria University of Wellington, without any express or implied warranty. 
+// In no event will the authors be held liable for any damages arising from
+// the use of this software.
+//
+// The contents of this file may not be copied or duplicated in any form
+// without the prior permission of its owner.
+//
+//----------------------------------------------------------------------------
+
+//----------------------------------------------------------------------------
+//
+// Light state and simulation
+//
+// Lights are kept as a structure of arrays, one array per component, so the
+// simulation step can update 4 lights per SIMD instruction. Each step pushes
+// lights that have left a zone back towards it, clamps their speed to a
+// range, and moves them.
+//
+// The SIMD step does exactly the same IEEE operations in the same order as
+// stepScalar, and every light is updated independently, so a step gives
+// bit-identical results whether it runs scalar, SIMD or split over threads.
+// Together with seed() this makes runs reproducible.
+//
+//----------------------------------------------------------------------------
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <vector>
+
+#include "cgra_math.hpp"
+#include "cgra_parallel.hpp"
+
+namespace cgra {
+
+	// How the lights move
+	struct light_motion {
+		vec3 zone_min;
+		vec3 zone_max;
+		float min_speed = 0.01f;
+		float max_speed = 0.1f;
+		float accel = 0.01f; // towards the zone, per step, per axis
+	};
+
+
+	class light_store {
+	public:
+		std::vector<float> pos_x, pos_y, pos_z; // world-space position
+		std::vector<float> vel_x, vel_y, vel_z; // world-space velocity
+		std::vector<vec3> flux;
+
+	private:
+		std::default_random_engine m_rng;
+
+	public:
+		light_store() : m_rng(std::random_device()()) { }
+
+		// Makes the lights created from now on deterministic
+		void seed(unsigned s) { m_rng.seed(s); }
+
+		size_t size() const { return flux.size(); }
+
+		vec3 position(size_t i) const { return vec3(pos_x[i], pos_y[i], pos_z[i]); }
+
+		vec3 velocity(size_t i) const { return vec3(vel_x[i], vel_y[i], vel_z[i]); }
+
+		// Removes lights from the end, or adds new random ones
+		void resize(size_t n) {
+			if (n < size()) {
+				for (std::vector<float> *a : { &pos_x, &pos_y, &pos_z, &vel_x, &vel_y, &vel_z }) a->resize(n);
+				flux.resize(n);
+				return;
+			}
+
+			for (std::vector<float> *a : { &pos_x, &pos_y, &pos_z, &vel_x, &vel_y, &vel_z }) a->reserve(n);
+			flux.reserve(n);
+			while (size() < n) {
+				// creation
+				vec3 p = (randomVec3(-20, 20) + vec3(0, 20, 0)) * vec3(1, 0.3, 1);
+				vec3 f = normalize(randomVec3(0, 1));
+
+				// intial velocity
+				vec3 v = 0.01f * normalize(randomVec3(-1, 1));
+
+				pos_x.push_back(p.x); pos_y.push_back(p.y); pos_z.push_back(p.z);
+				vel_x.push_back(v.x); vel_y.push_back(v.y); vel_z.push_back(v.z);
+				flux.push_back(f);
+			}
+		}
+
+		// One simulation step, split over the pool if given and there are
+		// enough lights to make it worthwhile
+		void step(const light_motion &m, worker_pool *pool = nullptr) {
+			const size_t min_per_thread = 4096;
+			if (pool && size() >= 2 * min_per_thread) {
+				pool->parallelFor(size(), min_per_thread, [&](size_t begin, size_t end) { stepRange(m, begin, end); });
+			} else {
+				stepRange(m, 0, size());
+			}
+		}
+
+		// Reference step, one light at a time
+		void stepScalar(const light_motion &m) {
+			stepScalarRange(m, 0, size());
+		}
+
+	private:
+		vec3 randomVec3(float lower, float upper) {
+			std::uniform_real_distribution<double> dist(lower, upper);
+			float x = float(dist(m_rng));
+			float y = float(dist(m_rng));
+			float z = float(dist(m_rng));
+			return vec3(x, y, z);
+		}
+
+		void stepScalarRange(const light_motion &m, size_t begin, size_t end) {
+			for (size_t i = begin; i < end; ++i) {
+				float px = pos_x[i], py = pos_y[i], pz = pos_z[i];
+				float vx = vel_x[i], vy = vel_y[i], vz = vel_z[i];
+
+				// apply acceleration if outside zone
+				vx += (px <= m.zone_min.x ? m.accel : 0.f) - (px >= m.zone_max.x ? m.accel : 0.f);
+				vy += (py <= m.zone_min.y ? m.accel : 0.f) - (py >= m.zone_max.y ? m.accel : 0.f);
+				vz += (pz <= m.zone_min.z ? m.accel : 0.f) - (pz >= m.zone_max.z ? m.accel : 0.f);
+
+				// clamp speed to min max speed
+				float speed = std::sqrt(vx * vx + vy * vy + vz * vz);
+				if (speed == 0) {
+					vx = vy = vz = m.min_speed;
+				} else if (speed < m.min_speed) {
+					float s = m.min_speed / speed;
+					vx *= s; vy *= s; vz *= s;
+				} else if (speed > m.max_speed) {
+					float s = m.max_speed / speed;
+					vx *= s; vy *= s; vz *= s;
+				}
+
+				// update position
+				pos_x[i] = px + vx; pos_y[i] = py + vy; pos_z[i] = pz + vz;
+				vel_x[i] = vx; vel_y[i] = vy; vel_z[i] = vz;
+			}
+		}
+
+#if defined(CGRA_MATH_SSE)
+
+		void stepRange(const light_motion &m, size_t begin, size_t end) {
+			const __m128 accel = _mm_set1_ps(m.accel);
+			const __m128 zero = _mm_setzero_ps();
+			const __m128 min_speed = _mm_set1_ps(m.min_speed);
+			const __m128 max_speed = _mm_set1_ps(m.max_speed);
+
+			// (mask ? a : b)
+			auto select = [](__m128 mask, __m128 a, __m128 b) {
+				return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+			};
+
+			// acceleration towards the zone along one axis
+			auto zoneAccel = [&](__m128 p, float lo, float hi) {
+				return _mm_sub_ps(
+					_mm_and_ps(_mm_cmple_ps(p, _mm_set1_ps(lo)), accel),
+					_mm_and_ps(_mm_cmpge_ps(p, _mm_set1_ps(hi)), accel));
+			};
+
+			size_t i = begin;
+			for (; i + 4 <= end; i += 4) {
+				__m128 px = _mm_loadu_ps(&pos_x[i]), py = _mm_loadu_ps(&pos_y[i]), pz = _mm_loadu_ps(&pos_z[i]);
+				__m128 vx = _mm_loadu_ps(&vel_x[i]), vy = _mm_loadu_ps(&vel_y[i]), vz = _mm_loadu_ps(&vel_z[i]);
+
+				vx = _mm_add_ps(vx, zoneAccel(px, m.zone_min.x, m.zone_max.x));
+				vy = _mm_add_ps(vy, zoneAccel(py, m.zone_min.y, m.zone_max.y));
+				vz = _mm_add_ps(vz, zoneAccel(pz, m.zone_min.z, m.zone_max.z));
+
+				// the branches of the scalar version become masks, the lanes
+				// that don't change speed are multiplied by exactly 1
+				__m128 speed = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(vx, vx), _mm_mul_ps(vy, vy)), _mm_mul_ps(vz, vz)));
+				__m128 is_zero = _mm_cmpeq_ps(speed, zero);
+				__m128 too_slow = _mm_cmplt_ps(speed, min_speed);
+				__m128 too_fast = _mm_andnot_ps(too_slow, _mm_cmpgt_ps(speed, max_speed));
+				__m128 s = select(too_slow, _mm_div_ps(min_speed, speed), _mm_set1_ps(1.f));
+				s = select(too_fast, _mm_div_ps(max_speed, speed), s);
+				vx = select(is_zero, min_speed, _mm_mul_ps(vx, s));
+				vy = select(is_zero, min_speed, _mm_mul_ps(vy, s));
+				vz = select(is_zero, min_speed, _mm_mul_ps(vz, s));
+
+				_mm_storeu_ps(&pos_x[i], _mm_add_ps(px, vx));
+				_mm_storeu_ps(&pos_y[i], _mm_add_ps(py, vy));
+				_mm_storeu_ps(&pos_z[i], _mm_add_ps(pz, vz));
+				_mm_storeu_ps(&vel_x[i], vx);
+				_mm_storeu_ps(&vel_y[i], vy);
+				_mm_storeu_ps(&vel_z[i], vz);
+			}
+
+			stepScalarRange(m, i, end);
+		}
+
+#elif defined(CGRA_MATH_NEON) && defined(__aarch64__)
+
+		void stepRange(const light_motion &m, size_t begin, size_t end) {
+			const float32x4_t accel = vdupq_n_f32(m.accel);
+			const float32x4_t zero = vdupq_n_f32(0);
+			const float32x4_t one = vdupq_n_f32(1);
+			const float32x4_t min_speed = vdupq_n_f32(m.min_speed);
+			const float32x4_t max_speed = vdupq_n_f32(m.max_speed);
+
+			// acceleration towards the zone along one axis
+			auto zoneAccel = [&](float32x4_t p, float lo, float hi) {
+				return vsubq_f32(
+					vbslq_f32(vcleq_f32(p, vdupq_n_f32(lo)), accel, zero),
+					vbslq_f32(vcgeq_f32(p, vdupq_n_f32(hi)), accel, zero));
+			};
+
+			size_t i = begin;
+			for (; i + 4 <= end; i += 4) {
+				float32x4_t px = vld1q_f32(&pos_x[i]), py = vld1q_f32(&pos_y[i]), pz = vld1q_f32(&pos_z[i]);
+				float32x4_t vx = vld1q_f32(&vel_x[i]), vy = vld1q_f32(&vel_y[i]), vz = vld1q_f32(&vel_z[i]);
+
+				vx = vaddq_f32(vx, zoneAccel(px, m.zone_min.x, m.zone_max.x));
+				vy = vaddq_f32(vy, zoneAccel(py, m.zone_min.y, m.zone_max.y));
+				vz = vaddq_f32(vz, zoneAccel(pz, m.zone_min.z, m.zone_max.z));
+
+				// separate multiply and add (not fused) to match the scalar version
+				float32x4_t speed = vsqrtq_f32(vaddq_f32(vaddq_f32(vmulq_f32(vx, vx), vmulq_f32(vy, vy)), vmulq_f32(vz, vz)));
+				uint32x4_t is_zero = vceqq_f32(speed, zero);
+				uint32x4_t too_slow = vcltq_f32(speed, min_speed);
+				uint32x4_t too_fast = vbicq_u32(vcgtq_f32(speed, max_speed), too_slow);
+				float32x4_t s = vbslq_f32(too_slow, vdivq_f32(min_speed, speed), one);
+				s = vbslq_f32(too_fast, vdivq_f32(max_speed, speed), s);
+				vx = vbslq_f32(is_zero, min_speed, vmulq_f32(vx, s));
+				vy = vbslq_f32(is_zero, min_speed, vmulq_f32(vy, s));
+				vz = vbslq_f32(is_zero, min_speed, vmulq_f32(vz, s));
+
+				vst1q_f32(&pos_x[i], vaddq_f32(px, vx));
+				vst1q_f32(&pos_y[i], vaddq_f32(py, vy));
+				vst1q_f32(&pos_z[i], vaddq_f32(pz, vz));
+				vst1q_f32(&vel_x[i], vx);
+				vst1q_f32(&vel_y[i], vy);
+				vst1q_f32(&vel_z[i], vz);
+			}
+
+			stepScalarRange(m, i, end);
+		}
+
+#else
+
+		void stepRange(const light_motion &m, size_t begin, size_t end) {
+			stepScalarRange(m, begin, end);
+		}
+
+#endif
+	};
+}
@@ -0,0 +1,75 @@
+//---------------------------------------------------------------------------
+//
+// Copyright (c) 2016 Taehyun Rhee, Joshua Scott, Ben Allen
+//
+// This software is provided 'as-is' for assignment of COMP308 in ECS,
+// Victoria University of Wellington, without any express or implied warranty. 
+// In no event will the authors be held liable for any damages arising from
+// the use of this software.
+//
+// The contents of this file may not be copied or duplicated in any form
+// without the prior permission of its owner.
+//
+//----------------------------------------------------------------------------
+
+//----------------------------------------------------------------------------
+//
+// Discrete level of detail
+//
+// Each tessellated shape has max_levels pre-built meshes, level 0 as
+// authored and each level after it with half the slices and stacks of the
+// one before (see mesh_cache::lodKey). The level drawn is the coarsest one
+// whose silhouette edges are no longer than edge_pixels on screen, for a
+// circle of the shape's projected bounding radius.
+//
+// That ideal level is continuous, and the drawn level only changes once the
+// ideal is more than hysteresis levels past the edge of the current one, so
+// objects sitting near a threshold don't flick between two levels.
+//
+//----------------------------------------------------------------------------
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+
+#include "cgra_math.hpp"
+
+namespace cgra {
+
+	class lod_policy {
+	public:
+		static const int max_levels = 4;
+
+		int levels = max_levels; // used, at most max_levels
+		float edge_pixels = 8;
+		float hysteresis = 0.25f; // in levels
+
+		// Radius in pixels of a circle facing the camera at distance from
+		// it, for a projection matrix and viewport height, or infinity if
+		// the camera is inside it
+		static float projectedRadius(float radius, float distance, const mat4 &projection, float viewport_height) {
+			if (distance <= radius) return inf<float>();
+			return radius * projection[1][1] * viewport_height * 0.5f / distance;
+		}
+
+		// Level for a shape with segments edges around its level 0
+		// silhouette, given the level it was drawn at last (or -1)
+		int select(float radius_pixels, int segments, int current) const {
+			int top = std::max(0, std::min(levels, int(max_levels)) - 1);
+			if (segments <= 0 || top == 0) return 0;
+
+			// level l has segments / 2^l edges of 2 pi r / (segments / 2^l).
+			// Past top it is only clamped far enough to still get over the
+			// band to step up to top
+			float ideal = std::log2(edge_pixels * segments / (2 * math::pi() * radius_pixels));
+			ideal = std::min(std::max(ideal, 0.f), top + 1 + hysteresis);
+			int target = std::min(int(ideal), top);
+
+			if (current < 0 || current > top) return target;
+			if (target > current && ideal < current + 1 + hysteresis) return current;
+			if (target < current && ideal > current - hysteresis) return current;
+			return target;
+		}
+	};
+}
@@ -65,6 +65,19 @@
 #include <sstream>
 #include <string>
 #include <type_traits>
+#include <vector>
+
+#include "cgra_parallel.hpp"
+
+// SIMD paths for matrix4<float> and vector4<float> (see the end of this file)
+// Define CGRA_MATH_NO_SIMD to always use the scalar fallback
+#if !defined(CGRA_MATH_NO_SIMD) && (defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1))
+#define CGRA_MATH_SSE
+#include <xmmintrin.h>
+#elif !defined(CGRA_MATH_NO_SIMD) && (defined(__ARM_NEON) || defined(__ARM_NEON__))
+#define CGRA_MATH_NEON
+#include <arm_neon.h>
+#endif
 
 namespace cgra {
 
@@ -1418,8 +1431,9 @@ namespace cgra {
 	/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 	///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
+	// float vectors are 16 byte aligned so they load into a single SIMD register
 	template <typename T>
-	class vector4 {
+	class alignas(std::is_same<T, float>::value ? 16 : alignof(T)) vector4 {
 	public:
 		union{ T x; T r;};
 		union{ T y; T g;};
@@ -2900,7 +2914,7 @@ namespace cgra {
 
 		// fovy in radians, aspect is w/h
 		static matrix4 perspectiveProjection(T fovy, T aspect, T zNear, T zFar) {
-			T f = T(1) / (fovy / T(2));
+			T f = T(1) / std::tan(fovy / T(2));
 
 			matrix4 m;
 			m[0][0] = f / aspect;
@@ -3353,4 +3367,401 @@ namespace cgra {
 		return m;
 	}
 
+
+
+	///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+	///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+	////                                                                                                                       ////
+	////   SIMD matrix4<float> / vector4<float>                                                                                ////
+	////                                                                                                                       ////
+	///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+	///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+	// Column major float 4x4 routines on raw pointers (16 floats per matrix, 4 per vector)
+	// simd::scalar is always available, the SSE or NEON versions are only
+	// defined when CGRA_MATH_SSE or CGRA_MATH_NEON is. Pointers don't need to
+	// be aligned, and outputs may alias inputs.
+	// 
+	namespace simd {
+
+		namespace scalar {
+
+			// out = a * b
+			inline void multiply(const float *a, const float *b, float *out) {
+				float r[16];
+				for (int i = 0; i < 4; i++) {
+					for (int k = 0; k < 4; k++) {
+						r[i * 4 + k] = 0;
+						for (int j = 0; j < 4; j++) {
+							r[i * 4 + k] += a[j * 4 + k] * b[i * 4 + j];
+						}
+					}
+				}
+				std::copy(r, r + 16, out);
+			}
+
+			// out = m * v
+			inline void transform(const float *m, const float *v, float *out) {
+				float r[4] = { 0, 0, 0, 0 };
+				for (int j = 0; j < 4; j++) {
+					for (int k = 0; k < 4; k++) {
+						r[k] += m[j * 4 + k] * v[j];
+					}
+				}
+				std::copy(r, r + 4, out);
+			}
+
+			inline void transpose(const float *m, float *out) {
+				float r[16];
+				for (int i = 0; i < 4; i++) {
+					for (int j = 0; j < 4; j++) {
+						r[i * 4 + j] = m[j * 4 + i];
+					}
+				}
+				std::copy(r, r + 16, out);
+			}
+
+			// cofactor expansion, returns the determinant (out is undefined if it is 0)
+			inline float inverse(const float *m, float *out) {
+				// 2x2 determinants of the bottom two rows (s) and top two rows (c)
+				float s0 = m[0] * m[5] - m[4] * m[1];
+				float s1 = m[0] * m[9] - m[8] * m[1];
+				float s2 = m[0] * m[13] - m[12] * m[1];
+				float s3 = m[4] * m[9] - m[8] * m[5];
+				float s4 = m[4] * m[13] - m[12] * m[5];
+				float s5 = m[8] * m[13] - m[12] * m[9];
+				float c5 = m[10] * m[15] - m[14] * m[11];
+				float c4 = m[6] * m[15] - m[14] * m[7];
+				float c3 = m[6] * m[11] - m[10] * m[7];
+				float c2 = m[2] * m[15] - m[14] * m[3];
+				float c1 = m[2] * m[11] - m[10] * m[3];
+				float c0 = m[2] * m[7] - m[6] * m[3];
+
+				float det = s0 * c5 - s1 * c4 + s2 * c3 + s3 * c2 - s4 * c1 + s5 * c0;
+				float invdet = 1 / det;
+
+				float r[16];
+				r[0] = ( m[5] * c5 - m[9] * c4 + m[13] * c3) * invdet;
+				r[1] = (-m[1] * c5 + m[9] * c2 - m[13] * c1) * invdet;
+				r[2] = ( m[1] * c4 - m[5] * c2 + m[13] * c0) * invdet;
+				r[3] = (-m[1] * c3 + m[5] * c1 - m[9] * c0) * invdet;
+				r[4] = (-m[4] * c5 + m[8] * c4 - m[12] * c3) * invdet;
+				r[5] = ( m[0] * c5 - m[8] * c2 + m[12] * c1) * invdet;
+				r[6] = (-m[0] * c4 + m[4] * c2 - m[12] * c0) * invdet;
+				r[7] = ( m[0] * c3 - m[4] * c1 + m[8] * c0) * invdet;
+				r[8] = ( m[7] * s5 - m[11] * s4 + m[15] * s3) * invdet;
+				r[9] = (-m[3] * s5 + m[11] * s2 - m[15] * s1) * invdet;
+				r[10] = ( m[3] * s4 - m[7] * s2 + m[15] * s0) * invdet;
+				r[11] = (-m[3] * s3 + m[7] * s1 - m[11] * s0) * invdet;
+				r[12] = (-m[6] * s5 + m[10] * s4 - m[14] * s3) * invdet;
+				r[13] = ( m[2] * s5 - m[10] * s2 + m[14] * s1) * invdet;
+				r[14] = (-m[2] * s4 + m[6] * s2 - m[14] * s0) * invdet;
+				r[15] = ( m[2] * s3 - m[6] * s1 + m[10] * s0) * invdet;
+				std::copy(r, r + 16, out);
+				return det;
+			}
+
+			// out[i] = (m * vec4(in[i], 1)).xyz for count points of 3 floats
+			inline void transformPoints(const float *m, const float *in, float *out, size_t count) {
+				for (size_t i = 0; i < count; ++i, in += 3, out += 3) {
+					float x = in[0], y = in[1], z = in[2];
+					out[0] = m[0] * x + m[4] * y + m[8] * z + m[12];
+					out[1] = m[1] * x + m[5] * y + m[9] * z + m[13];
+					out[2] = m[2] * x + m[6] * y + m[10] * z + m[14];
+				}
+			}
+		}
+
+#if defined(CGRA_MATH_SSE)
+
+		namespace detail {
+
+			template <int X, int Y, int Z, int W>
+			inline __m128 shuffle(__m128 a, __m128 b) {
+				return _mm_shuffle_ps(a, b, _MM_SHUFFLE(W, Z, Y, X));
+			}
+
+			template <int X, int Y, int Z, int W>
+			inline __m128 swizzle(__m128 a) {
+				return _mm_shuffle_ps(a, a, _MM_SHUFFLE(W, Z, Y, X));
+			}
+
+			// The inverse treats the matrix as 2x2 blocks, each stored in one
+			// register as (m00, m01, m10, m11) 
+			// 
+
+			// a * b
+			inline __m128 mat2Mul(__m128 a, __m128 b) {
+				return _mm_add_ps(_mm_mul_ps(a, swizzle<0, 3, 0, 3>(b)), _mm_mul_ps(swizzle<1, 0, 3, 2>(a), swizzle<2, 1, 2, 1>(b)));
+			}
+
+			// adjugate(a) * b
+			inline __m128 mat2AdjMul(__m128 a, __m128 b) {
+				return _mm_sub_ps(_mm_mul_ps(swizzle<3, 3, 0, 0>(a), b), _mm_mul_ps(swizzle<1, 1, 2, 2>(a), swizzle<2, 3, 0, 1>(b)));
+			}
+
+			// a * adjugate(b)
+			inline __m128 mat2MulAdj(__m128 a, __m128 b) {
+				return _mm_sub_ps(_mm_mul_ps(a, swizzle<3, 0, 3, 0>(b)), _mm_mul_ps(swizzle<1, 0, 3, 2>(a), swizzle<2, 1, 2, 1>(b)));
+			}
+		}
+
+		inline void multiply(const float *a, const float *b, float *out) {
+			__m128 a0 = _mm_loadu_ps(a);
+			__m128 a1 = _mm_loadu_ps(a + 4);
+			__m128 a2 = _mm_loadu_ps(a + 8);
+			__m128 a3 = _mm_loadu_ps(a + 12);
+			__m128 r[4];
+			for (int i = 0; i < 4; i++) {
+				const float *bi = b + i * 4;
+				r[i] = _mm_add_ps(
+					_mm_add_ps(_mm_mul_ps(a0, _mm_set1_ps(bi[0])), _mm_mul_ps(a1, _mm_set1_ps(bi[1]))),
+					_mm_add_ps(_mm_mul_ps(a2, _mm_set1_ps(bi[2])), _mm_mul_ps(a3, _mm_set1_ps(bi[3]))));
+			}
+			for (int i = 0; i < 4; i++) {
+				_mm_storeu_ps(out + i * 4, r[i]);
+			}
+		}
+
+		inline void transform(const float *m, const float *v, float *out) {
+			__m128 r = _mm_add_ps(
+				_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(m), _mm_set1_ps(v[0])), _mm_mul_ps(_mm_loadu_ps(m + 4), _mm_set1_ps(v[1]))),
+				_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(m + 8), _mm_set1_ps(v[2])), _mm_mul_ps(_mm_loadu_ps(m + 12), _mm_set1_ps(v[3]))));
+			_mm_storeu_ps(out, r);
+		}
+
+		inline void transpose(const float *m, float *out) {
+			__m128 c0 = _mm_loadu_ps(m);
+			__m128 c1 = _mm_loadu_ps(m + 4);
+			__m128 c2 = _mm_loadu_ps(m + 8);
+			__m128 c3 = _mm_loadu_ps(m + 12);
+			_MM_TRANSPOSE4_PS(c0, c1, c2, c3);
+			_mm_storeu_ps(out, c0);
+			_mm_storeu_ps(out + 4, c1);
+			_mm_storeu_ps(out + 8, c2);
+			_mm_storeu_ps(out + 12, c3);
+		}
+
+		// Block-wise inverse using 2x2 adjugates, returns the determinant
+		// (out is undefined if it is 0). Written for row major storage, which
+		// gives the right answer for column major too since inverse and
+		// transpose commute.
+		inline float inverse(const float *m, float *out) {
+			using namespace detail;
+			__m128 r0 = _mm_loadu_ps(m);
+			__m128 r1 = _mm_loadu_ps(m + 4);
+			__m128 r2 = _mm_loadu_ps(m + 8);
+			__m128 r3 = _mm_loadu_ps(m + 12);
+
+			// 2x2 blocks | A B |
+			//            | C D |
+			__m128 a = _mm_movelh_ps(r0, r1);
+			__m128 b = _mm_movehl_ps(r1, r0);
+			__m128 c = _mm_movelh_ps(r2, r3);
+			__m128 d = _mm_movehl_ps(r3, r2);
+
+			// (|A|, |B|, |C|, |D|)
+			__m128 det_sub = _mm_sub_ps(
+				_mm_mul_ps(shuffle<0, 2, 0, 2>(r0, r2), shuffle<1, 3, 1, 3>(r1, r3)),
+				_mm_mul_ps(shuffle<1, 3, 1, 3>(r0, r2), shuffle<0, 2, 0, 2>(r1, r3)));
+			__m128 det_a = swizzle<0, 0, 0, 0>(det_sub);
+			__m128 det_b = swizzle<1, 1, 1, 1>(det_sub);
+			__m128 det_c = swizzle<2, 2, 2, 2>(det_sub);
+			__m128 det_d = swizzle<3, 3, 3, 3>(det_sub);
+
+			__m128 d_c = mat2AdjMul(d, c);
+			__m128 a_b = mat2AdjMul(a, b);
+
+			// adjugates of the blocks of the inverse
+			__m128 x = _mm_sub_ps(_mm_mul_ps(det_d, a), mat2Mul(b, d_c));
+			__m128 w = _mm_sub_ps(_mm_mul_ps(det_a, d), mat2Mul(c, a_b));
+			__m128 y = _mm_sub_ps(_mm_mul_ps(det_b, c), mat2MulAdj(d, a_b));
+			__m128 z = _mm_sub_ps(_mm_mul_ps(det_c, b), mat2MulAdj(a, d_c));
+
+			// |M| = |A||D| + |B||C| - tr(adj(A)B adj(D)C)
+			__m128 tr = _mm_mul_ps(a_b, swizzle<0, 2, 1, 3>(d_c));
+			tr = _mm_add_ps(tr, swizzle<1, 0, 3, 2>(tr));
+			tr = _mm_add_ps(tr, swizzle<2, 3, 0, 1>(tr));
+			__m128 det = _mm_sub_ps(_mm_add_ps(_mm_mul_ps(det_a, det_d), _mm_mul_ps(det_b, det_c)), tr);
+
+			__m128 rdet = _mm_div_ps(_mm_setr_ps(1.f, -1.f, -1.f, 1.f), det);
+			x = _mm_mul_ps(x, rdet);
+			y = _mm_mul_ps(y, rdet);
+			z = _mm_mul_ps(z, rdet);
+			w = _mm_mul_ps(w, rdet);
+
+			// take the adjugate of each block while storing
+			_mm_storeu_ps(out, shuffle<3, 1, 3, 1>(x, y));
+			_mm_storeu_ps(out + 4, shuffle<2, 0, 2, 0>(x, y));
+			_mm_storeu_ps(out + 8, shuffle<3, 1, 3, 1>(z, w));
+			_mm_storeu_ps(out + 12, shuffle<2, 0, 2, 0>(z, w));
+			return _mm_cvtss_f32(det);
+		}
+
+		// Transforms 4 points at a time, shuffling the packed xyz triples
+		// into x, y and z registers and back
+		inline void transformPoints(const float *m, const float *in, float *out, size_t count) {
+			using namespace detail;
+			__m128 m00 = _mm_set1_ps(m[0]), m01 = _mm_set1_ps(m[1]), m02 = _mm_set1_ps(m[2]);
+			__m128 m10 = _mm_set1_ps(m[4]), m11 = _mm_set1_ps(m[5]), m12 = _mm_set1_ps(m[6]);
+			__m128 m20 = _mm_set1_ps(m[8]), m21 = _mm_set1_ps(m[9]), m22 = _mm_set1_ps(m[10]);
+			__m128 m30 = _mm_set1_ps(m[12]), m31 = _mm_set1_ps(m[13]), m32 = _mm_set1_ps(m[14]);
+
+			size_t blocks = count / 4;
+			for (size_t i = 0; i < blocks; ++i, in += 12, out += 12) {
+				// (x0 y0 z0 x1) (y1 z1 x2 y2) (z2 x3 y3 z3)
+				__m128 p0 = _mm_loadu_ps(in);
+				__m128 p1 = _mm_loadu_ps(in + 4);
+				__m128 p2 = _mm_loadu_ps(in + 8);
+
+				__m128 x = shuffle<0, 3, 0, 2>(p0, shuffle<2, 2, 1, 1>(p1, p2));
+				__m128 y = shuffle<0, 2, 0, 2>(shuffle<1, 1, 0, 0>(p0, p1), shuffle<3, 3, 2, 2>(p1, p2));
+				__m128 z = shuffle<0, 2, 0, 3>(shuffle<2, 2, 1, 1>(p0, p1), p2);
+
+				__m128 rx = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m00, x), _mm_mul_ps(m10, y)), _mm_add_ps(_mm_mul_ps(m20, z), m30));
+				__m128 ry = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m01, x), _mm_mul_ps(m11, y)), _mm_add_ps(_mm_mul_ps(m21, z), m31));
+				__m128 rz = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m02, x), _mm_mul_ps(m12, y)), _mm_add_ps(_mm_mul_ps(m22, z), m32));
+
+				_mm_storeu_ps(out, shuffle<0, 2, 0, 2>(shuffle<0, 0, 0, 0>(rx, ry), shuffle<0, 0, 1, 1>(rz, rx)));
+				_mm_storeu_ps(out + 4, shuffle<0, 2, 0, 2>(shuffle<1, 1, 1, 1>(ry, rz), shuffle<2, 2, 2, 2>(rx, ry)));
+				_mm_storeu_ps(out + 8, shuffle<0, 2, 0, 2>(shuffle<2, 2, 3, 3>(rz, rx), shuffle<3, 3, 3, 3>(ry, rz)));
+			}
+
+			scalar::transformPoints(m, in, out, count - blocks * 4);
+		}
+
+#elif defined(CGRA_MATH_NEON)
+
+		inline void multiply(const float *a, const float *b, float *out) {
+			float32x4_t a0 = vld1q_f32(a);
+			float32x4_t a1 = vld1q_f32(a + 4);
+			float32x4_t a2 = vld1q_f32(a + 8);
+			float32x4_t a3 = vld1q_f32(a + 12);
+			float32x4_t r[4];
+			for (int i = 0; i < 4; i++) {
+				float32x4_t bi = vld1q_f32(b + i * 4);
+				r[i] = vmulq_lane_f32(a0, vget_low_f32(bi), 0);
+				r[i] = vmlaq_lane_f32(r[i], a1, vget_low_f32(bi), 1);
+				r[i] = vmlaq_lane_f32(r[i], a2, vget_high_f32(bi), 0);
+				r[i] = vmlaq_lane_f32(r[i], a3, vget_high_f32(bi), 1);
+			}
+			for (int i = 0; i < 4; i++) {
+				vst1q_f32(out + i * 4, r[i]);
+			}
+		}
+
+		inline void transform(const float *m, const float *v, float *out) {
+			float32x4_t vv = vld1q_f32(v);
+			float32x4_t r = vmulq_lane_f32(vld1q_f32(m), vget_low_f32(vv), 0);
+			r = vmlaq_lane_f32(r, vld1q_f32(m + 4), vget_low_f32(vv), 1);
+			r = vmlaq_lane_f32(r, vld1q_f32(m + 8), vget_high_f32(vv), 0);
+			r = vmlaq_lane_f32(r, vld1q_f32(m + 12), vget_high_f32(vv), 1);
+			vst1q_f32(out, r);
+		}
+
+		inline void transpose(const float *m, float *out) {
+			// de-interleaving load gives the rows
+			float32x4x4_t t = vld4q_f32(m);
+			vst1q_f32(out, t.val[0]);
+			vst1q_f32(out + 4, t.val[1]);
+			vst1q_f32(out + 8, t.val[2]);
+			vst1q_f32(out + 12, t.val[3]);
+		}
+
+		// no NEON version yet, the scalar expansion is already branch free
+		inline float inverse(const float *m, float *out) {
+			return scalar::inverse(m, out);
+		}
+
+		// Transforms 4 points at a time, using de-interleaving loads and
+		// interleaving stores to get x, y and z registers
+		inline void transformPoints(const float *m, const float *in, float *out, size_t count) {
+			size_t blocks = count / 4;
+			for (size_t i = 0; i < blocks; ++i, in += 12, out += 12) {
+				float32x4x3_t p = vld3q_f32(in);
+				float32x4x3_t r;
+				r.val[0] = vmlaq_n_f32(vmlaq_n_f32(vmlaq_n_f32(vdupq_n_f32(m[12]), p.val[0], m[0]), p.val[1], m[4]), p.val[2], m[8]);
+				r.val[1] = vmlaq_n_f32(vmlaq_n_f32(vmlaq_n_f32(vdupq_n_f32(m[13]), p.val[0], m[1]), p.val[1], m[5]), p.val[2], m[9]);
+				r.val[2] = vmlaq_n_f32(vmlaq_n_f32(vmlaq_n_f32(vdupq_n_f32(m[14]), p.val[0], m[2]), p.val[1], m[6]), p.val[2], m[10]);
+				vst3q_f32(out, r);
+			}
+
+			scalar::transformPoints(m, in, out, count - blocks * 4);
+		}
+
+#else
+
+		using scalar::multiply;
+		using scalar::transform;
+		using scalar::transpose;
+		using scalar::inverse;
+		using scalar::transformPoints;
+
+#endif
+	}
+
+
+	// Batch transform of points, out[i] = vec3(m * vec4(in[i], 1))
+	// Split over the pool if given (see cgra_parallel.hpp) and there are
+	// enough points to make it worthwhile. in and out may be the same array.
+	// 
+	inline void transformPoints(const matrix4<float> &m, const vector3<float> *in, vector3<float> *out, size_t count, worker_pool *pool = nullptr) {
+		static_assert(sizeof(vector3<float>) == 3 * sizeof(float), "vec3 must be tightly packed");
+		const size_t min_per_thread = 8192;
+		if (count == 0) return;
+
+		if (pool && count >= 2 * min_per_thread) {
+			// ranges are a multiple of 4 so only the last one has a remainder
+			pool->parallelFor(count, min_per_thread, [&](size_t begin, size_t end) {
+				simd::transformPoints(m[0].dataPointer(), in[begin].dataPointer(), out[begin].dataPointer(), end - begin);
+			});
+		} else {
+			simd::transformPoints(m[0].dataPointer(), in->dataPointer(), out->dataPointer(), count);
+		}
+	}
+
+
+#if defined(CGRA_MATH_SSE) || defined(CGRA_MATH_NEON)
+
+	// matrix4<float> and vector4<float> overloads
+	// These take priority over the generic templates, which can still be
+	// called explicitly (eg. inverse<float>(m)) for comparison. Without SIMD
+	// the generic templates are used as is
+	// 
+
+	// mulitply-assign
+	template <> template <>
+	inline matrix4<float> & matrix4<float>::operator*=<float>(const matrix4<float> &rhs) {
+		simd::multiply(data[0].dataPointer(), rhs.data[0].dataPointer(), data[0].dataPointer());
+		return *this;
+	}
+
+	// Left multiply matrix4<float> m with vector4<float> v
+	// 
+	// multiply
+	inline vector4<float> operator*(const matrix4<float> &lhs, const vector4<float> &rhs) {
+		vector4<float> v;
+		simd::transform(lhs[0].dataPointer(), rhs.dataPointer(), v.dataPointer());
+		return v;
+	}
+
+	// transpose of matrix
+	inline matrix4<float> transpose(const matrix4<float> &m) {
+		matrix4<float> mt;
+		simd::transpose(m[0].dataPointer(), mt[0].dataPointer());
+		return mt;
+	}
+
+	// inverse of matrix (error if not invertible)
+	inline matrix4<float> inverse(const matrix4<float> &m) {
+		matrix4<float> mi;
+		float det = simd::inverse(m[0].dataPointer(), mi[0].dataPointer());
+		// FIXME proper detect infinite determinant
+		assert(!isinf(1 / det) && det == det && det != 0);
+		(void) det;
+		return mi;
+	}
+
+#endif
+
 }
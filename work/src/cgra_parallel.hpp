@@ -0,0 +1,148 @@
+//---------------------------------------------------------------------------
+//
+// Copyright (c) 2016 Taehyun Rhee, Joshua Scott, Ben Allen
+//
+// This software is provided 'as-is' for assignment of COMP308 in ECS,
+// Victoria University of Wellington, without any express or implied warranty. 
+// In no event will the authors be held liable for any damages arising from
+// the use of this software.
+//
+// The contents of this file may not be copied or duplicated in any form
+// without the prior permission of its owner.
+//
+//----------------------------------------------------------------------------
+
+//----------------------------------------------------------------------------
+//
+// Worker pool
+//
+// A fixed set of threads that are kept alive between jobs, so splitting
+// per-frame work (like updating thousands of lights) doesn't pay for thread
+// creation every frame. The calling thread also works on each job, and run()
+// only returns once the whole job is done.
+//
+// Usage:
+//   workerPool().parallelFor(count, 1024, [&](size_t begin, size_t end) {
+//     for (size_t i = begin; i < end; ++i) ...
+//   });
+//
+//----------------------------------------------------------------------------
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace cgra {
+
+	class worker_pool {
+	private:
+		std::vector<std::thread> m_threads;
+		std::mutex m_mutex;
+		std::condition_variable m_wake;
+		std::condition_variable m_done;
+
+		// current job, only changed while no workers are running
+		const std::function<void(size_t)> *m_job = nullptr;
+		size_t m_chunks = 0;
+		std::atomic<size_t> m_next_chunk { 0 };
+		unsigned m_generation = 0;
+		unsigned m_active = 0;
+		bool m_quit = false;
+
+	public:
+		// threads includes the calling thread, so 1 runs everything inline
+		explicit worker_pool(unsigned threads = std::thread::hardware_concurrency()) {
+			for (unsigned i = 1; i < threads; ++i) {
+				m_threads.emplace_back(&worker_pool::workerLoop, this);
+			}
+		}
+
+		worker_pool(const worker_pool &) = delete;
+		worker_pool & operator=(const worker_pool &) = delete;
+
+		~worker_pool() {
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_quit = true;
+			}
+			m_wake.notify_all();
+			for (std::thread &t : m_threads) t.join();
+		}
+
+		// number of threads that work on a job, including the caller
+		unsigned size() const { return unsigned(m_threads.size()) + 1; }
+
+		// Calls job(c) for every c in [0, chunks), spread over the pool
+		void run(size_t chunks, const std::function<void(size_t)> &job) {
+			if (m_threads.empty() || chunks <= 1) {
+				for (size_t c = 0; c < chunks; ++c) job(c);
+				return;
+			}
+
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_job = &job;
+				m_chunks = chunks;
+				m_next_chunk = 0;
+				m_active = unsigned(m_threads.size());
+				m_generation++;
+			}
+			m_wake.notify_all();
+
+			runChunks();
+
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_done.wait(lock, [&] { return m_active == 0; });
+			m_job = nullptr;
+		}
+
+		// Calls f(begin, end) over [0, count) in at most size() ranges of at
+		// least min_range items. Range boundaries are multiples of 4 so SIMD
+		// loops only have a remainder in the last range.
+		void parallelFor(size_t count, size_t min_range, const std::function<void(size_t, size_t)> &f) {
+			size_t ranges = std::max<size_t>(1, std::min<size_t>(size(), count / std::max<size_t>(1, min_range)));
+			size_t range = ((count + ranges - 1) / ranges + 3) & ~size_t(3);
+			run(ranges, [&](size_t r) {
+				size_t begin = std::min(count, r * range);
+				size_t end = std::min(count, begin + range);
+				if (begin < end) f(begin, end);
+			});
+		}
+
+	private:
+		void runChunks() {
+			for (size_t c; (c = m_next_chunk++) < m_chunks; ) {
+				(*m_job)(c);
+			}
+		}
+
+		void workerLoop() {
+			unsigned seen = 0;
+			std::unique_lock<std::mutex> lock(m_mutex);
+			while (true) {
+				m_wake.wait(lock, [&] { return m_quit || m_generation != seen; });
+				if (m_quit) return;
+				seen = m_generation;
+
+				lock.unlock();
+				runChunks();
+				lock.lock();
+
+				if (--m_active == 0) m_done.notify_one();
+			}
+		}
+	};
+
+
+	// Shared pool sized to the machine, created on first use
+	inline worker_pool & workerPool() {
+		static worker_pool pool;
+		return pool;
+	}
+}
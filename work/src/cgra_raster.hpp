@@ -0,0 +1,426 @@
+//---------------------------------------------------------------------------
+//
+// Copyright (c) 2016 Taehyun Rhee, Joshua Scott, Ben Allen
+//
+// This software is provided 'as-is' for assignment of COMP308 in ECS,
+// Victoria University of Wellington, without any express or implied warranty. 
+// In no event will the authors be held liable for any damages arising from
+// the use of this software.
+//
+// The contents of this file may not be copied or duplicated in any form
+// without the prior permission of its owner.
+//
+//----------------------------------------------------------------------------
+
+//----------------------------------------------------------------------------
+//
+// Software occlusion rasterizer
+//
+// Renders occluder meshes into a small CPU depth buffer, then tests boxes
+// against it, so hidden objects can be skipped without any help from the
+// GPU. Depends only on cgra_math.hpp and cgra_parallel.hpp, no OpenGL.
+//
+// Rendering is in two passes over the worker pool:
+//   1. The occluders are split between the threads, which transform their
+//      vertices, set up each triangle's edge and depth planes, and bin it
+//      into every tile of tile_size x tile_size pixels its bounds touch.
+//   2. The tiles are split between the threads, each rasterizing the
+//      triangles binned into it from every thread, 4 pixels at a time with
+//      SSE when cgra_math.hpp selected it (scalar otherwise).
+// A tile is only written by one thread and the buffer keeps the maximum, so
+// the result doesn't depend on the number of threads or the SIMD path.
+//
+// The buffer holds 1/w, view depth being w, which interpolates linearly in
+// screen space, and each pixel gets the smallest value over its square. A
+// box is hidden if its nearest corner is further than the buffer over every
+// pixel its screen rectangle touches. Pixels are covered if their whole
+// square is inside the edges on an occluder's outline, but only their
+// centre inside its other edges (see occluder_mesh::findAdjacent), so the
+// triangles of an occluder leave no gaps between them, yet nothing is
+// hidden by a partly covered pixel at its edge. As long as the occluders
+// are inside the objects they stand for (see mesh_cache::occluderKey),
+// that errs towards visible.
+//
+// Triangles crossing the near plane are dropped, which again only makes
+// fewer objects hidden. Both windings are drawn, as the scene meshes don't
+// share a consistent one.
+//
+// Usage:
+//   occlusion_rasterizer r(256, 144);
+//   r.clear(projection * view, znear);
+//   r.addOccluder(mesh, model); // meshes must outlive render()
+//   r.render();
+//   if (r.visible(bounds_min, bounds_max)) ...
+//
+//----------------------------------------------------------------------------
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <map>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "cgra_math.hpp"
+#include "cgra_parallel.hpp"
+
+namespace cgra {
+
+	// Indexed triangle list, positions only
+	struct occluder_mesh {
+		static const uint32_t no_triangle = ~0u;
+
+		std::vector<vec3> positions;
+		std::vector<uint32_t> indices;
+		std::vector<uint32_t> adjacent; // per triangle edge, the triangle across it, see findAdjacent
+
+		size_t triangleCount() const { return indices.size() / 3; }
+
+		// For edge j of triangle i, from corner j to j + 1, sets
+		// adjacent[3 * i + j] to the one other triangle with that edge, or
+		// no_triangle. Vertices are matched by position, to within a small
+		// tolerance, as the generated meshes duplicate them along seams.
+		// Triangles without area have no neighbours
+		void findAdjacent() {
+			float extent = 0;
+			for (const vec3 &p : positions) extent = std::max(extent, std::max(std::abs(p.x), std::max(std::abs(p.y), std::abs(p.z))));
+			float scale = extent > 0 ? 1e5f / extent : 1;
+			auto quantize = [&](uint32_t v) {
+				const vec3 &p = positions[v];
+				return std::make_tuple(std::lround(p.x * scale), std::lround(p.y * scale), std::lround(p.z * scale));
+			};
+
+			using point = decltype(quantize(0));
+			std::map<std::pair<point, point>, std::vector<uint32_t>> edges;
+			for (size_t i = 0; i + 2 < indices.size(); i += 3) {
+				vec3 a = positions[indices[i]], b = positions[indices[i + 1]], c = positions[indices[i + 2]];
+				if (length(cross(b - a, c - a)) <= 1e-6f * extent * extent) continue;
+				for (int j = 0; j < 3; ++j) {
+					point p = quantize(indices[i + j]), q = quantize(indices[i + (j + 1) % 3]);
+					edges[std::minmax(p, q)].push_back(uint32_t(i + j));
+				}
+			}
+
+			adjacent.assign(indices.size() - indices.size() % 3, uint32_t(no_triangle));
+			for (const auto &e : edges) {
+				if (e.second.size() != 2) continue;
+				adjacent[e.second[0]] = e.second[1] / 3;
+				adjacent[e.second[1]] = e.second[0] / 3;
+			}
+		}
+	};
+
+	// Work done by one occlusion_rasterizer::render
+	struct raster_stats {
+		int occluders = 0;
+		int triangles = 0;      // in the occluders
+		int triangles_set_up = 0; // that weren't clipped, degenerate or off screen
+		int bin_entries = 0;    // triangle and tile pairs rasterized
+	};
+
+
+	class occlusion_rasterizer {
+	public:
+		static const int tile_size = 32;
+
+	private:
+		// For the pixel at column x, row y, edge i covers it where
+		// e[i][0] * x + e[i][1] * y + e[i][2] >= 0, and depth is at least
+		// z[0] * x + z[1] * y + z[2] over its whole square
+		struct triangle {
+			float e[3][3];
+			float z[3];
+			int x0, y0, x1, y1; // pixel bounds, inclusive
+		};
+
+		// Per thread output of the setup pass
+		struct bin_set {
+			std::vector<triangle> triangles;
+			std::vector<std::vector<uint32_t>> tiles; // triangle indices per tile
+			std::vector<vec4> screen; // scratch, x y in pixels, 1/w, w
+			std::vector<float> area; // scratch, signed screen area per triangle, 0 if dropped
+			raster_stats stats;
+		};
+
+		struct occluder {
+			const occluder_mesh *mesh;
+			mat4 model;
+		};
+
+		int m_width = 0, m_height = 0;
+		int m_tiles_x = 0, m_tiles_y = 0;
+		int m_stride = 0; // row length of m_depth, whole tiles
+		std::vector<float> m_depth;
+
+		mat4 m_view_proj { 1 };
+		float m_znear = 0.1f;
+		std::vector<occluder> m_occluders;
+		std::vector<bin_set> m_bins;
+		raster_stats m_stats;
+
+	public:
+		explicit occlusion_rasterizer(int width = 256, int height = 144) { resize(width, height); }
+
+		void resize(int width, int height) {
+			m_width = std::max(1, width);
+			m_height = std::max(1, height);
+			m_tiles_x = (m_width + tile_size - 1) / tile_size;
+			m_tiles_y = (m_height + tile_size - 1) / tile_size;
+			m_stride = m_tiles_x * tile_size;
+			m_depth.assign(size_t(m_stride) * m_tiles_y * tile_size, 0.f);
+		}
+
+		int width() const { return m_width; }
+		int height() const { return m_height; }
+
+		// Empties the buffer and the occluder list for a new frame
+		void clear(const mat4 &view_proj, float znear) {
+			std::fill(m_depth.begin(), m_depth.end(), 0.f);
+			m_view_proj = view_proj;
+			m_znear = znear;
+			m_occluders.clear();
+			m_stats = raster_stats();
+		}
+
+		void addOccluder(const occluder_mesh &mesh, const mat4 &model) {
+			m_occluders.push_back({ &mesh, model });
+		}
+
+		// Draws every occluder added since clear()
+		void render(worker_pool &pool = workerPool(), bool simd = true) {
+			size_t sets = std::max<size_t>(1, std::min<size_t>(pool.size(), m_occluders.size()));
+			if (m_bins.size() < sets) m_bins.resize(sets);
+			for (bin_set &b : m_bins) {
+				b.triangles.clear();
+				b.tiles.resize(size_t(m_tiles_x) * m_tiles_y);
+				for (std::vector<uint32_t> &t : b.tiles) t.clear();
+				b.stats = raster_stats();
+			}
+
+			pool.run(sets, [&](size_t s) {
+				size_t begin = m_occluders.size() * s / sets;
+				size_t end = m_occluders.size() * (s + 1) / sets;
+				for (size_t i = begin; i < end; ++i) setupOccluder(m_occluders[i], m_bins[s]);
+			});
+
+			pool.run(size_t(m_tiles_x) * m_tiles_y, [&](size_t tile) {
+				for (const bin_set &b : m_bins) {
+					for (uint32_t t : b.tiles[tile]) {
+#if defined(CGRA_MATH_SSE)
+						if (simd) {
+							rasterizeSSE(b.triangles[t], int(tile));
+							continue;
+						}
+#endif
+						rasterizeScalar(b.triangles[t], int(tile));
+					}
+				}
+			});
+			(void) simd;
+
+			m_stats.occluders = int(m_occluders.size());
+			for (const bin_set &b : m_bins) {
+				m_stats.triangles += b.stats.triangles;
+				m_stats.triangles_set_up += b.stats.triangles_set_up;
+				m_stats.bin_entries += b.stats.bin_entries;
+			}
+		}
+
+		const raster_stats & stats() const { return m_stats; }
+
+		// False only if the box is certainly hidden behind the occluders
+		bool visible(const vec3 &bmin, const vec3 &bmax) const {
+			float x0 = inf<float>(), y0 = inf<float>(), x1 = -inf<float>(), y1 = -inf<float>();
+			float nearest = 0; // largest 1/w
+			for (int k = 0; k < 8; ++k) {
+				vec4 clip = m_view_proj * vec4((k & 1) ? bmax.x : bmin.x, (k & 2) ? bmax.y : bmin.y, (k & 4) ? bmax.z : bmin.z, 1);
+				if (clip.w < m_znear) return true; // crosses the near plane
+				float iw = 1 / clip.w;
+				float x = (clip.x * iw * 0.5f + 0.5f) * m_width;
+				float y = (clip.y * iw * 0.5f + 0.5f) * m_height;
+				x0 = std::min(x0, x); x1 = std::max(x1, x);
+				y0 = std::min(y0, y); y1 = std::max(y1, y);
+				nearest = std::max(nearest, iw);
+			}
+
+			// off screen, so only frustum culling can say
+			if (x1 < 0 || y1 < 0 || x0 >= m_width || y0 >= m_height) return true;
+
+			int px0 = std::max(0, int(std::floor(x0))), px1 = std::min(m_width - 1, int(std::floor(x1)));
+			int py0 = std::max(0, int(std::floor(y0))), py1 = std::min(m_height - 1, int(std::floor(y1)));
+			for (int y = py0; y <= py1; ++y) {
+				const float *row = &m_depth[size_t(y) * m_stride];
+				for (int x = px0; x <= px1; ++x) {
+					if (row[x] <= nearest) return true;
+				}
+			}
+			return false;
+		}
+
+		// 1/w of the nearest occluder covering each pixel, 0 where there is
+		// none, row major from the bottom with rows of stride() floats
+		const float * depth() const { return m_depth.data(); }
+
+		int stride() const { return m_stride; }
+
+	private:
+		void setupOccluder(const occluder &o, bin_set &bins) const {
+			const occluder_mesh &mesh = *o.mesh;
+			mat4 mvp = m_view_proj * o.model;
+
+			bins.screen.resize(mesh.positions.size());
+			for (size_t i = 0; i < mesh.positions.size(); ++i) {
+				vec4 clip = mvp * vec4(mesh.positions[i], 1);
+				float iw = 1 / clip.w;
+				bins.screen[i] = vec4((clip.x * iw * 0.5f + 0.5f) * m_width, (clip.y * iw * 0.5f + 0.5f) * m_height, iw, clip.w);
+			}
+
+			size_t count = mesh.triangleCount();
+			bins.stats.triangles += int(count);
+			bins.area.assign(count, 0.f);
+			for (size_t i = 0; i < count; ++i) {
+				const vec4 &a = bins.screen[mesh.indices[3 * i]];
+				const vec4 &b = bins.screen[mesh.indices[3 * i + 1]];
+				const vec4 &c = bins.screen[mesh.indices[3 * i + 2]];
+				if (a.w < m_znear || b.w < m_znear || c.w < m_znear) continue;
+				float area = (b.x - a.x) * (c.y - a.y) - (c.x - a.x) * (b.y - a.y);
+				if (std::abs(area) > 1e-6f) bins.area[i] = area; // also drops NaN
+			}
+
+			for (size_t i = 0; i < count; ++i) {
+				if (bins.area[i] == 0) continue;
+
+				// Between two triangles facing the same way on screen an edge
+				// is inside the occluder's outline, anywhere else it's on it
+				bool inner[3];
+				for (int j = 0; j < 3; ++j) {
+					uint32_t other = mesh.adjacent.empty() ? occluder_mesh::no_triangle : mesh.adjacent[3 * i + j];
+					inner[j] = other != occluder_mesh::no_triangle && (bins.area[other] > 0) == (bins.area[i] > 0) && bins.area[other] != 0;
+				}
+
+				triangle t;
+				const vec4 *v = &bins.screen[0];
+				if (!setupTriangle(v[mesh.indices[3 * i]], v[mesh.indices[3 * i + 1]], v[mesh.indices[3 * i + 2]], bins.area[i], inner, t)) continue;
+				bins.stats.triangles_set_up++;
+
+				uint32_t index = uint32_t(bins.triangles.size());
+				bins.triangles.push_back(t);
+				for (int ty = t.y0 / tile_size; ty <= t.y1 / tile_size; ++ty) {
+					for (int tx = t.x0 / tile_size; tx <= t.x1 / tile_size; ++tx) {
+						bins.tiles[ty * m_tiles_x + tx].push_back(index);
+						bins.stats.bin_entries++;
+					}
+				}
+			}
+		}
+
+		bool setupTriangle(vec4 a, vec4 b, vec4 c, float area, const bool inner[3], triangle &t) const {
+			// edges a-b, b-c, c-a, or a-c, c-b, b-a once b and c are swapped
+			bool edge_inner[3] = { inner[0], inner[1], inner[2] };
+			if (area < 0) {
+				std::swap(b, c);
+				std::swap(edge_inner[0], edge_inner[2]);
+				area = -area;
+			}
+
+			float fx0 = std::min(a.x, std::min(b.x, c.x)), fx1 = std::max(a.x, std::max(b.x, c.x));
+			float fy0 = std::min(a.y, std::min(b.y, c.y)), fy1 = std::max(a.y, std::max(b.y, c.y));
+			if (fx1 <= 0 || fy1 <= 0 || fx0 >= m_width || fy0 >= m_height) return false;
+			t.x0 = std::max(0, int(std::floor(fx0)));
+			t.y0 = std::max(0, int(std::floor(fy0)));
+			t.x1 = std::min(m_width - 1, int(std::ceil(fx1)) - 1);
+			t.y1 = std::min(m_height - 1, int(std::ceil(fy1)) - 1);
+			if (t.x0 > t.x1 || t.y0 > t.y1) return false;
+
+			// Edge functions are linear, so the pixel square is inside an
+			// edge if its centre is at least half the gradient's L1 length in
+			// (the furthest corner is that much further out). Inner edges
+			// only test the centre
+			const vec4 *v[3] = { &a, &b, &c };
+			for (int i = 0; i < 3; ++i) {
+				const vec4 &p = *v[i], &q = *v[(i + 1) % 3];
+				float ea = p.y - q.y, eb = q.x - p.x;
+				float ec = p.x * q.y - p.y * q.x;
+				t.e[i][0] = ea;
+				t.e[i][1] = eb;
+				t.e[i][2] = ec + 0.5f * (ea + eb) - (edge_inner[i] ? 0 : 0.5f * (std::abs(ea) + std::abs(eb)));
+			}
+
+			// The same for the depth plane, which is lowest at a corner
+			float za = ((b.z - a.z) * (c.y - a.y) - (c.z - a.z) * (b.y - a.y)) / area;
+			float zb = ((c.z - a.z) * (b.x - a.x) - (b.z - a.z) * (c.x - a.x)) / area;
+			float zc = a.z - za * a.x - zb * a.y;
+			t.z[0] = za;
+			t.z[1] = zb;
+			t.z[2] = zc + 0.5f * (za + zb) - 0.5f * (std::abs(za) + std::abs(zb));
+			return true;
+		}
+
+		void tileBounds(const triangle &t, int tile, int &x0, int &y0, int &x1, int &y1) const {
+			int tx = tile % m_tiles_x, ty = tile / m_tiles_x;
+			x0 = std::max(t.x0, tx * tile_size);
+			y0 = std::max(t.y0, ty * tile_size);
+			x1 = std::min(t.x1, tx * tile_size + tile_size - 1);
+			y1 = std::min(t.y1, ty * tile_size + tile_size - 1);
+		}
+
+		void rasterizeScalar(const triangle &t, int tile) {
+			int x0, y0, x1, y1;
+			tileBounds(t, tile, x0, y0, x1, y1);
+			for (int y = y0; y <= y1; ++y) {
+				float fy = float(y);
+				float *row = &m_depth[size_t(y) * m_stride];
+				for (int x = x0; x <= x1; ++x) {
+					float fx = float(x);
+					float e0 = t.e[0][0] * fx + t.e[0][1] * fy + t.e[0][2];
+					float e1 = t.e[1][0] * fx + t.e[1][1] * fy + t.e[1][2];
+					float e2 = t.e[2][0] * fx + t.e[2][1] * fy + t.e[2][2];
+					if (e0 >= 0 && e1 >= 0 && e2 >= 0) {
+						row[x] = std::max(row[x], t.z[0] * fx + t.z[1] * fy + t.z[2]);
+					}
+				}
+			}
+		}
+
+#if defined(CGRA_MATH_SSE)
+		// Same arithmetic as rasterizeScalar, in the same order, so the
+		// results are identical. Rows start on a multiple of 4, which the
+		// tiles and the row stride are, and the lanes outside the triangle's
+		// bounds fail its edge tests
+		void rasterizeSSE(const triangle &t, int tile) {
+			int x0, y0, x1, y1;
+			tileBounds(t, tile, x0, y0, x1, y1);
+			x0 &= ~3;
+
+			__m128 ea0 = _mm_set1_ps(t.e[0][0]), eb0 = _mm_set1_ps(t.e[0][1]), ec0 = _mm_set1_ps(t.e[0][2]);
+			__m128 ea1 = _mm_set1_ps(t.e[1][0]), eb1 = _mm_set1_ps(t.e[1][1]), ec1 = _mm_set1_ps(t.e[1][2]);
+			__m128 ea2 = _mm_set1_ps(t.e[2][0]), eb2 = _mm_set1_ps(t.e[2][1]), ec2 = _mm_set1_ps(t.e[2][2]);
+			__m128 za = _mm_set1_ps(t.z[0]), zb = _mm_set1_ps(t.z[1]), zc = _mm_set1_ps(t.z[2]);
+			__m128 zero = _mm_setzero_ps();
+
+			for (int y = y0; y <= y1; ++y) {
+				__m128 fy = _mm_set1_ps(float(y));
+				__m128 e0y = _mm_mul_ps(eb0, fy), e1y = _mm_mul_ps(eb1, fy), e2y = _mm_mul_ps(eb2, fy);
+				__m128 zy = _mm_mul_ps(zb, fy);
+				float *row = &m_depth[size_t(y) * m_stride];
+				for (int x = x0; x <= x1; x += 4) {
+					__m128 fx = _mm_setr_ps(float(x), float(x + 1), float(x + 2), float(x + 3));
+					__m128 e0 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ea0, fx), e0y), ec0);
+					__m128 e1 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ea1, fx), e1y), ec1);
+					__m128 e2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ea2, fx), e2y), ec2);
+					__m128 inside = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(e0, zero), _mm_cmpge_ps(e1, zero)), _mm_cmpge_ps(e2, zero));
+					if (_mm_movemask_ps(inside) == 0) continue;
+
+					__m128 z = _mm_add_ps(_mm_add_ps(_mm_mul_ps(za, fx), zy), zc);
+					__m128 d = _mm_loadu_ps(row + x);
+					__m128 m = _mm_max_ps(d, z);
+					_mm_storeu_ps(row + x, _mm_or_ps(_mm_and_ps(inside, m), _mm_andnot_ps(inside, d)));
+				}
+			}
+		}
+#endif
+	};
+}
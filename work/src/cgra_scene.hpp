@@ -0,0 +1,368 @@
+//---------------------------------------------------------------------------
+//
+// Copyright (c) 2016 Taehyun Rhee, Joshua Scott, Ben Allen
+//
+// This software is provided 'as-is' for assignment of COMP308 in ECS,
+// Victoria University of Wellington, without any express or implied warranty. 
+// In no event will the authors be held liable for any damages arising from
+// the use of this software.
+//
+// The contents of this file may not be copied or duplicated in any form
+// without the prior permission of its owner.
+//
+//----------------------------------------------------------------------------
+
+//----------------------------------------------------------------------------
+//
+// Scene description
+//
+// A scene is a flat array of materials and a flat array of objects, each
+// object a cached mesh (see cgra_geometry.hpp), a model matrix, a material
+// index and its world space bounds. The renderer walks the object array.
+//
+// Text format, one statement per line, # starts a comment:
+//
+//   material <name> <diffuse r g b> <specular r g b> <shininess> [emissive]
+//   sphere <radius> <slices> <stacks> <material> [transforms]
+//   cylinder <base radius> <top radius> <height> <slices> <stacks> <material> [transforms]
+//   cone <base radius> <height> <slices> <stacks> <material> [transforms]
+//   plane <half size> <material> [transforms]
+//
+// Transforms are any of translate x y z, rotate x|y|z <degrees> and
+// scale s, multiplied together in the order written (so the last one is
+// applied to the mesh first). Materials must be declared before use.
+// Radii, sizes and heights must be positive (one cylinder radius may be 0),
+// and slices and stacks from 1 to max_tessellation.
+//
+// The binary format is a header followed by the two arrays as they are in
+// memory, so it loads with two reads. It is only meant to be read on the
+// machine that wrote it (no endian or padding conversion).
+//
+//----------------------------------------------------------------------------
+
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+#include "cgra_geometry.hpp"
+#include "cgra_math.hpp"
+
+namespace cgra {
+
+	struct scene_material {
+		vec3 diffuse;
+		vec3 specular;
+		float shininess = 1;
+		uint32_t emissive = 0;
+	};
+
+	struct scene_object {
+		mesh_cache::key mesh;
+		uint32_t material = 0;
+		mat4 model = mat4(1);
+		aabb bounds; // world space, see scene::updateBounds
+	};
+
+	static_assert(std::is_trivially_copyable<scene_material>::value, "scene_material is written to binary scenes as is");
+	static_assert(std::is_trivially_copyable<scene_object>::value, "scene_object is written to binary scenes as is");
+
+
+	class scene {
+	public:
+		std::vector<scene_material> materials;
+		std::vector<scene_object> objects;
+
+	private:
+		struct binary_header {
+			char magic[4];
+			uint32_t version;
+			uint32_t material_count;
+			uint32_t object_count;
+		};
+
+		static constexpr const char *binary_magic = "CGSB";
+		static const uint32_t binary_version = 2;
+
+		// What is wrong with an object's mesh parameters, or empty if
+		// nothing is, so a bad scene fails to load instead of drawing
+		static std::string meshError(const mesh_cache::key &k) {
+			auto positive = [](float x) { return x > 0 && std::isfinite(x); };
+			auto tessellation = [&]() -> std::string {
+				if (k.slices < 1 || k.slices > max_tessellation || k.stacks < 1 || k.stacks > max_tessellation) {
+					return "slices and stacks must be from 1 to " + std::to_string(max_tessellation);
+				}
+				return "";
+			};
+			switch (k.s) {
+			case mesh_cache::shape::sphere:
+				if (!positive(k.radius0)) return "radius must be positive";
+				return tessellation();
+			case mesh_cache::shape::cylinder:
+				if (!(k.radius0 >= 0 && k.radius1 >= 0) || !(positive(k.radius0) || positive(k.radius1))
+					|| !std::isfinite(k.radius0) || !std::isfinite(k.radius1)) {
+					return "radii must not be negative, and one must be positive";
+				}
+				if (!positive(k.height)) return "height must be positive";
+				return tessellation();
+			case mesh_cache::shape::plane:
+				if (!positive(k.radius0)) return "size must be positive";
+				return "";
+			default:
+				return "unknown shape";
+			}
+		}
+
+	public:
+		static const int max_tessellation = 1024; // slices or stacks
+
+		// Loads either format, binary files are recognised by their magic
+		static scene load(const std::string &filename) {
+			std::ifstream file(filename, std::ios::binary);
+			if (!file) throw std::runtime_error("Error: Could not locate and open file " + filename);
+
+			char magic[4] = { };
+			file.read(magic, 4);
+			file.clear();
+			file.seekg(0);
+
+			if (std::memcmp(magic, binary_magic, 4) == 0) return readBinary(file, filename);
+			return readText(file, filename);
+		}
+
+		void writeBinary(const std::string &filename) const {
+			std::ofstream file(filename, std::ios::binary);
+			if (!file) throw std::runtime_error("Error: Could not open file " + filename + " for writing");
+
+			binary_header header;
+			std::memcpy(header.magic, binary_magic, 4);
+			header.version = binary_version;
+			header.material_count = uint32_t(materials.size());
+			header.object_count = uint32_t(objects.size());
+
+			file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+			file.write(reinterpret_cast<const char *>(materials.data()), materials.size() * sizeof(scene_material));
+			file.write(reinterpret_cast<const char *>(objects.data()), objects.size() * sizeof(scene_object));
+			if (!file) throw std::runtime_error("Error: Failed writing scene " + filename);
+		}
+
+		// Recomputes every object's world space bounds from its mesh and
+		// model matrix
+		void updateBounds() {
+			for (scene_object &o : objects) {
+				o.bounds = transformBounds(mesh_cache::bounds(o.mesh), o.model);
+			}
+		}
+
+		// For each material, the index of the first material with the same
+		// values, so draws can skip setting a material that is already set
+		std::vector<uint32_t> uniqueMaterials() const {
+			std::map<std::tuple<float, float, float, float, float, float, float, uint32_t>, uint32_t> first;
+			std::vector<uint32_t> unique;
+			for (const scene_material &m : materials) {
+				auto values = std::make_tuple(m.diffuse.x, m.diffuse.y, m.diffuse.z, m.specular.x, m.specular.y, m.specular.z, m.shininess, m.emissive);
+				unique.push_back(first.emplace(values, uint32_t(unique.size())).first->second);
+			}
+			return unique;
+		}
+
+		// A floor covered in count randomly placed and coloured spheres,
+		// cylinders and cones, with a handful of shared materials, for
+		// benchmarking how the renderer scales with the object count
+		static scene generate(int count, unsigned seed) {
+			const int num_materials = 16;
+			const float half_size = 40;
+			const float clear_radius = 15; // around the origin, where the camera orbits
+
+			scene s;
+			std::default_random_engine rng(seed);
+			std::uniform_real_distribution<float> unit(0, 1);
+
+			for (int i = 0; i < num_materials; ++i) {
+				scene_material m;
+				vec3 chroma(unit(rng), unit(rng), unit(rng));
+				float ratio = unit(rng);
+				m.diffuse = chroma * chroma * (1 - ratio);
+				m.specular = chroma * ratio;
+				m.shininess = std::pow(2.f, 10 * unit(rng));
+				s.materials.push_back(m);
+			}
+
+			scene_material floor;
+			floor.diffuse = vec3(0.32f);
+			floor.specular = vec3(0.4f);
+			floor.shininess = 100;
+			s.materials.push_back(floor);
+
+			scene_object plane;
+			plane.mesh = { mesh_cache::shape::plane, half_size, 0, 0, 0, 0 };
+			plane.material = num_materials;
+			plane.model = mat4::translate(0, -0.01, 0);
+			s.objects.push_back(plane);
+
+			// Few distinct sizes, so the objects share a few cached meshes
+			std::uniform_real_distribution<float> pos(-half_size, half_size);
+			std::uniform_int_distribution<int> size(1, 4);
+			std::uniform_int_distribution<int> shape(0, 2);
+			std::uniform_int_distribution<int> material(0, num_materials - 1);
+			auto position = [&](float y) {
+				vec3 p;
+				do {
+					p = vec3(pos(rng), y, pos(rng));
+				} while (p.x * p.x + p.z * p.z < clear_radius * clear_radius);
+				return p;
+			};
+
+			for (int i = 0; i < count; ++i) {
+				scene_object o;
+				float r = 0.25f * size(rng);
+				switch (shape(rng)) {
+				case 0:
+					o.mesh = { mesh_cache::shape::sphere, r, 0, 0, 20, 20 };
+					o.model = mat4::translate(position(r));
+					break;
+				case 1:
+					o.mesh = { mesh_cache::shape::cylinder, r, r, 4 * r, 20, 4 };
+					o.model = mat4::translate(position(0)) * mat4::rotateX(radians(-90.f));
+					break;
+				default:
+					o.mesh = { mesh_cache::shape::cylinder, r, 0, 3 * r, 20, 4 };
+					o.model = mat4::translate(position(0)) * mat4::rotateX(radians(-90.f));
+					break;
+				}
+				o.material = uint32_t(material(rng));
+				s.objects.push_back(o);
+			}
+
+			s.updateBounds();
+			return s;
+		}
+
+	private:
+		static scene readBinary(std::istream &file, const std::string &filename) {
+			binary_header header;
+			file.read(reinterpret_cast<char *>(&header), sizeof(header));
+			if (!file || header.version != binary_version) {
+				throw std::runtime_error("Error: Unsupported binary scene " + filename);
+			}
+
+			scene s;
+			s.materials.resize(header.material_count);
+			s.objects.resize(header.object_count);
+			file.read(reinterpret_cast<char *>(s.materials.data()), s.materials.size() * sizeof(scene_material));
+			file.read(reinterpret_cast<char *>(s.objects.data()), s.objects.size() * sizeof(scene_object));
+			if (!file) throw std::runtime_error("Error: Truncated binary scene " + filename);
+
+			for (size_t i = 0; i < s.objects.size(); ++i) {
+				const scene_object &o = s.objects[i];
+				if (o.material >= s.materials.size()) throw std::runtime_error("Error: Bad material index in " + filename);
+				std::string error = meshError(o.mesh);
+				if (!error.empty()) throw std::runtime_error("Error: " + filename + ": object " + std::to_string(i) + ": " + error);
+			}
+			return s;
+		}
+
+		static scene readText(std::istream &file, const std::string &filename) {
+			scene s;
+			std::unordered_map<std::string, uint32_t> material_names;
+			std::string line;
+
+			for (int line_number = 1; std::getline(file, line); ++line_number) {
+				auto fail = [&](const std::string &message) {
+					return std::runtime_error("Error: " + filename + ":" + std::to_string(line_number) + ": " + message);
+				};
+
+				line = line.substr(0, line.find('#'));
+				std::istringstream ss(line);
+				std::string statement;
+				if (!(ss >> statement)) continue;
+
+				if (statement == "material") {
+					std::string name;
+					scene_material m;
+					if (!(ss >> name >> m.diffuse.x >> m.diffuse.y >> m.diffuse.z
+						>> m.specular.x >> m.specular.y >> m.specular.z >> m.shininess)) {
+						throw fail("expected material <name> <diffuse r g b> <specular r g b> <shininess>");
+					}
+					std::string flag;
+					if (ss >> flag) {
+						if (flag != "emissive") throw fail("unknown material flag " + flag);
+						m.emissive = 1;
+					}
+					if (!material_names.emplace(name, uint32_t(s.materials.size())).second) {
+						throw fail("material " + name + " declared twice");
+					}
+					s.materials.push_back(m);
+					continue;
+				}
+
+				scene_object o;
+				mesh_cache::key &k = o.mesh;
+				bool ok;
+				if (statement == "sphere") {
+					k = { mesh_cache::shape::sphere, 0, 0, 0, 0, 0 };
+					ok = bool(ss >> k.radius0 >> k.slices >> k.stacks);
+				} else if (statement == "cylinder") {
+					k = { mesh_cache::shape::cylinder, 0, 0, 0, 0, 0 };
+					ok = bool(ss >> k.radius0 >> k.radius1 >> k.height >> k.slices >> k.stacks);
+				} else if (statement == "cone") {
+					k = { mesh_cache::shape::cylinder, 0, 0, 0, 0, 0 };
+					ok = bool(ss >> k.radius0 >> k.height >> k.slices >> k.stacks);
+				} else if (statement == "plane") {
+					k = { mesh_cache::shape::plane, 0, 0, 0, 0, 0 };
+					ok = bool(ss >> k.radius0);
+				} else {
+					throw fail("unknown statement " + statement);
+				}
+				if (!ok) throw fail("missing or bad " + statement + " parameters");
+				std::string error = meshError(k);
+				if (!error.empty()) throw fail(statement + " " + error);
+
+				std::string name;
+				if (!(ss >> name)) throw fail("expected a material");
+				auto it = material_names.find(name);
+				if (it == material_names.end()) throw fail("unknown material " + name);
+				o.material = it->second;
+
+				std::string transform;
+				while (ss >> transform) {
+					if (transform == "translate") {
+						vec3 d;
+						if (!(ss >> d.x >> d.y >> d.z)) throw fail("expected translate x y z");
+						o.model = o.model * mat4::translate(d);
+					} else if (transform == "rotate") {
+						std::string axis;
+						float degrees;
+						if (!(ss >> axis >> degrees)) throw fail("expected rotate x|y|z <degrees>");
+						if (axis == "x") o.model = o.model * mat4::rotateX(radians(degrees));
+						else if (axis == "y") o.model = o.model * mat4::rotateY(radians(degrees));
+						else if (axis == "z") o.model = o.model * mat4::rotateZ(radians(degrees));
+						else throw fail("unknown axis " + axis);
+					} else if (transform == "scale") {
+						float f;
+						if (!(ss >> f)) throw fail("expected scale s");
+						o.model = o.model * mat4::scale(f);
+					} else {
+						throw fail("unknown transform " + transform);
+					}
+				}
+
+				s.objects.push_back(o);
+			}
+
+			s.updateBounds();
+			return s;
+		}
+	};
+}
@@ -0,0 +1,135 @@
+//---------------------------------------------------------------------------
+//
+// Copyright (c) 2016 Taehyun Rhee, Joshua Scott, Ben Allen
+//
+// This software is provided 'as-is' for assignment of COMP308 in ECS,
+// Victoria University of Wellington, without any express or implied warranty. 
+// In no event will the authors be held liable for any damages arising from
+// the use of this software.
+//
+// The contents of this file may not be copied or duplicated in any form
+// without the prior permission of its owner.
+//
+//----------------------------------------------------------------------------
+
+//----------------------------------------------------------------------------
+//
+// Post-transform vertex cache
+//
+// GPUs keep the last few transformed vertices of an indexed draw, so a
+// vertex referenced again soon after is not transformed again. The generated
+// meshes share vertices between rows, but emitting the triangles a row at a
+// time means a vertex's second use is a whole row later, long after it has
+// been evicted, so nearly every vertex is transformed twice.
+//
+// optimizeVertexCache reorders the triangles with Tipsify (Sander, Nehab and
+// Barczak, "Fast Triangle Reordering for Vertex Locality and Reduced
+// Overdraw", 2007): it emits every remaining triangle around one vertex, then
+// moves to a vertex those triangles brought into the cache that will still
+// be there when its own triangles are emitted. It runs in linear time and
+// keeps every triangle's winding.
+//
+// vertexCacheMisses simulates a FIFO cache to measure the result. Misses per
+// triangle (the average cache miss ratio, ACMR) is 3 at worst, around 1 for
+// row order grids, and approaches 0.5 for large well ordered grids.
+//
+//----------------------------------------------------------------------------
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace cgra {
+
+	// Entries assumed by default, small enough for any GPU's cache
+	const int vertex_cache_size = 16;
+
+	// Vertices a FIFO cache of cache_size entries would transform drawing
+	// the triangle list indices, over vertex_count vertices
+	template <typename Index>
+	size_t vertexCacheMisses(const std::vector<Index> &indices, size_t vertex_count, int cache_size = vertex_cache_size) {
+		// a vertex is cached if fewer than cache_size misses came after its own
+		std::vector<int64_t> missed_at(vertex_count, -int64_t(cache_size) - 1);
+		int64_t misses = 0;
+		for (Index v : indices) {
+			if (misses - missed_at[v] > cache_size) missed_at[v] = misses++;
+		}
+		return size_t(misses);
+	}
+
+	// Reorders the triangles of the triangle list indices, over vertex_count
+	// vertices, for a cache of cache_size entries (see above)
+	template <typename Index>
+	void optimizeVertexCache(std::vector<Index> &indices, size_t vertex_count, int cache_size = vertex_cache_size) {
+		size_t triangle_count = indices.size() / 3;
+		if (triangle_count == 0) return;
+
+		// triangles around each vertex, in order
+		std::vector<uint32_t> live(vertex_count, 0);
+		for (Index v : indices) live[v]++;
+		std::vector<uint32_t> first(vertex_count + 1, 0);
+		for (size_t v = 0; v < vertex_count; ++v) first[v + 1] = first[v] + live[v];
+		std::vector<uint32_t> adjacent(indices.size());
+		{
+			std::vector<uint32_t> fill(first.begin(), first.end() - 1);
+			for (size_t i = 0; i < indices.size(); ++i) adjacent[fill[indices[i]]++] = uint32_t(i / 3);
+		}
+
+		std::vector<int64_t> cached_at(vertex_count, -int64_t(cache_size) - 1);
+		std::vector<uint8_t> emitted(triangle_count, 0);
+		std::vector<Index> dead_ends; // recently used vertices to fall back on
+		std::vector<Index> candidates;
+		std::vector<Index> out;
+		out.reserve(triangle_count * 3);
+		int64_t time = 0;
+		size_t cursor = 0;
+
+		auto nextVertex = [&]() -> int64_t {
+			// the candidate longest in the cache that will still be there
+			// after its remaining triangles (at most 2 new vertices each)
+			int64_t best = -1, best_priority = -1;
+			for (Index v : candidates) {
+				if (live[v] == 0) continue;
+				int64_t priority = 0;
+				if (time - cached_at[v] + 2 * int64_t(live[v]) <= cache_size) priority = time - cached_at[v];
+				if (priority > best_priority) {
+					best = v;
+					best_priority = priority;
+				}
+			}
+			if (best >= 0) return best;
+
+			// dead end, so fall back to a recent vertex, then any in order
+			while (!dead_ends.empty()) {
+				Index v = dead_ends.back();
+				dead_ends.pop_back();
+				if (live[v] > 0) return v;
+			}
+			for (; cursor < vertex_count; ++cursor) {
+				if (live[cursor] > 0) return int64_t(cursor);
+			}
+			return -1;
+		};
+
+		for (int64_t fan = nextVertex(); fan >= 0; fan = nextVertex()) {
+			candidates.clear();
+			for (uint32_t a = first[fan]; a < first[fan + 1]; ++a) {
+				uint32_t t = adjacent[a];
+				if (emitted[t]) continue;
+				emitted[t] = 1;
+				for (int j = 0; j < 3; ++j) {
+					Index v = indices[3 * t + j];
+					out.push_back(v);
+					dead_ends.push_back(v);
+					candidates.push_back(v);
+					live[v]--;
+					if (time - cached_at[v] > cache_size) cached_at[v] = time++;
+				}
+			}
+		}
+
+		indices.swap(out);
+	}
+}
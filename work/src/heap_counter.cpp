@@ -0,0 +1,63 @@
+//---------------------------------------------------------------------------
+//
+// Copyright (c) 2016 Taehyun Rhee, Joshua Scott, Ben Allen
+//
+// This software is provided 'as-is' for assignment of COMP308 in ECS,
+// Victoria University of Wellington, without any express or implied warranty. 
+// In no event will the authors be held liable for any damages arising from
+// the use of this software.
+//
+// The contents of this file may not be copied or duplicated in any form
+// without the prior permission of its owner.
+//
+//----------------------------------------------------------------------------
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+#include "heap_counter.hpp"
+
+
+namespace {
+	std::atomic<unsigned long long> g_allocations { 0 };
+
+	void * allocate(std::size_t size) {
+		g_allocations++;
+		return std::malloc(size ? size : 1);
+	}
+}
+
+
+unsigned long long cgra::heapAllocations() {
+	return g_allocations.load();
+}
+
+
+// Every replaceable form up to C++14, so nothing reaches the default
+// allocator and every delete matches its new
+
+void * operator new(std::size_t size) {
+	if (void *p = allocate(size)) return p;
+	throw std::bad_alloc();
+}
+
+void * operator new[](std::size_t size) {
+	if (void *p = allocate(size)) return p;
+	throw std::bad_alloc();
+}
+
+void * operator new(std::size_t size, const std::nothrow_t &) noexcept {
+	return allocate(size);
+}
+
+void * operator new[](std::size_t size, const std::nothrow_t &) noexcept {
+	return allocate(size);
+}
+
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete[](void *p) noexcept { std::free(p); }
+void operator delete(void *p, std::size_t) noexcept { std::free(p); }
+void operator delete[](void *p, std::size_t) noexcept { std::free(p); }
+void operator delete(void *p, const std::nothrow_t &) noexcept { std::free(p); }
+void operator delete[](void *p, const std::nothrow_t &) noexcept { std::free(p); }
@@ -0,0 +1,32 @@
+//---------------------------------------------------------------------------
+//
+// Copyright (c) 2016 Taehyun Rhee, Joshua Scott, Ben Allen
+//
+// This software is provided 'as-is' for assignment of COMP308 in ECS,
+// Victoria University of Wellington, without any express or implied warranty. 
+// In no event will the authors be held liable for any damages arising from
+// the use of this software.
+//
+// The contents of this file may not be copied or duplicated in any form
+// without the prior permission of its owner.
+//
+//----------------------------------------------------------------------------
+
+//----------------------------------------------------------------------------
+//
+// Heap allocation counter for the checks
+//
+// Linking heap_counter.cpp replaces the global operator new and delete with
+// versions that count every allocation, so a check can assert a stretch of
+// code made none. Only the check targets link it; the renderer keeps the
+// standard library's allocator.
+//
+//----------------------------------------------------------------------------
+
+#pragma once
+
+namespace cgra {
+
+	// Calls to any form of operator new so far
+	unsigned long long heapAllocations();
+}
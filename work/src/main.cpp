@@ -12,25 +12,50 @@
 //
 //----------------------------------------------------------------------------
 
+#include <algorithm>
 #include <cmath>
+#include <cstdio>
 #include <cstdlib>
 #include <chrono>
+#include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <map>
+#include <random>
 #include <sstream>
 #include <string>
 #include <stdexcept>
+#include <thread>
 #include <vector>
 
+#include "cgra_airlight.hpp"
+#include "cgra_bvh.hpp"
+#include "cgra_camera.hpp"
+#include "cgra_cluster.hpp"
+#include "cgra_draw_list.hpp"
 #include "cgra_geometry.hpp"
+#include "cgra_hiz.hpp"
+#include "cgra_lights.hpp"
+#include "cgra_lod.hpp"
 #include "cgra_math.hpp"
+#include "cgra_parallel.hpp"
+#include "cgra_raster.hpp"
+#include "cgra_scene.hpp"
+#include "simple_benchmark.hpp"
 #include "simple_image.hpp"
+#include "simple_profiler.hpp"
 #include "simple_shader.hpp"
 #include "simple_gui.hpp"
 #include "opengl.hpp"
 
+#ifdef CGRA_HEAP_COUNTER
+#include "heap_counter.hpp"
+#endif
+
 using namespace std;
 using namespace cgra;
 
+
 // Window
 //
 GLFWwindow* g_window;
@@ -51,6 +76,9 @@ float g_pitch = 0;
 float g_yaw = 0;
 float g_zoom = 1.0;
 
+// View and projection for the current frame (see setupCamera)
+camera g_camera;
+
 
 // Buffers
 //
@@ -61,24 +89,166 @@ GLuint g_tex_scene_normal = 0;
 GLuint g_tex_scene_diffuse = 0;
 GLuint g_tex_scene_specular = 0;
 
+// G-buffer layout, chosen at startup with --compact-gbuffer
+//
+//   target     standard (28 B/px)          compact (16 B/px)
+//   depth      DEPTH24_STENCIL8            DEPTH24_STENCIL8
+//   normal     RGBA16F, xyz                RG16, octahedral
+//   diffuse    RGBA16F, rgb + emissive     RGBA8, sqrt(rgb) + emissive
+//   specular   RGBA16F, rgb + shininess    RGBA8, sqrt(rgb) + log2(shininess)
+//
+// Depth is attached to GL_DEPTH_STENCIL_ATTACHMENT in both, as light
+// volumes copy it into their own depth-stencil buffer (see ensureLightAccumFBO)
+//
+bool g_compact_gbuffer = false;
+
 
 // Shaders
 //
-GLuint g_scene_shader;
-GLuint g_deferred_shader;
+shader_program g_scene_shader;
+shader_program g_scene_instanced_shader;
+shader_program g_deferred_shader;
+shader_program g_inscatter_shader;
+shader_program g_froxel_inject_shader;
+shader_program g_froxel_integrate_shader;
+shader_program g_light_stencil_shader;
+shader_program g_light_volume_shader;
+shader_program g_hiz_build_shader;
+shader_program g_hiz_test_shader;
+
+// Uniforms set while rendering, resolved in every program once after it is
+// linked (see initShader), so the render loop indexes an array instead of
+// looking up names. Programs that don't use one get -1, which glUniform*
+// ignores. g_uniform_names must list them in the same order
+enum uniform_slot {
+	u_airlight, u_cluster_dims, u_cluster_grid, u_cluster_lights,
+	u_cluster_slice_scale, u_cluster_z_near, u_clustered, u_depth,
+	u_depth_size, u_diffuse, u_emissive, u_exposure, u_froxel_dims,
+	u_froxel_exponent, u_froxel_far, u_froxel_integral, u_froxel_scatter,
+	u_froxel_slice, u_froxel_volume, u_hiz, u_hiz_levels, u_inscatter,
+	u_inscatter_mode, u_inscatter_size, u_light_accum, u_light_data,
+	u_light_index, u_light_volumes, u_model_view_matrix, u_normal,
+	u_normal_matrix, u_num_lights, u_num_objects, u_object_bounds,
+	u_projection_matrix, u_projection_matrix_inverse, u_screen_size,
+	u_shininess, u_specular, u_view_projection, u_z_far, u_z_near,
+	u_z_unproject,
+	uniform_slot_count
+};
+const char * const g_uniform_names[uniform_slot_count] = {
+	"uAirlight", "uClusterDims", "uClusterGrid", "uClusterLights",
+	"uClusterSliceScale", "uClusterZNear", "uClustered", "uDepth",
+	"uDepthSize", "uDiffuse", "uEmissive", "uExposure", "uFroxelDims",
+	"uFroxelExponent", "uFroxelFar", "uFroxelIntegral", "uFroxelScatter",
+	"uFroxelSlice", "uFroxelVolume", "uHiZ", "uHiZLevels", "uInscatter",
+	"uInscatterMode", "uInscatterSize", "uLightAccum", "uLightData",
+	"uLightIndex", "uLightVolumes", "uModelViewMatrix", "uNormal",
+	"uNormalMatrix", "uNumLights", "uNumObjects", "uObjectBounds",
+	"uProjectionMatrix", "uProjectionMatrixInverse", "uScreenSize",
+	"uShininess", "uSpecular", "uViewProjection", "uZFar", "uZNear",
+	"uZUnproject"
+};
 
 
 
-// Lights
-struct Light {
-	vec3 acl_w; // acceleration
-	vec3 vel_w; // velocity
-	vec3 pos_w; // position
-	vec3 flux;
-	Light(vec3 p, vec3 f) : pos_w(p), flux(f), vel_w(0), acl_w(0) { }
-};
+// Scene
+// Loaded from g_scene_file (text or binary), or generated with
+// g_generate_scene objects for benchmarking. The cached mesh for each
+// object, and ids for its mesh and material, are looked up once after
+// loading. Objects with identical materials share a material id
+//
+// Objects are drawn from g_scene_draws, sorted by program, material, mesh
+// and depth if g_sort_draws (see cgra_draw_list.hpp), and only state that
+// changes between draws is set. g_scene_draw_stats counts the changes
+//
+string g_scene_file = "./work/res/scenes/default.scene";
+int g_generate_scene = -1; // object count, or -1 to load g_scene_file
+string g_write_scene; // if set, write the scene here as binary and exit
+scene g_scene;
+vector<const gl_mesh *> g_scene_meshes; // per object and level of detail
+vector<uint32_t> g_scene_mesh_ids;      // likewise
+vector<uint32_t> g_scene_material_ids;
+draw_list g_scene_draws;
+bool g_sort_draws = true;
+draw_list_stats g_scene_draw_stats;
+
+
+// Level of detail
+// Every scene object, and the light markers, have lod_policy::max_levels
+// meshes (see cgra_lod.hpp), and each is drawn at the level g_lod picks from
+// the projected size of its shape's radius (g_scene_lod_radius, in world
+// space), which is kept per object in g_scene_lod and per light in
+// g_marker_lod for the hysteresis. g_scene_triangles counts the triangles
+// the scene pass submitted last frame, and g_lod_counts the objects drawn at
+// each level
+//
+bool g_lod_enabled = true;
+lod_policy g_lod;
+vector<float> g_scene_lod_radius;
+vector<int> g_scene_lod; // level last drawn, or -1
+vector<int> g_marker_lod;
+int g_lod_counts[lod_policy::max_levels] = { };
+unsigned long long g_scene_triangles = 0;
+
+
+// Frustum culling
+// Objects are culled against the camera frustum with a BVH over their
+// world space bounds, built when the scene is loaded (objects are static)
+//
+bool g_frustum_culling = true;
+bvh g_scene_bvh;
+vector<uint32_t> g_visible_objects;
+bvh_cull_stats g_cull_stats;
+bool g_check_culling = false;
+
+
+// Occlusion culling
+// After the scene pass its depth is reduced into a Hi-Z pyramid (g_tex_hiz,
+// unit 12) and every object's bounds (g_tex_object_bounds, unit 13) are
+// tested against it, either on the GPU into g_tex_hiz_visible, or on the
+// CPU against a small level read back into g_hiz_cpu. The results are read
+// back through g_pbo_hiz and used the next frame, so when the camera moves
+// objects coming out from behind others appear a frame late
+//
+// occlusion_raster needs nothing from the GPU: the frustum visible objects
+// at least g_occluder_min_size across (bounding radius over distance) are
+// drawn as coarse occluders into g_occlusion_raster, a small CPU depth
+// buffer (see cgra_raster.hpp), and everything visible is tested against it
+// in the same frame, before any draws are submitted
+//
+enum occlusion_mode { occlusion_off, occlusion_gpu, occlusion_cpu, occlusion_raster };
+int g_occlusion_mode = occlusion_off;
+int g_hiz_readback_width = 64; // the CPU test reads the first level this narrow
+ivec2 g_hiz_size;
+int g_hiz_levels = 0;
+GLuint g_fbo_hiz = 0;
+GLuint g_tex_hiz = 0;
+GLuint g_tex_object_bounds = 0;
+GLuint g_tex_hiz_visible = 0;
+ivec2 g_hiz_visible_size;
+GLuint g_pbo_hiz = 0;
+int g_hiz_pending = occlusion_off; // which test's results are in the PBO
+ivec2 g_hiz_pending_size;
+int g_hiz_pending_level = 0;
+ivec2 g_hiz_pending_screen_size;
+mat4 g_hiz_pending_view_proj;
+vector<uint8_t> g_object_visible; // GPU test results, per object
+hiz_buffer g_hiz_cpu;
+int g_occluded_objects = 0;
+
+const int hiz_objects_per_row = 1024; // must match deferred_shader.frag
+
+occlusion_rasterizer g_occlusion_raster;
+int g_occlusion_raster_width = 256; // height follows the frame's aspect
+float g_occluder_min_size = 0.05f;
+map<mesh_cache::key, occluder_mesh> g_occluder_meshes;
+vector<const occluder_mesh *> g_scene_occluders; // per object
+raster_stats g_raster_stats;
+
 
-vector<Light> g_lights;
+
+// Lights
+// Stored as a structure of arrays (see cgra_lights.hpp)
+light_store g_lights;
 
 
 
@@ -89,6 +259,7 @@ float g_flux_mult = 15.0;
 
 // float g_bloom_thresh = 1.0;
 int g_num_lights = 4;
+int g_max_lights = 65536;
 bool g_simulate_lights = false;
 float g_min_light_speed = 0.01;
 float g_max_light_speed = 0.1;
@@ -99,6 +270,124 @@ vec3 g_zone_hize(30, 10, 30);
 vec3 g_zone_position(0, 10, 0);
 
 
+// Instancing
+// The stress test spheres are drawn with one instanced draw call, and the
+// light markers with one per level of detail, or one draw call per sphere
+// without instancing.
+// The stress spheres are scattered over the floor, regenerated from a fixed
+// seed whenever the count changes
+//
+bool g_instancing = true;
+int g_stress_instances = 0;
+int g_max_stress_instances = 1 << 20;
+vector<mesh_instance> g_stress_data;
+vector<mesh_instance> g_marker_data[lod_policy::max_levels];
+instanced_mesh g_stress_mesh;
+instanced_mesh g_marker_meshes[lod_policy::max_levels];
+const mesh_cache::key g_marker_sphere { mesh_cache::shape::sphere, 1, 0, 0, 10, 10 };
+int g_scene_draw_calls = 0;
+
+
+// Clustered lighting
+// Lights only reach as far as their influence radius (see
+// lightInfluenceRadius), which bounds the clusters and light volumes
+// g_light_threshold is the displayed luminance the radius is set at
+//
+bool g_cluster_lights = true;
+float g_light_threshold = 0.002; // about half an 8 bit step
+float g_cluster_zfar = 1000.0;
+light_cluster_grid g_light_clusters(16, 9, 24);
+GLuint g_tex_cluster_grid = 0;
+GLuint g_tex_cluster_lights = 0;
+int g_cluster_lights_rows = 0;
+const int g_cluster_lights_width = 4096; // must match cluster_lights_width in deferred_shader.frag
+
+// view-space light positions and radii, rebuilt every frame
+vector<vec3> g_light_pos_v;
+vector<float> g_light_radius;
+
+
+// Light data for the deferred shader
+// Packed structure-of-arrays in a float texture, light i is in column
+// i % g_light_data_width of row pair i / g_light_data_width, with its
+// view-space position and radius in the first row and flux in the second
+//
+GLuint g_tex_light_data = 0;
+int g_light_data_rows = 0; // allocated row pairs
+const int g_light_data_width = 1024; // must match light_data_width in deferred_shader.frag
+vector<vec4> g_light_data;
+
+
+// Volumetric in-scattering
+// Either computed per pixel in the deferred pass, computed in its own
+// pass at 1/g_inscatter_scale resolution and upsampled (depth-aware) by the
+// deferred pass, or looked up in a froxel volume
+// Must match the inscatter_ constants in deferred_shader.frag
+//
+enum inscatter_mode { inscatter_per_pixel, inscatter_low_res, inscatter_froxels };
+int g_inscatter_mode = inscatter_per_pixel;
+int g_inscatter_scale = 2; // 2 for half, 4 for quarter resolution
+ivec2 g_inscatter_size;
+GLuint g_fbo_inscatter = 0;
+GLuint g_tex_inscatter = 0;
+
+// Airlight integral table for the in-scattering (see cgra_airlight.hpp)
+GLuint g_tex_airlight = 0;
+
+
+// Surface lighting
+// Either every pixel loops over the lights in the deferred pass, or each
+// light's influence sphere is drawn and only shades the pixels it covers,
+// accumulated into g_tex_light_accum for the deferred pass to add
+//
+enum lighting_mode { lighting_fullscreen, lighting_volumes };
+int g_lighting_mode = lighting_fullscreen;
+ivec2 g_light_accum_size;
+GLuint g_fbo_light = 0;
+GLuint g_tex_light_accum = 0;
+GLuint g_rbo_light_depth = 0; // copy of the scene depth, and the stencil
+int g_light_volumes_drawn = 0;
+
+
+// Froxel volume
+// A grid over the view frustum, g_froxel_dims.xy screen tiles by
+// g_froxel_dims.z depth slices out to g_froxel_far. Slice boundaries are at
+// g_froxel_far * (t / slices)^g_froxel_exponent, so higher exponents give
+// thinner slices near the camera. Each light's scattering is injected into
+// every froxel it reaches, then integrated front to back along each ray
+//
+ivec3 g_froxel_dims(160, 90, 64);
+float g_froxel_far = 100.0; // in-scattering still stops at inscatter_range along each ray (deferred_shader.frag)
+float g_froxel_exponent = 2.0;
+ivec3 g_froxel_allocated;
+GLuint g_fbo_froxel = 0;
+GLuint g_tex_froxel_scatter = 0; // per froxel scattering and extinction
+GLuint g_tex_froxel_volume = 0; // integrated in-scattering and transmittance
+GLuint g_tex_froxel_integral[2] = { 0, 0 }; // one slice of it, read and written in turn while integrating
+
+
+// Headless benchmark settings (see parseArguments)
+bool g_headless = false;
+bool g_check_inscatter = false;
+bool g_check_mesh_cache = false;
+ivec2 g_headless_size(1280, 720);
+int g_bench_frames = 300;
+int g_bench_warmup = 10;
+string g_bench_csv = "benchmark.csv";
+vector<int> g_bench_lights; // light counts to sweep over, empty for just g_num_lights
+
+
+// Profiler
+// Every frame is profiled, a number of frames can be captured to a Chrome
+// trace from the GUI (or the whole benchmark with --trace)
+//
+frame_profiler g_profiler;
+string g_trace_file = "profile_trace.json";
+int g_trace_frames = 120;
+bool g_trace_pending = false;
+bool g_trace_benchmark = false;
+
+
 
 
 // Mouse Button callback
@@ -165,84 +454,683 @@ void charCallback(GLFWwindow *win, unsigned int c) {
 // An example of how to load a shader from a hardcoded location
 //
 void initShader() {
-	g_scene_shader = makeShaderProgramFromFile(
-		{GL_VERTEX_SHADER, GL_FRAGMENT_SHADER },
-		{ "./work/res/shaders/scene_shader.vert", "./work/res/shaders/scene_shader.frag" }
-	);
+	vector<string> defines;
+	if (g_compact_gbuffer) defines.push_back("COMPACT_GBUFFER");
 
-	g_deferred_shader = makeShaderProgramFromFile(
+	g_scene_shader = shader_program(makeShaderProgramFromFile(
+		{GL_VERTEX_SHADER, GL_FRAGMENT_SHADER },
+		{ "./work/res/shaders/scene_shader.vert", "./work/res/shaders/scene_shader.frag" },
+		defines
+	));
+
+	// Instance attributes have to be bound before linking, so link again
+	vector<string> instanced_defines = defines;
+	instanced_defines.push_back("INSTANCED");
+	GLuint instanced_prog = makeShaderProgramFromFile(
 		{GL_VERTEX_SHADER, GL_FRAGMENT_SHADER },
-		{ "./work/res/shaders/deferred_shader.vert", "./work/res/shaders/deferred_shader.frag" }
+		{ "./work/res/shaders/scene_shader.vert", "./work/res/shaders/scene_shader.frag" },
+		instanced_defines
 	);
+	glBindAttribLocation(instanced_prog, instance_pos_scale_attrib, "aInstancePosScale");
+	glBindAttribLocation(instanced_prog, instance_color_attrib, "aInstanceColor");
+	linkShaderProgram(instanced_prog);
+	g_scene_instanced_shader = shader_program(instanced_prog);
+
+	// The in-scatter and froxel passes are the deferred shader with a
+	// different main, chosen by a define
+	auto makeDeferredProgram = [&](const char *pass) {
+		vector<string> pass_defines = defines;
+		if (pass) pass_defines.push_back(pass);
+		return shader_program(makeShaderProgramFromFile(
+			{GL_VERTEX_SHADER, GL_FRAGMENT_SHADER },
+			{ "./work/res/shaders/deferred_shader.vert", "./work/res/shaders/deferred_shader.frag" },
+			pass_defines
+		));
+	};
+
+	g_deferred_shader = makeDeferredProgram(nullptr);
+	g_inscatter_shader = makeDeferredProgram("INSCATTER_PASS");
+	g_froxel_inject_shader = makeDeferredProgram("FROXEL_INJECT_PASS");
+	g_froxel_integrate_shader = makeDeferredProgram("FROXEL_INTEGRATE_PASS");
+	g_light_stencil_shader = makeDeferredProgram("LIGHT_STENCIL_PASS");
+	g_light_volume_shader = makeDeferredProgram("LIGHT_VOLUME_PASS");
+	g_hiz_build_shader = makeDeferredProgram("HIZ_BUILD_PASS");
+	g_hiz_test_shader = makeDeferredProgram("HIZ_TEST_PASS");
+
+	for (shader_program *prog : {
+		&g_scene_shader, &g_scene_instanced_shader, &g_deferred_shader, &g_inscatter_shader,
+		&g_froxel_inject_shader, &g_froxel_integrate_shader, &g_light_stencil_shader,
+		&g_light_volume_shader, &g_hiz_build_shader, &g_hiz_test_shader,
+	}) {
+		prog->resolveSlots(g_uniform_names, uniform_slot_count);
+	}
 }
 
 
-void addLight() {
-	// creation
-	vec3 position = (vec3::random(-20, 20) + vec3(0, 20, 0)) * vec3(1, 0.3, 1);
-	vec3 flux = normalize(vec3::random(0, 1));
-	Light l = Light(position, flux);
+// Builds the airlight table and uploads it to unit 10, where it stays
+// 
+void initAirlight() {
+	airlight_table table;
+
+	glActiveTexture(GL_TEXTURE10);
+	glGenTextures(1, &g_tex_airlight);
+	glBindTexture(GL_TEXTURE_2D, g_tex_airlight);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, airlight_table::gamma_size, airlight_table::k_size, 0, GL_RED, GL_FLOAT, table.data());
+	glActiveTexture(GL_TEXTURE0);
+}
 
-	// intial velocity
-	vec3 velocity = 0.01 * normalize(vec3::random(-1, 1));
-	l.vel_w = velocity;
 
-	g_lights.push_back(l);
+// Compares the tabulated in-scattering with a finely marched reference
+// over random rays and lights, half of them passing close to the light
+// Returns false if the error is over the bound
+// 
+bool checkInscatter(ostream &out) {
+	const int num_rays = 4000;
+	const double max_error = 0.02; // relative
+
+	airlight_table table;
+	default_random_engine rng(1);
+	uniform_real_distribution<float> unit(-1, 1);
+	uniform_real_distribution<float> length(0.5, 100);
+	uniform_real_distribution<float> near(airlight_table::min_distance, 2);
+
+	vector<double> errors;
+	for (int i = 0; i < num_rays; ++i) {
+		vec3 dir = normalize(vec3(unit(rng), unit(rng), unit(rng)) + vec3(0, 0, 0.001));
+		float d_max = length(rng);
+		vec3 light_pos = 50 * vec3(unit(rng), unit(rng), unit(rng));
+		if (i % 2) {
+			vec3 side = normalize(cross(dir, vec3(unit(rng), unit(rng), unit(rng))));
+			light_pos = dir * length(rng) + side * near(rng);
+		}
+
+		double expected = airlight_table::inscatterReference(vec3(0), dir, d_max, light_pos, vec3(1)).x;
+		double actual = table.inscatter(vec3(0), dir, d_max, light_pos, vec3(1)).x;
+		errors.push_back(abs(actual - expected) / expected);
+	}
+	sort(errors.begin(), errors.end());
+
+	bool pass = errors.back() <= max_error;
+	out << "In-scatter table vs reference : " << num_rays << " rays, relative error"
+		<< fixed << setprecision(3)
+		<< " p50 " << 100 * errors[num_rays / 2] << "%"
+		<< " p99 " << 100 * errors[num_rays * 99 / 100] << "%"
+		<< " max " << 100 * errors.back() << "% (bound " << 100 * max_error << "%) "
+		<< (pass ? "pass" : "FAIL") << endl;
+	return pass;
+}
+
+
+// Culls generated scenes of increasing size from a few views, with the BVH
+// and by testing every object, and reports the time each takes
+// Returns false if they ever disagree
+// 
+bool checkCulling(ostream &out) {
+	const int repeats = 10;
+	const vec2 views[] = { { 0, 0 }, { 20, 135 }, { 90, 0 } }; // pitch, yaw
+
+	bool pass = true;
+	out << fixed << setprecision(3);
+	for (int count : { 1000, 10000, 100000, 1000000 }) {
+		scene s = scene::generate(count, 1);
+		vector<aabb> bounds;
+		for (const scene_object &o : s.objects) bounds.push_back(o.bounds);
+
+		auto start = chrono::steady_clock::now();
+		bvh tree;
+		tree.build(bounds);
+		double build_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+		out << "Culling " << s.objects.size() << " objects, BVH of " << tree.nodeCount() << " nodes built in " << build_ms << " ms" << endl;
+
+		for (const vec2 &v : views) {
+			camera cam;
+			cam.setPerspective(g_fovy, 16 / 9.f, g_znear, g_zfar);
+			cam.setOrbit(v.x, v.y, 10);
+			frustum f(cam.projection() * cam.view());
+
+			vector<uint32_t> visible, expected;
+			bvh_cull_stats stats;
+			start = chrono::steady_clock::now();
+			for (int i = 0; i < repeats; ++i) {
+				visible.clear();
+				tree.cull(f, visible, &stats);
+			}
+			double bvh_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count() / repeats;
+
+			start = chrono::steady_clock::now();
+			for (int i = 0; i < repeats; ++i) {
+				expected.clear();
+				for (size_t j = 0; j < bounds.size(); ++j) {
+					if (f.test(bounds[j]) != frustum::outside) expected.push_back(uint32_t(j));
+				}
+			}
+			double brute_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count() / repeats;
+
+			sort(visible.begin(), visible.end());
+			bool same = visible == expected;
+			pass = pass && same;
+			out << "  view (" << int(v.x) << ", " << int(v.y) << "): " << stats.visible << " visible, "
+				<< stats.nodes_tested << " nodes + " << stats.objects_tested << " objects tested, "
+				<< "BVH " << bvh_ms << " ms, every object " << brute_ms << " ms " << (same ? "match" : "MISMATCH") << endl;
+		}
+	}
+	out.unsetf(ios::floatfield);
+	return pass;
 }
 
 
 void updateLights() {
-	while(g_lights.size() < g_num_lights)
-		addLight();
-	while(g_lights.size() > g_num_lights)
-		g_lights.pop_back();
+	profile_scope scope(g_profiler, "update lights");
+
+	g_num_lights = std::max(0, std::min(g_num_lights, g_max_lights));
+	g_lights.resize(g_num_lights);
 
 	if(g_simulate_lights) {
+		light_motion motion;
+		motion.zone_min = g_zone_position - g_zone_hize;
+		motion.zone_max = g_zone_position + g_zone_hize;
+		motion.min_speed = g_min_light_speed;
+		motion.max_speed = g_max_light_speed;
+
+		// splits over the worker pool when there are many lights
+		g_lights.step(motion, &workerPool());
+	}
+}
+
+
+// Distance at which a light, on a white surface facing it, would be
+// displayed at g_light_threshold luminance with the current exposure
+// The shader fades lights out to 0 at this radius (see light_window in
+// deferred_shader.frag), so nothing past it needs shading. Ignores
+// transmittance and specular peaks, which are only brighter up close
+//
+float lightInfluenceRadius(const vec3 &light_flux) {
+	float luminance = g_flux_mult * dot(light_flux, vec3(0.2126, 0.7152, 0.0722));
+	return sqrt(std::max(g_exposure * luminance, 0.f) / (float(math::pi()) * g_light_threshold));
+}
+
+
+// Sets up where the camera is in the scene
+// Called once per frame, the passes read the matrices from g_camera
+// 
+void setupCamera(int width, int height) {
+	g_camera.setPerspective(g_fovy, width / float(height), g_znear, g_zfar);
+	g_camera.setOrbit(g_pitch, g_yaw, 10 * g_zoom);
+}
+
+
+// Sets the per-draw matrices in the scene shader for an object
+// 
+void setModelMatrix(const mat4 &model) {
+	mat4 model_view = g_camera.modelView(model);
+	glUniformMatrix4fv(g_scene_shader.location(u_model_view_matrix), 1, false, model_view.dataPointer());
+	glUniformMatrix3fv(g_scene_shader.location(u_normal_matrix), 1, false, camera::normalMatrix(model_view).dataPointer());
+}
+
+
+// Regenerates the stress test spheres if the count has changed
+// 
+void ensureStressInstances() {
+	size_t count = size_t(std::min(std::max(g_stress_instances, 0), g_max_stress_instances));
+	if (g_stress_data.size() == count) return;
+
+	default_random_engine rng(1);
+	uniform_real_distribution<float> xz(-40, 40);
+	uniform_real_distribution<float> y(0.5, 20);
+	uniform_real_distribution<float> scale(0.2, 0.5);
+	uniform_real_distribution<float> unit(0, 1);
+
+	g_stress_data.resize(count);
+	for (mesh_instance &inst : g_stress_data) {
+		inst.pos_scale = vec4(xz(rng), y(rng), xz(rng), scale(rng));
+		inst.color = vec4(unit(rng), unit(rng), unit(rng), 1);
+	}
+
+	g_stress_mesh.setMesh(meshCache().sphere(1, 10, 10));
+	g_stress_mesh.upload(g_stress_data.data(), g_stress_data.size());
+}
+
+
+// Loads or generates g_scene, returns false (with a message) if it fails
+// 
+bool loadScene() {
+	auto start = chrono::steady_clock::now();
+	try {
+		if (g_generate_scene >= 0) g_scene = scene::generate(g_generate_scene, 1);
+		else g_scene = scene::load(g_scene_file);
+	} catch (const exception &e) {
+		cerr << e.what() << endl;
+		return false;
+	}
+	double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+	cout << "Scene: " << g_scene.objects.size() << " objects, " << g_scene.materials.size() << " materials ("
+		<< (g_generate_scene >= 0 ? "generated" : g_scene_file) << ", " << fixed << setprecision(2) << ms << " ms)" << endl;
+	cout.unsetf(ios::floatfield);
+
+	g_scene_meshes.clear();
+	g_scene_draws.clear();
+	return true;
+}
+
+
+// Uploads the bounds of every scene object for the Hi-Z test, and sizes
+// its output to match. Results from before are dropped
+// 
+void uploadObjectBounds() {
+	size_t count = g_scene.objects.size();
+	int width = int(std::min(count, size_t(hiz_objects_per_row)));
+	int rows = int((count + hiz_objects_per_row - 1) / hiz_objects_per_row);
+
+	// min then max, so object i is at texels 2i and 2i + 1 of the array
+	vector<vec4> data(size_t(2 * width) * rows);
+	for (size_t i = 0; i < count; ++i) {
+		data[2 * i] = vec4(g_scene.objects[i].bounds.min, 1);
+		data[2 * i + 1] = vec4(g_scene.objects[i].bounds.max, 1);
+	}
+
+	glActiveTexture(GL_TEXTURE13);
+	if (!g_tex_object_bounds) {
+		glGenTextures(1, &g_tex_object_bounds);
+		glBindTexture(GL_TEXTURE_2D, g_tex_object_bounds);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	}
+	glBindTexture(GL_TEXTURE_2D, g_tex_object_bounds);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, 2 * std::max(width, 1), std::max(rows, 1), 0, GL_RGBA, GL_FLOAT, count ? data.data() : nullptr);
+
+	// the bounds stay bound to unit 13
+	glActiveTexture(GL_TEXTURE0);
+	if (!g_tex_hiz_visible) {
+		glGenTextures(1, &g_tex_hiz_visible);
+		glBindTexture(GL_TEXTURE_2D, g_tex_hiz_visible);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	}
+	glBindTexture(GL_TEXTURE_2D, g_tex_hiz_visible);
+	g_hiz_visible_size = ivec2(std::max(width, 1), std::max(rows, 1));
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, g_hiz_visible_size.x, g_hiz_visible_size.y, 0, GL_RED, GL_UNSIGNED_BYTE, nullptr);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	g_object_visible.clear();
+	g_hiz_cpu = hiz_buffer();
+	g_hiz_pending = occlusion_off;
+}
+
+
+// Creates or resizes the Hi-Z pyramid, level 0 half the frame size
+// 
+void ensureHiZ(int w, int h) {
+	ivec2 size(std::max(1, w / 2), std::max(1, h / 2));
+	if (size == g_hiz_size) return;
+
+	if (!g_fbo_hiz) glGenFramebuffers(1, &g_fbo_hiz);
+
+	glActiveTexture(GL_TEXTURE12);
+	if (!g_tex_hiz) {
+		glGenTextures(1, &g_tex_hiz);
+		glBindTexture(GL_TEXTURE_2D, g_tex_hiz);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	}
+	glBindTexture(GL_TEXTURE_2D, g_tex_hiz);
+	g_hiz_levels = 0;
+	for (ivec2 level = size; ; level = cgra::max(level / 2, ivec2(1))) {
+		glTexImage2D(GL_TEXTURE_2D, g_hiz_levels++, GL_R32F, level.x, level.y, 0, GL_RED, GL_FLOAT, nullptr);
+		if (level == ivec2(1)) break;
+	}
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, g_hiz_levels - 1);
+	glActiveTexture(GL_TEXTURE0);
 
-		vec3 zone_min = g_zone_position - g_zone_hize;
-		vec3 zone_max = g_zone_position + g_zone_hize;
+	g_hiz_size = size;
+	g_hiz_cpu = hiz_buffer();
+	if (g_hiz_pending == occlusion_cpu) g_hiz_pending = occlusion_off;
+}
 
-		for (Light &l : g_lights) {
 
-			// apply acceleration if outside zone
-			vec3 accel;
-			accel += 0.01 * mix(vec3(0.0), vec3(1.0), lessThanEqual(l.pos_w, zone_min));
-			accel += 0.01 * mix(vec3(0.0), vec3(-1.0), greaterThanEqual(l.pos_w, zone_max));
-			l.acl_w += accel;
+// Copies the occlusion results read back last frame out of the PBO
+// 
+void readOcclusionResults() {
+	if (g_hiz_pending == occlusion_off) return;
+
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, g_pbo_hiz);
+	const void *data = glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+	if (data) {
+		if (g_hiz_pending == occlusion_gpu) {
+			const uint8_t *visible = static_cast<const uint8_t *>(data);
+			g_object_visible.assign(visible, visible + g_scene.objects.size());
+		} else {
+			g_hiz_cpu.width = g_hiz_pending_size.x;
+			g_hiz_cpu.height = g_hiz_pending_size.y;
+			g_hiz_cpu.level = g_hiz_pending_level;
+			g_hiz_cpu.screen_size = g_hiz_pending_screen_size;
+			const float *depth = static_cast<const float *>(data);
+			g_hiz_cpu.depth.assign(depth, depth + g_hiz_cpu.width * g_hiz_cpu.height);
+			g_hiz_cpu.view_proj = g_hiz_pending_view_proj;
+			g_hiz_cpu.znear = g_znear;
+			g_hiz_cpu.zfar = g_zfar;
+		}
+		glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+	}
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	g_hiz_pending = occlusion_off;
+}
 
-			// update velocities
-			l.vel_w += l.acl_w;
-			l.acl_w = vec3(0);
 
-			// clamp speed to min max speed
-			float speed = length(l.vel_w);
-			if (speed == 0) l.vel_w = vec3(1) * g_min_light_speed;
-			else if (speed < g_min_light_speed) l.vel_w *= g_min_light_speed/speed;
-			else if (speed > g_max_light_speed) l.vel_w *= g_max_light_speed/speed;
+// Builds the Hi-Z pyramid from this frame's scene depth, then starts
+// reading back either the visibility of every object (GPU test) or a small
+// level (CPU test) for the next frame
+// 
+void renderHiZ(int width, int height) {
+	if ((g_occlusion_mode != occlusion_gpu && g_occlusion_mode != occlusion_cpu) || g_scene.objects.empty()) return;
+	profile_scope scope(g_profiler, "hi-z");
 
-			// update position
-			l.pos_w += l.vel_w;
+	ensureHiZ(width, height);
+	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, g_fbo_hiz);
+	glDisable(GL_DEPTH_TEST);
 
+	// Each level reads the one above, which is the only level visible
+	// while it's written, so the texture is never read and written at once
+	glUseProgram(g_hiz_build_shader.id());
+	glUniform1i(g_hiz_build_shader.location(u_hiz), 12);
+	glActiveTexture(GL_TEXTURE12);
+	ivec2 size = g_hiz_size;
+	for (int level = 0; level < g_hiz_levels; ++level) {
+		if (level == 0) {
+			glBindTexture(GL_TEXTURE_2D, g_tex_scene_depth);
+		} else {
+			glBindTexture(GL_TEXTURE_2D, g_tex_hiz);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, level - 1);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, level - 1);
+		}
+		glFramebufferTexture(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, g_tex_hiz, level);
+		glViewport(0, 0, size.x, size.y);
+		cgraScreenTriangle();
+		size = cgra::max(size / 2, ivec2(1));
+	}
+	glBindTexture(GL_TEXTURE_2D, g_tex_hiz);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, g_hiz_levels - 1);
+
+	if (!g_pbo_hiz) glGenBuffers(1, &g_pbo_hiz);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, g_pbo_hiz);
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	mat4 view_proj = g_camera.projection() * g_camera.view();
+
+	if (g_occlusion_mode == occlusion_gpu) {
+		glFramebufferTexture(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, g_tex_hiz_visible, 0);
+		glViewport(0, 0, g_hiz_visible_size.x, g_hiz_visible_size.y);
+
+		const shader_program &prog = g_hiz_test_shader;
+		glUseProgram(prog.id());
+		glUniform1i(prog.location(u_hiz), 12);
+		glUniform1i(prog.location(u_object_bounds), 13);
+		glUniform1i(prog.location(u_hiz_levels), g_hiz_levels);
+		glUniform2i(prog.location(u_depth_size), width, height);
+		glUniform1i(prog.location(u_num_objects), int(g_scene.objects.size()));
+		glUniformMatrix4fv(prog.location(u_view_projection), 1, false, view_proj.dataPointer());
+		glUniform1f(prog.location(u_z_near), g_znear);
+		glUniform1f(prog.location(u_z_far), g_zfar);
+		cgraScreenTriangle();
+
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, g_fbo_hiz);
+		glReadBuffer(GL_COLOR_ATTACHMENT0);
+		glBufferData(GL_PIXEL_PACK_BUFFER, g_hiz_visible_size.x * g_hiz_visible_size.y, nullptr, GL_STREAM_READ);
+		glReadPixels(0, 0, g_hiz_visible_size.x, g_hiz_visible_size.y, GL_RED, GL_UNSIGNED_BYTE, nullptr);
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+	} else {
+		int level = 0;
+		size = g_hiz_size;
+		while (size.x > g_hiz_readback_width && level < g_hiz_levels - 1) {
+			size = cgra::max(size / 2, ivec2(1));
+			level++;
 		}
+		glBufferData(GL_PIXEL_PACK_BUFFER, size.x * size.y * sizeof(float), nullptr, GL_STREAM_READ);
+		glGetTexImage(GL_TEXTURE_2D, level, GL_RED, GL_FLOAT, nullptr);
+		g_hiz_pending_size = size;
+		g_hiz_pending_level = level;
+		g_hiz_pending_screen_size = ivec2(width, height);
 	}
+
+	glPixelStorei(GL_PACK_ALIGNMENT, 4);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	glActiveTexture(GL_TEXTURE0);
+	glUseProgram(0);
+	g_hiz_pending = g_occlusion_mode;
+	g_hiz_pending_view_proj = view_proj;
 }
 
 
-// Sets up where the camera is in the scene
+// Looks up the cached mesh at every level of detail for every object in
+// g_scene, and gives each distinct mesh and material an id for sorting
 // 
-void setupCamera(int width, int height) {
-	// Set up the projection matrix
-	glMatrixMode(GL_PROJECTION);
-	glLoadIdentity();
-	gluPerspective(g_fovy, width / float(height), g_znear, g_zfar);
+void resolveSceneObjects() {
+	mesh_cache &cache = meshCache();
+	map<const gl_mesh *, uint32_t> mesh_ids;
+
+	g_scene_meshes.clear();
+	g_scene_mesh_ids.clear();
+	g_scene_lod_radius.clear();
+	for (const scene_object &o : g_scene.objects) {
+		for (int level = 0; level < lod_policy::max_levels; ++level) {
+			const gl_mesh *mesh = &cache.get(mesh_cache::lodKey(o.mesh, level));
+			g_scene_meshes.push_back(mesh);
+			g_scene_mesh_ids.push_back(mesh_ids.emplace(mesh, uint32_t(mesh_ids.size())).first->second);
+		}
+
+		// the shape's widest radius, scaled as much as the model scales any axis
+		float scale = 0;
+		for (int j = 0; j < 3; ++j) scale = max(scale, length(vec3(o.model[j])));
+		g_scene_lod_radius.push_back(max(o.mesh.radius0, o.mesh.radius1) * scale);
+	}
+	g_scene_lod.assign(g_scene.objects.size(), -1);
+
+	g_scene_material_ids = g_scene.uniqueMaterials();
+
+	vector<aabb> bounds;
+	for (const scene_object &o : g_scene.objects) bounds.push_back(o.bounds);
+	g_scene_bvh.build(bounds);
+
+	uploadObjectBounds();
+
+	// shrunk to fit inside whichever level is drawn
+	g_scene_occluders.clear();
+	for (const scene_object &o : g_scene.objects) {
+		auto it = g_occluder_meshes.find(o.mesh);
+		if (it == g_occluder_meshes.end()) {
+			occluder_mesh m = occluderMeshData(mesh_cache::occluderKey(o.mesh), mesh_cache::lodInset(o.mesh, lod_policy::max_levels));
+			it = g_occluder_meshes.emplace(o.mesh, move(m)).first;
+		}
+		g_scene_occluders.push_back(&it->second);
+	}
+}
+
+
+// Draws the large frustum visible objects into g_occlusion_raster as
+// occluders, for testing the rest against
+// 
+void rasterizeOccluders(int width, int height) {
+	profile_scope scope(g_profiler, "occluders");
+
+	int raster_height = max(1, g_occlusion_raster_width * height / max(1, width));
+	if (g_occlusion_raster.width() != g_occlusion_raster_width || g_occlusion_raster.height() != raster_height) {
+		g_occlusion_raster.resize(g_occlusion_raster_width, raster_height);
+	}
+
+	g_occlusion_raster.clear(g_camera.projection() * g_camera.view(), g_znear);
+	vec3 eye(inverse(g_camera.view())[3]);
+	for (uint32_t i : g_visible_objects) {
+		const aabb &b = g_scene.objects[i].bounds;
+		float radius = length(b.halfSize());
+		if (radius < g_occluder_min_size * length(b.center() - eye)) continue;
+		g_occlusion_raster.addOccluder(*g_scene_occluders[i], g_scene.objects[i].model);
+	}
+	g_occlusion_raster.render();
+	g_raster_stats = g_occlusion_raster.stats();
+}
+
+
+// Draws every object in g_scene with the scene shader, through
+// g_scene_draws, setting only the state that changes between draws
+// 
+void renderSceneObjects(int width, int height) {
+	if (g_scene_meshes.size() != g_scene.objects.size() * lod_policy::max_levels) resolveSceneObjects();
+
+	readOcclusionResults();
+
+	g_visible_objects.clear();
+	{
+		profile_scope scope(g_profiler, "cull");
+		if (g_frustum_culling) {
+			g_scene_bvh.cull(frustum(g_camera.projection() * g_camera.view()), g_visible_objects, &g_cull_stats);
+			// unsorted draws stay in file order
+			if (!g_sort_draws) sort(g_visible_objects.begin(), g_visible_objects.end());
+		} else {
+			for (size_t i = 0; i < g_scene.objects.size(); ++i) g_visible_objects.push_back(uint32_t(i));
+			g_cull_stats = bvh_cull_stats();
+			g_cull_stats.visible = int(g_visible_objects.size());
+		}
+
+		// then drop the objects hidden last frame
+		size_t before = g_visible_objects.size();
+		if (g_occlusion_mode == occlusion_gpu && g_object_visible.size() == g_scene.objects.size()) {
+			g_visible_objects.erase(remove_if(g_visible_objects.begin(), g_visible_objects.end(), [](uint32_t i) {
+				return !g_object_visible[i];
+			}), g_visible_objects.end());
+		} else if (g_occlusion_mode == occlusion_cpu) {
+			g_visible_objects.erase(remove_if(g_visible_objects.begin(), g_visible_objects.end(), [](uint32_t i) {
+				return !g_hiz_cpu.visible(g_scene.objects[i].bounds);
+			}), g_visible_objects.end());
+		} else if (g_occlusion_mode == occlusion_raster) {
+			rasterizeOccluders(width, height);
+			g_visible_objects.erase(remove_if(g_visible_objects.begin(), g_visible_objects.end(), [](uint32_t i) {
+				const aabb &b = g_scene.objects[i].bounds;
+				return !g_occlusion_raster.visible(b.min, b.max);
+			}), g_visible_objects.end());
+		}
+		g_occluded_objects = int(before - g_visible_objects.size());
+	}
+
+	// Pick a level of detail for each, from its shape's radius at the
+	// distance to the nearest point of its bounds
+	const mat4 &view = g_camera.view();
+	fill(begin(g_lod_counts), end(g_lod_counts), 0);
+	{
+		vec3 eye(inverse(view)[3]);
+		for (uint32_t i : g_visible_objects) {
+			const scene_object &o = g_scene.objects[i];
+			int level = 0;
+			if (g_lod_enabled) {
+				vec3 outside = cgra::max(cgra::max(o.bounds.min - eye, eye - o.bounds.max), vec3(0));
+				float r = lod_policy::projectedRadius(g_scene_lod_radius[i], length(outside), g_camera.projection(), float(height));
+				level = g_lod.select(r, 2 * o.mesh.slices, g_scene_lod[i]);
+			}
+			g_scene_lod[i] = level;
+			g_lod_counts[level]++;
+		}
+	}
+
+	// Sort by program, material, mesh, then front to back, with depth
+	// mapped like the log depth buffer so near objects get the precision
+	const float depth_scale = 1 / log(g_zfar * 0.01f + 1);
+	const uint32_t scene_program = 0; // only one program so far
+	g_scene_draws.clear();
+	for (uint32_t i : g_visible_objects) {
+		const scene_object &o = g_scene.objects[i];
+		uint64_t key = 0;
+		if (g_sort_draws) {
+			float depth = -(view * o.model[3]).z;
+			uint32_t mesh_id = g_scene_mesh_ids[i * lod_policy::max_levels + g_scene_lod[i]];
+			key = draw_list::makeKey(scene_program, g_scene_material_ids[o.material], mesh_id, log(max(depth, 0.f) * 0.01f + 1) * depth_scale);
+		}
+		g_scene_draws.add(key, i);
+	}
+	if (g_sort_draws) g_scene_draws.sort();
+
+	// Submit, tracking what is set
+	const shader_program *programs[] = { &g_scene_shader };
+	mesh_cache &cache = meshCache();
+	draw_list_stats &stats = g_scene_draw_stats;
+	stats = draw_list_stats();
+	const uint32_t none = ~0u;
+	uint32_t program = none, material = none;
+	const gl_mesh *mesh = nullptr;
+
+	for (const draw_list::item &item : g_scene_draws.items()) {
+		const scene_object &o = g_scene.objects[item.index];
+
+		if (program != scene_program) {
+			program = scene_program;
+			glUseProgram(programs[program]->id());
+			stats.program_changes++;
+		}
+		const shader_program &prog = *programs[program];
+
+		if (material != g_scene_material_ids[o.material]) {
+			material = g_scene_material_ids[o.material];
+			const scene_material &m = g_scene.materials[material];
+			glUniform1i(prog.location(u_emissive), m.emissive);
+			glUniform3fv(prog.location(u_diffuse), 1, m.diffuse.dataPointer());
+			glUniform3fv(prog.location(u_specular), 1, m.specular.dataPointer());
+			glUniform1f(prog.location(u_shininess), m.shininess);
+			stats.material_changes++;
+		}
+
+		const gl_mesh *level_mesh = g_scene_meshes[item.index * lod_policy::max_levels + g_scene_lod[item.index]];
+		if (mesh != level_mesh) {
+			mesh = level_mesh;
+			glBindVertexArray(mesh->vao);
+			stats.mesh_changes++;
+		}
 
-	// Set up the view part of the model view matrix
-	glMatrixMode(GL_MODELVIEW);
-	glLoadIdentity();
+		setModelMatrix(o.model);
+		cache.drawBound(*mesh);
+		stats.draws++;
+	}
 
-	glTranslatef(0, 0, -10 * g_zoom);
-	glRotatef(g_pitch, 1, 0, 0);
-	glRotatef(g_yaw, 0, 1, 0);
+	glBindVertexArray(0);
+}
+
+
+// Draws unit spheres with a shared material, either instanced (the
+// instances must already be uploaded to mesh) or one sphere at a time
+// Leaves the scene shader bound
+// 
+void drawSphereInstances(const instanced_mesh &mesh, const gl_mesh &sphere, const vector<mesh_instance> &instances, bool emissive, const vec3 &specular, float shininess) {
+	if (instances.empty()) return;
+
+	if (g_instancing) {
+		const shader_program &prog = g_scene_instanced_shader;
+		mat4 view = g_camera.modelView(mat4::identity());
+		glUseProgram(prog.id());
+		glUniform1f(prog.location(u_z_far), g_zfar);
+		glUniformMatrix4fv(prog.location(u_projection_matrix), 1, false, g_camera.projection().dataPointer());
+		glUniformMatrix4fv(prog.location(u_model_view_matrix), 1, false, view.dataPointer());
+		glUniformMatrix3fv(prog.location(u_normal_matrix), 1, false, camera::normalMatrix(view).dataPointer());
+		glUniform1i(prog.location(u_emissive), emissive);
+		glUniform3fv(prog.location(u_specular), 1, specular.dataPointer());
+		glUniform1f(prog.location(u_shininess), shininess);
+		meshCache().draw(mesh);
+		glUseProgram(g_scene_shader.id());
+		return;
+	}
+
+	glUniform1i(g_scene_shader.location(u_emissive), emissive);
+	glUniform3fv(g_scene_shader.location(u_specular), 1, specular.dataPointer());
+	glUniform1f(g_scene_shader.location(u_shininess), shininess);
+	for (const mesh_instance &inst : instances) {
+		vec3 color(inst.color);
+		setModelMatrix(mat4::translate(vec3(inst.pos_scale)) * mat4::scale(inst.pos_scale.w));
+		glUniform3fv(g_scene_shader.location(u_diffuse), 1, color.dataPointer());
+		meshCache().draw(sphere);
+	}
 }
 
 
@@ -251,6 +1139,9 @@ void setupCamera(int width, int height) {
 void ensureFBO(int w, int h) {
 	if (ivec2(w, h) == g_last_frame_size) return;
 
+	GLenum normal_format = g_compact_gbuffer ? GL_RG16 : GL_RGBA16F;
+	GLenum material_format = g_compact_gbuffer ? GL_RGBA8 : GL_RGBA16F;
+
 	if (!g_fbo_scene) glGenFramebuffers(1, &g_fbo_scene);
 	
 	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, g_fbo_scene);
@@ -264,13 +1155,13 @@ void ensureFBO(int w, int h) {
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, w, h, 0, GL_DEPTH_COMPONENT, GL_FLOAT, nullptr);
-		glFramebufferTexture(GL_DRAW_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, g_tex_scene_depth, 0);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH24_STENCIL8, w, h, 0, GL_DEPTH_STENCIL, GL_UNSIGNED_INT_24_8, nullptr);
+		glFramebufferTexture(GL_DRAW_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, g_tex_scene_depth, 0);
 
 	// Otherwise, bind the existing target with the right size
 	} else {
 		glBindTexture(GL_TEXTURE_2D, g_tex_scene_depth);
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, w, h, 0, GL_DEPTH_COMPONENT, GL_FLOAT, nullptr);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH24_STENCIL8, w, h, 0, GL_DEPTH_STENCIL, GL_UNSIGNED_INT_24_8, nullptr);
 	}
 
 	if (!g_tex_scene_normal) {
@@ -280,11 +1171,11 @@ void ensureFBO(int w, int h) {
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F, w, h, 0, GL_RGBA, GL_FLOAT, nullptr);
+		glTexImage2D(GL_TEXTURE_2D, 0, normal_format, w, h, 0, GL_RGBA, GL_FLOAT, nullptr);
 		glFramebufferTexture(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, g_tex_scene_normal, 0);
 	} else {
 		glBindTexture(GL_TEXTURE_2D, g_tex_scene_normal);
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F, w, h, 0, GL_RGBA, GL_FLOAT, nullptr);
+		glTexImage2D(GL_TEXTURE_2D, 0, normal_format, w, h, 0, GL_RGBA, GL_FLOAT, nullptr);
 	}
 
 	if (!g_tex_scene_diffuse) {
@@ -294,11 +1185,11 @@ void ensureFBO(int w, int h) {
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F, w, h, 0, GL_RGBA, GL_FLOAT, nullptr);
+		glTexImage2D(GL_TEXTURE_2D, 0, material_format, w, h, 0, GL_RGBA, GL_FLOAT, nullptr);
 		glFramebufferTexture(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, g_tex_scene_diffuse, 0);
 	} else {
 		glBindTexture(GL_TEXTURE_2D, g_tex_scene_diffuse);
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F, w, h, 0, GL_RGBA, GL_FLOAT, nullptr);
+		glTexImage2D(GL_TEXTURE_2D, 0, material_format, w, h, 0, GL_RGBA, GL_FLOAT, nullptr);
 	}
 
 	if (!g_tex_scene_specular) {
@@ -308,11 +1199,11 @@ void ensureFBO(int w, int h) {
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F, w, h, 0, GL_RGBA, GL_FLOAT, nullptr);
+		glTexImage2D(GL_TEXTURE_2D, 0, material_format, w, h, 0, GL_RGBA, GL_FLOAT, nullptr);
 		glFramebufferTexture(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT2, g_tex_scene_specular, 0);
 	} else {
 		glBindTexture(GL_TEXTURE_2D, g_tex_scene_specular);
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F, w, h, 0, GL_RGBA, GL_FLOAT, nullptr);
+		glTexImage2D(GL_TEXTURE_2D, 0, material_format, w, h, 0, GL_RGBA, GL_FLOAT, nullptr);
 	}
 
 	GLenum bufs[] { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1, GL_COLOR_ATTACHMENT2 };
@@ -324,10 +1215,46 @@ void ensureFBO(int w, int h) {
 }
 
 
+// Bytes per pixel of the G-buffer (see g_compact_gbuffer)
+// 24 bit depth is counted as 4 bytes, as it is normally padded
+//
+int gbufferBytesPerPixel(bool compact) {
+	return compact ? 4 + 4 + 4 + 4 : 4 + 8 + 8 + 8;
+}
+
+
+// Memory and bandwidth of both G-buffer layouts at common resolutions
+// Bandwidth assumes every pixel is written once by the scene pass and read
+// once by the deferred pass, so overdraw only makes the difference bigger
+//
+void printGBufferReport(ostream &out) {
+	const ivec2 sizes[] = { ivec2(1280, 720), ivec2(1920, 1080), ivec2(2560, 1440), ivec2(3840, 2160) };
+	int standard = gbufferBytesPerPixel(false);
+	int compact = gbufferBytesPerPixel(true);
+
+	out << "G-buffer : standard " << standard << " B/px, compact " << compact << " B/px";
+	out << " (using " << (g_compact_gbuffer ? "compact" : "standard") << ")" << endl;
+	out << fixed << setprecision(1);
+	for (ivec2 size : sizes) {
+		double pixels = double(size.x) * size.y;
+		double standard_mb = pixels * standard / (1024 * 1024);
+		double compact_mb = pixels * compact / (1024 * 1024);
+		out << "  " << setw(4) << size.x << "x" << setw(4) << left << size.y << right
+			<< "  memory " << setw(6) << standard_mb << " MB -> " << setw(6) << compact_mb << " MB"
+			<< "  |  traffic at 60 fps " << setw(5) << 2 * 60 * standard_mb / 1024 << " GB/s -> " << setw(5) << 2 * 60 * compact_mb / 1024 << " GB/s"
+			<< endl;
+	}
+}
+
+
 
 //
 //
 void renderSceneBuffer(int width, int height) {
+	profile_scope scope(g_profiler, "scene");
+	unsigned long long draws_before = meshCache().stats().draws;
+	unsigned long long triangles_before = meshCache().stats().triangles;
+
 	ensureFBO(width, height);
 	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, g_fbo_scene);
 	glViewport(0, 0, width, height);
@@ -342,178 +1269,531 @@ void renderSceneBuffer(int width, int height) {
 	glEnable(GL_DEPTH_TEST);
 	glEnable(GL_NORMALIZE);
 
-	setupCamera(width, height);
-
-	glUseProgram(g_scene_shader);
+	glUseProgram(g_scene_shader.id());
 
 	// Render scene 
 	//
-	glUniform1f(glGetUniformLocation(g_scene_shader, "uZFar"), g_zfar);
+	glUniform1f(g_scene_shader.location(u_z_far), g_zfar);
+	glUniformMatrix4fv(g_scene_shader.location(u_projection_matrix), 1, false, g_camera.projection().dataPointer());
 
 
-	// Golden sphere
-	vec3 gold_spec_chroma { 0.9f, 0.8f, 0.6f };
-	float gold_spec_ratio = 0.9;
-	float gold_shininess = 1000.0;
+	renderSceneObjects(width, height);
 
-	glUniform1i(glGetUniformLocation(g_scene_shader, "uEmissive"), false);
-	glUniform3fv(glGetUniformLocation(g_scene_shader, "uDiffuse"), 1, (pow(gold_spec_chroma, vec3(2)) * (1-gold_spec_ratio)).dataPointer());
-	glUniform3fv(glGetUniformLocation(g_scene_shader, "uSpecular"), 1, (gold_spec_chroma * gold_spec_ratio).dataPointer());
-	glUniform1f(glGetUniformLocation(g_scene_shader, "uShininess"), gold_shininess);
 
-	glPushMatrix();
-		glTranslatef(0,4,0);
-		cgraSphere(4.0, 100, 100);
-	glPopMatrix();
 
+	// Stress test spheres
+	ensureStressInstances();
+	drawSphereInstances(g_stress_mesh, meshCache().sphere(1, 10, 10), g_stress_data, false, vec3(0.04f), 50.0);
 
 
-	// White pillar
-	vec3 white_spec_chroma { 0.9f, 0.8f, 0.6f };
-	float white_spec_ratio = 0.5;
-	float white_shininess = 1.0;
 
-	glUniform1i(glGetUniformLocation(g_scene_shader, "uEmissive"), false);
-	glUniform3fv(glGetUniformLocation(g_scene_shader, "uDiffuse"), 1, (pow(white_spec_chroma, vec3(2)) * (1-white_spec_ratio)).dataPointer());
-	glUniform3fv(glGetUniformLocation(g_scene_shader, "uSpecular"), 1, (white_spec_chroma * white_spec_ratio).dataPointer());
-	glUniform1f(glGetUniformLocation(g_scene_shader, "uShininess"), white_shininess);
+	//Draw Lights
+	// one instanced draw per level of detail
+	if (g_draw_lights) {
+		const float marker_radius = 0.1f;
+		vec3 eye(inverse(g_camera.view())[3]);
+		for (vector<mesh_instance> &data : g_marker_data) data.clear();
+		g_marker_lod.resize(g_lights.size(), -1);
+		for (size_t i = 0; i < g_lights.size(); ++i) {
+			vec3 pos = g_lights.position(i);
+			int level = 0;
+			if (g_lod_enabled) {
+				float r = lod_policy::projectedRadius(marker_radius, length(pos - eye), g_camera.projection(), float(height));
+				level = g_lod.select(r, 2 * g_marker_sphere.slices, g_marker_lod[i]);
+			}
+			g_marker_lod[i] = level;
+			g_marker_data[level].push_back({ vec4(pos, marker_radius), vec4(normalize(g_lights.flux[i]), 1) });
+		}
+		for (int level = 0; level < lod_policy::max_levels; ++level) {
+			const gl_mesh &sphere = meshCache().get(mesh_cache::lodKey(g_marker_sphere, level));
+			if (g_instancing) {
+				g_marker_meshes[level].setMesh(sphere);
+				g_marker_meshes[level].upload(g_marker_data[level].data(), g_marker_data[level].size());
+			}
+			drawSphereInstances(g_marker_meshes[level], sphere, g_marker_data[level], true, vec3(0), 1.0);
+		}
+	}
 
-	glPushMatrix();
-		glTranslatef(15,0,15);
-		glRotatef(-90, 1, 0, 0);
-		cgraCylinder(2.0, 2.0, 20, 100, 100);
-	glPopMatrix();
 
+	glUseProgram(0);
+	g_scene_draw_calls = int(meshCache().stats().draws - draws_before);
+	g_scene_triangles = meshCache().stats().triangles - triangles_before;
 
+	glDisable(GL_DEPTH_TEST);
+	glDisable(GL_NORMALIZE);
 
+	renderHiZ(width, height);
+}
 
-	// Red Cone
-	vec3 red_spec_chroma { 0.9f, 0.1f, 0.1f };
-	float red_spec_ratio = 0.8;
-	float red_shininess = 300.0;
 
-	glUniform1i(glGetUniformLocation(g_scene_shader, "uEmissive"), false);
-	glUniform3fv(glGetUniformLocation(g_scene_shader, "uDiffuse"), 1, (pow(red_spec_chroma, vec3(2)) * (1-red_spec_ratio)).dataPointer());
-	glUniform3fv(glGetUniformLocation(g_scene_shader, "uSpecular"), 1, (red_spec_chroma * red_spec_ratio).dataPointer());
-	glUniform1f(glGetUniformLocation(g_scene_shader, "uShininess"), red_shininess);
 
-	glPushMatrix();
-		glTranslatef(-15,0,15);
-		glRotatef(-90, 1, 0, 0);
-		cgraCone(3.0, 8.0, 100, 100);
-	glPopMatrix();
 
+// Uploads the cluster light lists into integer textures for the deferred shader
+// and leaves them bound to texture units 4 (grid) and 5 (light indices)
+//
+void uploadLightClusters() {
+	ivec3 dims = g_light_clusters.dimensions();
+	const vector<uvec2> &ranges = g_light_clusters.ranges();
+	const vector<unsigned> &indices = g_light_clusters.indices();
+
+	// (offset, count) for every cluster
+	glActiveTexture(GL_TEXTURE4);
+	if (!g_tex_cluster_grid) {
+		glGenTextures(1, &g_tex_cluster_grid);
+		glBindTexture(GL_TEXTURE_2D, g_tex_cluster_grid);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	}
+	glBindTexture(GL_TEXTURE_2D, g_tex_cluster_grid);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RG32UI, dims.x, dims.y * (dims.z + 1), 0, GL_RG_INTEGER, GL_UNSIGNED_INT, ranges[0].dataPointer());
+
+	// light indices, wrapped into rows of g_cluster_lights_width
+	// only reallocate when the list grows past the current size
+	glActiveTexture(GL_TEXTURE5);
+	if (!g_tex_cluster_lights) {
+		glGenTextures(1, &g_tex_cluster_lights);
+		glBindTexture(GL_TEXTURE_2D, g_tex_cluster_lights);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	}
+	glBindTexture(GL_TEXTURE_2D, g_tex_cluster_lights);
 
+	int n = int(indices.size());
+	int rows = std::max(1, (n + g_cluster_lights_width - 1) / g_cluster_lights_width);
+	if (rows > g_cluster_lights_rows) {
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_R32UI, g_cluster_lights_width, rows, 0, GL_RED_INTEGER, GL_UNSIGNED_INT, nullptr);
+		g_cluster_lights_rows = rows;
+	}
+	int full_rows = n / g_cluster_lights_width;
+	int remainder = n % g_cluster_lights_width;
+	if (full_rows > 0) {
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, g_cluster_lights_width, full_rows, GL_RED_INTEGER, GL_UNSIGNED_INT, &indices[0]);
+	}
+	if (remainder > 0) {
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, full_rows, remainder, 1, GL_RED_INTEGER, GL_UNSIGNED_INT, &indices[full_rows * g_cluster_lights_width]);
+	}
 
+	glActiveTexture(GL_TEXTURE0);
+}
 
 
-	// Green bottom heavy cylinder
-	vec3 green_spec_chroma { 0.1f, 0.9f, 0.1f };
-	float green_spec_ratio = 0.5;
-	float green_shininess = 100.0;
 
-	glUniform1i(glGetUniformLocation(g_scene_shader, "uEmissive"), false);
-	glUniform3fv(glGetUniformLocation(g_scene_shader, "uDiffuse"), 1, (pow(green_spec_chroma, vec3(2)) * (1-green_spec_ratio)).dataPointer());
-	glUniform3fv(glGetUniformLocation(g_scene_shader, "uSpecular"), 1, (green_spec_chroma * green_spec_ratio).dataPointer());
-	glUniform1f(glGetUniformLocation(g_scene_shader, "uShininess"), green_shininess);
+// Writes the light data texture with a single upload, rows past the last
+// light hold stale data which the shader never reads
+//
+void uploadLightData(int num_lights) {
+	int rows = std::max(1, (num_lights + g_light_data_width - 1) / g_light_data_width);
 
-	glPushMatrix();
-		glTranslatef(15,0,-15);
-		glRotatef(-90, 1, 0, 0);
-		cgraCylinder(4.0, 1.0, 20, 100, 100);
-	glPopMatrix();
+	glActiveTexture(GL_TEXTURE6);
+	if (!g_tex_light_data) {
+		glGenTextures(1, &g_tex_light_data);
+		glBindTexture(GL_TEXTURE_2D, g_tex_light_data);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	}
+	glBindTexture(GL_TEXTURE_2D, g_tex_light_data);
 
+	// only reallocate when the number of lights grows past the current size
+	if (rows > g_light_data_rows) {
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, g_light_data_width, 2 * rows, 0, GL_RGBA, GL_FLOAT, nullptr);
+		g_light_data_rows = rows;
+	}
 
+	if (num_lights > 0) {
+		glPixelStorei(GL_UNPACK_ROW_LENGTH, g_light_data_width);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, std::min(num_lights, g_light_data_width), 2 * rows, GL_RGBA, GL_FLOAT, g_light_data[0].dataPointer());
+		glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+	}
 
-	// Blue top heavy cylinder
-	vec3 blue_spec_chroma { 0.1f, 0.1f, 0.9f };
-	float blue_spec_ratio = 0.2;
-	float blue_shininess = 1.0;
+	glActiveTexture(GL_TEXTURE0);
+}
 
-	glUniform1i(glGetUniformLocation(g_scene_shader, "uEmissive"), false);
-	glUniform3fv(glGetUniformLocation(g_scene_shader, "uDiffuse"), 1, (pow(blue_spec_chroma, vec3(2)) * (1-blue_spec_ratio)).dataPointer());
-	glUniform3fv(glGetUniformLocation(g_scene_shader, "uSpecular"), 1, (blue_spec_chroma * blue_spec_ratio).dataPointer());
-	glUniform1f(glGetUniformLocation(g_scene_shader, "uShininess"), blue_shininess);
 
-	glPushMatrix();
-		glTranslatef(-15,0,-15);
-		glRotatef(-90, 1, 0, 0);
-		cgraCylinder(1.5, 3.0, 20, 100, 100);
-	glPopMatrix();
+// Transforms the lights into view-space and uploads them, and their
+// clusters, for the deferred shader. Positions must be in view-space so the
+// camera must already be set up
+//
+void uploadLights() {
+	profile_scope scope(g_profiler, "lights");
 
+	const mat4 &proj = g_camera.projection();
+	const mat4 &view = g_camera.view();
 
+	int num_lights = int(g_lights.size());
+	int rows = std::max(1, (num_lights + g_light_data_width - 1) / g_light_data_width);
+	g_light_pos_v.resize(num_lights);
+	g_light_radius.resize(num_lights);
+	g_light_data.resize(2 * rows * g_light_data_width);
 
+	for (int i = 0; i < num_lights; ++i) {
+		g_light_pos_v[i] = g_lights.position(i);
+		g_light_radius[i] = lightInfluenceRadius(g_lights.flux[i]);
+	}
 
+	// transform to view-space in one pass
+	transformPoints(view, g_light_pos_v.data(), g_light_pos_v.data(), num_lights, &workerPool());
 
-	// Silver floor
-	vec3 silver_spec_chroma { 0.8f };
-	float silver_spec_ratio = 0.5;
-	float silver_shininess = 100.0;
+	// pack into row pairs of positions and radii then flux
+	for (int begin = 0; begin < num_lights; begin += g_light_data_width) {
+		int n = std::min(g_light_data_width, num_lights - begin);
+		vec4 *row = &g_light_data[2 * begin];
+		for (int i = 0; i < n; ++i) {
+			row[i] = vec4(g_light_pos_v[begin + i], g_light_radius[begin + i]);
+			row[g_light_data_width + i] = vec4(g_flux_mult * g_lights.flux[begin + i], 0);
+		}
+	}
 
-	glUniform1i(glGetUniformLocation(g_scene_shader, "uEmissive"), false);
-	glUniform3fv(glGetUniformLocation(g_scene_shader, "uDiffuse"), 1, (pow(silver_spec_chroma, vec3(2)) * silver_spec_ratio).dataPointer());
-	glUniform3fv(glGetUniformLocation(g_scene_shader, "uSpecular"), 1, (silver_spec_chroma * silver_spec_ratio).dataPointer());
-	glUniform1f(glGetUniformLocation(g_scene_shader, "uShininess"), silver_shininess);
+	uploadLightData(num_lights);
+
+
+	// Bin the lights into clusters so each pixel only loops over nearby lights
+	//
+	if (g_cluster_lights) {
+		g_light_clusters.setDepthRange(g_znear, g_cluster_zfar);
+		g_light_clusters.build(proj, g_light_pos_v.data(), g_light_radius.data(), num_lights);
+		uploadLightClusters();
+	}
+}
 
-	glPushMatrix();
-		glTranslatef(0,-0.01,0);
-		glBegin(GL_TRIANGLES);
-		glNormal3f(0, 1.0, 0);
-		glVertex3f(-40.0, 0, -40.0);
-		glVertex3f( 40.0, 0, -40.0);
-		glVertex3f(-40.0, 0,  40.0);
-		glVertex3f( 40.0, 0, -40.0);
-		glVertex3f( 40.0, 0,  40.0);
-		glVertex3f(-40.0, 0,  40.0);
-		glEnd();
-		glFlush();
-	glPopMatrix();
 
 
+// Sets the uniforms shared by the deferred and in-scatter passes, for
+// rebuilding view rays from the depth buffer and reading the lights
+// The program must be in use, and the depth buffer is bound to unit 0
+//
+void setLightingUniforms(const shader_program &prog) {
+
+	// Upload the far plane
+	// 
+	glUniform1f(prog.location(u_z_far), g_zfar);
 
+	// Upload the inverse projection to work out the view rays
+	glUniformMatrix4fv(prog.location(u_projection_matrix_inverse), 1, false, g_camera.projectionInverse().dataPointer());
+	// Pick a z for unprojection (nearly arbitrary)
+	vec4 unproj = g_camera.projection() * vec4(0, 0, -g_znear * 10, 1);
+	glUniform1f(prog.location(u_z_unproject), unproj.z / unproj.w);
 
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, g_tex_scene_depth);
+	glUniform1i(prog.location(u_depth), 0);
 
-	// Big grey sphere
-	glPushMatrix();
-		vec3 grey(0.8, 0.8, 0.8);
-		glTranslatef(0,0, 4000000);
-		glUniform1i(glGetUniformLocation(g_scene_shader, "uEmissive"), false);
-		glUniform3fv(glGetUniformLocation(g_scene_shader, "uDiffuse"), 1, grey.dataPointer());
-		glUniform3fv(glGetUniformLocation(g_scene_shader, "uSpecular"), 1, grey.dataPointer());
-		glUniform1f(glGetUniformLocation(g_scene_shader, "uShininess"), 1.0);
-		cgraSphere(1500000, 100, 100);
-	glPopMatrix();
 
+	// Lights and clusters are uploaded separately (see uploadLights)
+	// The samplers are always bound to their own units, as integer and float
+	// samplers can't share a unit even when they aren't used
+	// 
+	glUniform1i(prog.location(u_light_data), 6);
+	glUniform1i(prog.location(u_cluster_grid), 4);
+	glUniform1i(prog.location(u_cluster_lights), 5);
+	glUniform1i(prog.location(u_inscatter), 7);
+	glUniform1i(prog.location(u_froxel_scatter), 8);
+	glUniform1i(prog.location(u_froxel_volume), 9);
+	glUniform1i(prog.location(u_airlight), 10);
+	glUniform1i(prog.location(u_light_accum), 11);
+
+	glUniform1i(prog.location(u_num_lights), int(g_lights.size()));
+	glUniform1i(prog.location(u_clustered), g_cluster_lights);
+	if (g_cluster_lights) {
+		ivec3 dims = g_light_clusters.dimensions();
+		glUniform3i(prog.location(u_cluster_dims), dims.x, dims.y, dims.z);
+		glUniform1f(prog.location(u_cluster_z_near), g_light_clusters.nearDepth());
+		glUniform1f(prog.location(u_cluster_slice_scale), g_light_clusters.sliceScale());
+	}
 
+	glUniform3i(prog.location(u_froxel_dims), g_froxel_dims.x, g_froxel_dims.y, g_froxel_dims.z);
+	glUniform1f(prog.location(u_froxel_far), g_froxel_far);
+	glUniform1f(prog.location(u_froxel_exponent), g_froxel_exponent);
+}
 
 
+// Creates or resizes the in-scatter target, 1/g_inscatter_scale of the
+// frame size, rgb is radiance and a the depth it was computed at
+// 
+void ensureInscatterFBO(int w, int h) {
+	ivec2 size(std::max(1, w / g_inscatter_scale), std::max(1, h / g_inscatter_scale));
+	if (size == g_inscatter_size) return;
 
+	if (!g_fbo_inscatter) glGenFramebuffers(1, &g_fbo_inscatter);
+	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, g_fbo_inscatter);
 
-	//Draw Lights
-	if (g_draw_lights) {
-		for (const Light &l : g_lights) {
-			glPushMatrix();
-				glTranslatef(l.pos_w.x, l.pos_w.y, l.pos_w.z);
-				glUniform1i(glGetUniformLocation(g_scene_shader, "uEmissive"), true);
-				glUniform3fv(glGetUniformLocation(g_scene_shader, "uDiffuse"), 1, normalize(l.flux).dataPointer());
-				cgraSphere(0.1);
-			glPopMatrix();
+	glActiveTexture(GL_TEXTURE7);
+	if (!g_tex_inscatter) {
+		glGenTextures(1, &g_tex_inscatter);
+		glBindTexture(GL_TEXTURE_2D, g_tex_inscatter);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	}
+	glBindTexture(GL_TEXTURE_2D, g_tex_inscatter);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F, size.x, size.y, 0, GL_RGBA, GL_FLOAT, nullptr);
+	glFramebufferTexture(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, g_tex_inscatter, 0);
+	glActiveTexture(GL_TEXTURE0);
+
+	g_inscatter_size = size;
+}
+
+
+
+// Creates or resizes the froxel volume textures to g_froxel_dims
+// 
+void ensureFroxelTextures() {
+	if (g_froxel_dims == g_froxel_allocated) return;
+
+	if (!g_fbo_froxel) glGenFramebuffers(1, &g_fbo_froxel);
+
+	// scattering is only read with texelFetch, the volume is filtered
+	glActiveTexture(GL_TEXTURE8);
+	for (GLuint *tex : { &g_tex_froxel_scatter, &g_tex_froxel_volume }) {
+		if (!*tex) {
+			GLenum filter = tex == &g_tex_froxel_volume ? GL_LINEAR : GL_NEAREST;
+			glGenTextures(1, tex);
+			glBindTexture(GL_TEXTURE_3D, *tex);
+			glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, filter);
+			glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, filter);
+			glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+			glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+			glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+		}
+		glBindTexture(GL_TEXTURE_3D, *tex);
+		glTexImage3D(GL_TEXTURE_3D, 0, GL_RGBA16F, g_froxel_dims.x, g_froxel_dims.y, g_froxel_dims.z, 0, GL_RGBA, GL_FLOAT, nullptr);
+	}
+	glBindTexture(GL_TEXTURE_3D, 0);
+
+	// full float, as each slice adds to the last one's rounding
+	glActiveTexture(GL_TEXTURE14);
+	for (GLuint &tex : g_tex_froxel_integral) {
+		if (!tex) {
+			glGenTextures(1, &tex);
+			glBindTexture(GL_TEXTURE_2D, tex);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 		}
+		glBindTexture(GL_TEXTURE_2D, tex);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, g_froxel_dims.x, g_froxel_dims.y, 0, GL_RGBA, GL_FLOAT, nullptr);
+	}
+	glBindTexture(GL_TEXTURE_2D, 0);
+	glActiveTexture(GL_TEXTURE0);
+
+	g_froxel_allocated = g_froxel_dims;
+}
+
+
+// Fills the froxel volume, one slice at a time: first each light's
+// scattering into every froxel, then the front to back integration, each
+// slice continuing from the one before (see FROXEL_INTEGRATE_PASS)
+// The cost depends on the number of froxels, not the screen resolution
+// 
+void renderFroxels() {
+	g_froxel_dims = cgra::max(g_froxel_dims, ivec3(1));
+	ensureFroxelTextures();
+
+	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, g_fbo_froxel);
+	glViewport(0, 0, g_froxel_dims.x, g_froxel_dims.y);
+	glDisable(GL_DEPTH_TEST);
+
+	// neither texture may be bound while it's being rendered to
+	glActiveTexture(GL_TEXTURE9);
+	glBindTexture(GL_TEXTURE_3D, 0);
+	glActiveTexture(GL_TEXTURE8);
+	glBindTexture(GL_TEXTURE_3D, 0);
+
+	glUseProgram(g_froxel_inject_shader.id());
+	setLightingUniforms(g_froxel_inject_shader);
+	for (int k = 0; k < g_froxel_dims.z; ++k) {
+		glFramebufferTextureLayer(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, g_tex_froxel_scatter, 0, k);
+		glUniform1i(g_froxel_inject_shader.location(u_froxel_slice), k);
+		cgraScreenTriangle();
 	}
 
+	glActiveTexture(GL_TEXTURE8);
+	glBindTexture(GL_TEXTURE_3D, g_tex_froxel_scatter);
+	glUseProgram(g_froxel_integrate_shader.id());
+	setLightingUniforms(g_froxel_integrate_shader);
+	glUniform1i(g_froxel_integrate_shader.location(u_froxel_integral), 14);
+
+	// slice k reads integral k % 2, written by slice k - 1, and writes the other
+	const GLenum buffers[] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 };
+	glDrawBuffers(2, buffers);
+	glActiveTexture(GL_TEXTURE14);
+	for (int k = 0; k < g_froxel_dims.z; ++k) {
+		glBindTexture(GL_TEXTURE_2D, g_tex_froxel_integral[k % 2]);
+		glFramebufferTextureLayer(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, g_tex_froxel_volume, 0, k);
+		glFramebufferTexture(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, g_tex_froxel_integral[(k + 1) % 2], 0);
+		glUniform1i(g_froxel_integrate_shader.location(u_froxel_slice), k);
+		cgraScreenTriangle();
+	}
+	glBindTexture(GL_TEXTURE_2D, 0);
+	glActiveTexture(GL_TEXTURE0);
+	glFramebufferTexture(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, 0, 0);
+	glDrawBuffer(GL_COLOR_ATTACHMENT0);
 
 	glUseProgram(0);
+}
 
+
+// Renders the in-scattering for the deferred pass to use, either at a
+// lower resolution to upsample or into the froxel volume. Does nothing if
+// it's done per pixel in the deferred pass instead
+// 
+void renderInscatter(int width, int height) {
+	profile_scope scope(g_profiler, "inscatter");
+
+	if (g_inscatter_mode == inscatter_froxels) {
+		renderFroxels();
+		return;
+	}
+	if (g_inscatter_mode != inscatter_low_res) return;
+
+	ensureInscatterFBO(width, height);
+	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, g_fbo_inscatter);
+	glViewport(0, 0, g_inscatter_size.x, g_inscatter_size.y);
+
+	glUseProgram(g_inscatter_shader.id());
 	glDisable(GL_DEPTH_TEST);
-	glDisable(GL_NORMALIZE);
+	setLightingUniforms(g_inscatter_shader);
+	cgraScreenTriangle();
+
+	glUseProgram(0);
+}
+
+
+
+// Creates or resizes the light accumulation buffer, and the depth-stencil
+// buffer the light volumes are tested against
+// 
+void ensureLightAccumFBO(int w, int h) {
+	if (ivec2(w, h) == g_light_accum_size) return;
+
+	if (!g_fbo_light) glGenFramebuffers(1, &g_fbo_light);
+	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, g_fbo_light);
+
+	glActiveTexture(GL_TEXTURE11);
+	if (!g_tex_light_accum) {
+		glGenTextures(1, &g_tex_light_accum);
+		glBindTexture(GL_TEXTURE_2D, g_tex_light_accum);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	}
+	glBindTexture(GL_TEXTURE_2D, g_tex_light_accum);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F, w, h, 0, GL_RGBA, GL_FLOAT, nullptr);
+	glFramebufferTexture(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, g_tex_light_accum, 0);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	glActiveTexture(GL_TEXTURE0);
+
+	// the scene depth can't be attached here while it's being sampled, so
+	// it is copied, which needs the same format
+	if (!g_rbo_light_depth) glGenRenderbuffers(1, &g_rbo_light_depth);
+	glBindRenderbuffer(GL_RENDERBUFFER, g_rbo_light_depth);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, w, h);
+	glBindRenderbuffer(GL_RENDERBUFFER, 0);
+	glFramebufferRenderbuffer(GL_DRAW_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, g_rbo_light_depth);
+
+	g_light_accum_size = ivec2(w, h);
 }
 
 
+// Shades each light's influence sphere (see lightInfluenceRadius) into the
+// light accumulation buffer, so a light only costs the pixels near it
+// For each light, a stencil pass marks the pixels whose surface is inside
+// the sphere (depth fail counting, so it works with the camera inside it
+// too), then the lighting pass shades and unmarks them with additive blending
+// 
+void renderLightVolumes(int width, int height) {
+	profile_scope scope(g_profiler, "light volumes");
+
+	ensureLightAccumFBO(width, height);
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, g_fbo_scene);
+	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, g_fbo_light);
+	glBlitFramebuffer(0, 0, width, height, 0, 0, width, height, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+
+	glViewport(0, 0, width, height);
+	glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+	glClearStencil(0);
+	glClear(GL_COLOR_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
+
+	// The sphere mesh is inscribed in the unit sphere, so it's scaled out
+	// to cover the whole influence radius
+	const int slices = 10, stacks = 10;
+	const float cover = 1.0 / (cos(math::pi() / (2 * slices)) * cos(math::pi() / (2 * stacks)));
+	mesh_cache &cache = meshCache();
+	const gl_mesh &sphere = cache.sphere(1.0, slices, stacks);
+
+	for (const shader_program *prog : { &g_light_stencil_shader, &g_light_volume_shader }) {
+		glUseProgram(prog->id());
+		setLightingUniforms(*prog);
+		glUniformMatrix4fv(prog->location(u_projection_matrix), 1, false, g_camera.projection().dataPointer());
+		glUniform2f(prog->location(u_screen_size), float(width), float(height));
+	}
+	glActiveTexture(GL_TEXTURE1);
+	glBindTexture(GL_TEXTURE_2D, g_tex_scene_normal);
+	glUniform1i(g_light_volume_shader.location(u_normal), 1);
+	glActiveTexture(GL_TEXTURE2);
+	glBindTexture(GL_TEXTURE_2D, g_tex_scene_diffuse);
+	glUniform1i(g_light_volume_shader.location(u_diffuse), 2);
+	glActiveTexture(GL_TEXTURE3);
+	glBindTexture(GL_TEXTURE_2D, g_tex_scene_specular);
+	glUniform1i(g_light_volume_shader.location(u_specular), 3);
+	glActiveTexture(GL_TEXTURE0);
+
+	// Both faces are drawn in both passes, so the sphere's winding doesn't
+	// matter. The lighting pass zeroes the stencil as it goes, so each
+	// pixel is only shaded once and is clear for the next light
+	glDepthMask(GL_FALSE);
+	glDepthFunc(GL_LESS);
+	glEnable(GL_STENCIL_TEST);
+	glBlendFunc(GL_ONE, GL_ONE);
+
+	g_light_volumes_drawn = 0;
+	for (int i = 0; i < int(g_lights.size()); ++i) {
+		const vec3 &pos_v = g_light_pos_v[i];
+		float radius = g_light_radius[i] * cover;
+
+		// entirely behind the camera
+		if (pos_v.z - radius > -g_znear) continue;
+
+		mat4 model_view = mat4::translate(pos_v) * mat4::scale(radius);
+		g_light_volumes_drawn++;
+
+		glUseProgram(g_light_stencil_shader.id());
+		glUniformMatrix4fv(g_light_stencil_shader.location(u_model_view_matrix), 1, false, model_view.dataPointer());
+		glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+		glEnable(GL_DEPTH_TEST);
+		glDisable(GL_BLEND);
+		glStencilFunc(GL_ALWAYS, 0, 0xFF);
+		glStencilOpSeparate(GL_BACK, GL_KEEP, GL_INCR_WRAP, GL_KEEP);
+		glStencilOpSeparate(GL_FRONT, GL_KEEP, GL_DECR_WRAP, GL_KEEP);
+		cache.draw(sphere);
+
+		glUseProgram(g_light_volume_shader.id());
+		glUniformMatrix4fv(g_light_volume_shader.location(u_model_view_matrix), 1, false, model_view.dataPointer());
+		glUniform1i(g_light_volume_shader.location(u_light_index), i);
+		glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+		glDisable(GL_DEPTH_TEST);
+		glEnable(GL_BLEND);
+		glStencilFunc(GL_NOTEQUAL, 0, 0xFF);
+		glStencilOp(GL_ZERO, GL_ZERO, GL_ZERO);
+		cache.draw(sphere);
+	}
+
+	glDisable(GL_BLEND);
+	glDisable(GL_STENCIL_TEST);
+	glDepthMask(GL_TRUE);
+	glUseProgram(0);
+}
 
 
 // 
 //
 void renderDeferred(int width, int height) {
+	profile_scope scope(g_profiler, "deferred");
+
+	if (g_lighting_mode == lighting_volumes) renderLightVolumes(width, height);
 
 	// Set to draw to the screen frame buffer
 	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
@@ -522,77 +1802,60 @@ void renderDeferred(int width, int height) {
 
 	// Use the deferred shading program
 	// 
-	glUseProgram(g_deferred_shader);
+	glUseProgram(g_deferred_shader.id());
 	glDisable(GL_DEPTH_TEST);
 
-
-	// Upload the far plane
-	// 
-	glUniform1f(glGetUniformLocation(g_deferred_shader, "uZFar"), g_zfar);
-
-	// Get the projection matrix to work out the plane to project onto
-	mat4 proj;
-	glGetFloatv(GL_PROJECTION_MATRIX, proj.dataPointer());
-	// Pick a z for unprojection (nearly arbitrary)
-	vec4 unproj = proj * vec4(0, 0, -g_znear * 10, 1);
-	glUniform1f(glGetUniformLocation(g_deferred_shader, "uZUnproject"), unproj.z / unproj.w);
+	// View rays and lights (and the depth buffer on unit 0)
+	//
+	setLightingUniforms(g_deferred_shader);
 
 
 	// Upload Exposure
 	// 
-	glUniform1f(glGetUniformLocation(g_deferred_shader, "uExposure"), g_exposure);
+	glUniform1f(g_deferred_shader.location(u_exposure), g_exposure);
 
 
-	// Upload the scene buffer textures
+	// Upload the rest of the scene buffer textures
 	// 
-	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_2D, g_tex_scene_depth);
-	glUniform1i(glGetUniformLocation(g_deferred_shader, "uDepth"), 0);
-
 	glActiveTexture(GL_TEXTURE1);
 	glBindTexture(GL_TEXTURE_2D, g_tex_scene_normal);
-	glUniform1i(glGetUniformLocation(g_deferred_shader, "uNormal"), 1);
+	glUniform1i(g_deferred_shader.location(u_normal), 1);
 
 	glActiveTexture(GL_TEXTURE2);
 	glBindTexture(GL_TEXTURE_2D, g_tex_scene_diffuse);
-	glUniform1i(glGetUniformLocation(g_deferred_shader, "uDiffuse"), 2);
+	glUniform1i(g_deferred_shader.location(u_diffuse), 2);
 
 	glActiveTexture(GL_TEXTURE3);
 	glBindTexture(GL_TEXTURE_2D, g_tex_scene_specular);
-	glUniform1i(glGetUniformLocation(g_deferred_shader, "uSpecular"), 3);
+	glUniform1i(g_deferred_shader.location(u_specular), 3);
 
 
-
-	// Setup the camera again, so the GL_MODELVIEW_MATRIX contains just the view matrix
-	setupCamera(width, height);
-	mat4 view;
-	glGetFloatv(GL_MODELVIEW_MATRIX, view.dataPointer());
+	// Lighting from the light volumes (see renderLightVolumes)
+	//
+	glUniform1i(g_deferred_shader.location(u_light_volumes), g_lighting_mode == lighting_volumes);
+	if (g_lighting_mode == lighting_volumes) {
+		glActiveTexture(GL_TEXTURE11);
+		glBindTexture(GL_TEXTURE_2D, g_tex_light_accum);
+	}
 
 
-	// Upload lights
-	// Positions must be in view-space
+	// Low resolution in-scattering, or the froxel volume (see renderInscatter)
 	//
-	glUniform1i(glGetUniformLocation(g_deferred_shader, "uNumLights"), GLuint(g_lights.size()));
-
-	for (size_t i = 0; i < g_lights.size(); ++i) {
-		ostringstream ss;
-		ss << "uLights[" << i << "].pos_v";
-		glUniform3fv(glGetUniformLocation(g_deferred_shader, ss.str().c_str()), 1, (view * vec4(g_lights[i].pos_w, 1)).dataPointer());
-		
-		ss = ostringstream();
-		ss << "uLights[" << i << "].flux";
-		glUniform3fv(glGetUniformLocation(g_deferred_shader, ss.str().c_str()), 1, (g_flux_mult * g_lights[i].flux).dataPointer());
+	glUniform1i(g_deferred_shader.location(u_inscatter_mode), g_inscatter_mode);
+	if (g_inscatter_mode == inscatter_low_res) {
+		glActiveTexture(GL_TEXTURE7);
+		glBindTexture(GL_TEXTURE_2D, g_tex_inscatter);
+		glUniform2f(g_deferred_shader.location(u_inscatter_size), float(g_inscatter_size.x), float(g_inscatter_size.y));
+	} else if (g_inscatter_mode == inscatter_froxels) {
+		glActiveTexture(GL_TEXTURE9);
+		glBindTexture(GL_TEXTURE_3D, g_tex_froxel_volume);
 	}
+	glActiveTexture(GL_TEXTURE0);
 
 
 	// Draw a triangle that covers the screen
 	// This does the deferred shading pass
-	glBegin(GL_TRIANGLES);
-	glVertex3f(-1.0, -1.0, 0.0);
-	glVertex3f(3.0, -1.0, 0.0);
-	glVertex3f(-1.0, 3.0, 0.0);
-	glEnd();
-	glFlush();
+	cgraScreenTriangle();
 
 	glUseProgram(0);
 }
@@ -601,26 +1864,153 @@ void renderDeferred(int width, int height) {
 // Draw function
 //
 void render(int width, int height) {
+	setupCamera(width, height);
 	renderSceneBuffer(width, height);
+	uploadLights();
+	renderInscatter(width, height);
 	renderDeferred(width, height);
 }
 
 
+// Writes the frames captured by the profiler to g_trace_file
+//
+void writeTrace() {
+	ofstream out(g_trace_file);
+	if (!out) {
+		cerr << "Error: Could not open " << g_trace_file << " for writing" << endl;
+		return;
+	}
+	g_profiler.writeChromeTrace(out);
+	cout << "Wrote " << g_trace_file << endl;
+}
+
+
+// Per scope timings of the last profiled frame, with a rolling graph of
+// GPU time (or CPU time if there are no timer queries)
+//
+void renderProfilerGUI() {
+	for (const frame_profiler::scope_result &r : g_profiler.lastFrame()) {
+		const vector<float> &history = g_profiler.gpuTiming() ? g_profiler.gpuHistory(r.name) : g_profiler.cpuHistory(r.name);
+
+		char overlay[64];
+		if (r.gpu_ms == r.gpu_ms) {
+			snprintf(overlay, sizeof(overlay), "cpu %.2f ms, gpu %.2f ms", r.cpu_ms, r.gpu_ms);
+		} else {
+			snprintf(overlay, sizeof(overlay), "cpu %.2f ms", r.cpu_ms);
+		}
+
+		for (int i = 0; i < r.depth; ++i) ImGui::Indent();
+		ImGui::PlotLines(g_profiler.name(r.name).c_str(), &history[0], int(history.size()), g_profiler.historyOffset(), overlay, 0.0f, FLT_MAX, ImVec2(0, 30));
+		for (int i = 0; i < r.depth; ++i) ImGui::Unindent();
+	}
+
+	if (g_profiler.capturing()) {
+		ImGui::Text("Capturing trace...");
+	} else if (ImGui::Button("Dump trace")) {
+		g_profiler.startCapture(g_trace_frames);
+		g_trace_pending = true;
+	}
+	ImGui::SameLine();
+	ImGui::Text("%d frames to %s", g_trace_frames, g_trace_file.c_str());
+}
+
+
 // Draw GUI function
 //
 void renderGUI() {
 	ImGui::Begin("Debug");
 	ImGui::Text("Application average %.3f ms/frame (%.1f FPS)", 1000.0f / ImGui::GetIO().Framerate, ImGui::GetIO().Framerate);
 
+	ImGui::Text("Scene: %d objects, %d materials", int(g_scene.objects.size()), int(g_scene.materials.size()));
+	ImGui::Checkbox("Frustum culling", &g_frustum_culling);
+	ImGui::Text("Objects drawn: %d, culled: %d (BVH nodes tested %d, objects tested %d)",
+		g_cull_stats.visible, g_cull_stats.culled, g_cull_stats.nodes_tested, g_cull_stats.objects_tested);
+	ImGui::Text("Occlusion culling");
+	ImGui::RadioButton("Off", &g_occlusion_mode, occlusion_off);
+	ImGui::SameLine();
+	ImGui::RadioButton("GPU", &g_occlusion_mode, occlusion_gpu);
+	ImGui::SameLine();
+	ImGui::RadioButton("CPU", &g_occlusion_mode, occlusion_cpu);
+	ImGui::SameLine();
+	ImGui::RadioButton("Raster", &g_occlusion_mode, occlusion_raster);
+	if (g_occlusion_mode != occlusion_off) {
+		ImGui::Text("Objects occluded: %d", g_occluded_objects);
+	}
+	if (g_occlusion_mode == occlusion_raster) {
+		ImGui::SliderFloat("Occluder min size", &g_occluder_min_size, 0.f, 0.5f);
+		ImGui::Text("Occluders: %d, triangles: %d (%d set up, %d binned)", g_raster_stats.occluders,
+			g_raster_stats.triangles, g_raster_stats.triangles_set_up, g_raster_stats.bin_entries);
+	}
+	ImGui::Checkbox("Sort draws", &g_sort_draws);
+	const draw_list_stats &ds = g_scene_draw_stats;
+	ImGui::Text("Scene state changes: %d programs, %d materials, %d meshes for %d draws",
+		ds.program_changes, ds.material_changes, ds.mesh_changes, ds.draws);
+	ImGui::Checkbox("Level of detail", &g_lod_enabled);
+	if (g_lod_enabled) {
+		ImGui::SliderInt("LOD levels", &g_lod.levels, 1, lod_policy::max_levels);
+		ImGui::SliderFloat("LOD edge pixels", &g_lod.edge_pixels, 1.0, 64.0, "%.1f");
+		ImGui::SliderFloat("LOD hysteresis", &g_lod.hysteresis, 0.0, 1.0, "%.2f");
+		ImGui::Text("Objects per level:");
+		for (int count : g_lod_counts) {
+			ImGui::SameLine();
+			ImGui::Text("%d", count);
+		}
+	}
+
+	// Mesh builds and trig calls should stop increasing after the first frame
+	const mesh_stats &ms = meshCache().stats();
+	ImGui::Text("Meshes cached: %d (built %llu, trig calls %llu)", int(meshCache().size()), ms.builds, ms.trig_calls);
+	ImGui::Text("Vertex cache ACMR: %.3f (%.3f as generated)", ms.acmr(), ms.acmrGenerated());
+
+	int gbuffer_bpp = gbufferBytesPerPixel(g_compact_gbuffer);
+	ImGui::Text("G-buffer: %s, %d B/px, %.1f MB", g_compact_gbuffer ? "compact" : "standard", gbuffer_bpp,
+		double(g_last_frame_size.x) * g_last_frame_size.y * gbuffer_bpp / (1024 * 1024));
+
+	if (ImGui::CollapsingHeader("Profiler", nullptr, true, true)) {
+		renderProfilerGUI();
+	}
+
 	ImGui::Separator();
 
 	ImGui::SliderFloat("Exposure", &g_exposure, 0.0, 100.0, "%.1f");
 	ImGui::SliderFloat("Flux Multiplier", &g_flux_mult, 1.0, 100.0, "%.0f");
 
 
-	ImGui::SliderInt("# of Lights", &g_num_lights, 0, 64);
+	ImGui::DragInt("# of Lights", &g_num_lights, 1.0, 0, g_max_lights);
+
+	ImGui::Text("Lighting");
+	ImGui::RadioButton("Fullscreen", &g_lighting_mode, lighting_fullscreen);
+	ImGui::SameLine();
+	ImGui::RadioButton("Light volumes", &g_lighting_mode, lighting_volumes);
+	if (g_lighting_mode == lighting_volumes) {
+		ImGui::Text("Light volumes drawn: %d", g_light_volumes_drawn);
+	}
+
+	ImGui::Checkbox("Cluster Lights", &g_cluster_lights);
+	if (g_cluster_lights) {
+		ImGui::Text("Cluster light references: %d", int(g_light_clusters.indices().size()));
+	}
+	ImGui::SliderFloat("Light threshold", &g_light_threshold, 0.0001, 0.1, "%.4f", 3.0);
+
+	ImGui::Text("In-scatter");
+	ImGui::RadioButton("Per pixel", &g_inscatter_mode, inscatter_per_pixel);
+	ImGui::SameLine();
+	ImGui::RadioButton("Low res", &g_inscatter_mode, inscatter_low_res);
+	ImGui::SameLine();
+	ImGui::RadioButton("Froxels", &g_inscatter_mode, inscatter_froxels);
+	if (g_inscatter_mode == inscatter_low_res) {
+		ImGui::RadioButton("Half", &g_inscatter_scale, 2);
+		ImGui::SameLine();
+		ImGui::RadioButton("Quarter", &g_inscatter_scale, 4);
+	} else if (g_inscatter_mode == inscatter_froxels) {
+		ImGui::SliderInt3("Froxel grid", &g_froxel_dims[0], 1, 256);
+		ImGui::SliderFloat("Slice exponent", &g_froxel_exponent, 1.0, 4.0, "%.1f");
+	}
 
 	ImGui::Checkbox("Draw Lights", &g_draw_lights);
+	ImGui::Checkbox("Instancing", &g_instancing);
+	ImGui::DragInt("Stress instances", &g_stress_instances, 100.0, 0, g_max_stress_instances);
+	ImGui::Text("Scene draw calls: %d, triangles: %llu", g_scene_draw_calls, g_scene_triangles);
 	ImGui::Checkbox("Simulate Lights", &g_simulate_lights);
 	if (g_simulate_lights) {
 		ImGui::SliderFloat("Min speed", &g_min_light_speed, 0.0, 1.0, "%.1f");
@@ -634,6 +2024,313 @@ void renderGUI() {
 
 
 
+// Renders g_bench_warmup frames, which build every mesh they draw, then
+// g_bench_frames more with the same settings, which must build no meshes
+// and evaluate no trig functions. Built as frame_check (with heap_counter.cpp)
+// they must also make no heap allocations. The warm up is at least long
+// enough for the profiler to have read back a frame, as its results only
+// grow to size then
+//
+bool checkMeshCache(ostream &out) {
+	int width, height;
+	glfwGetFramebufferSize(g_window, &width, &height);
+	auto frame = [&] {
+		g_profiler.beginFrame();
+		updateLights();
+		render(width, height);
+		g_profiler.endFrame();
+		glfwSwapBuffers(g_window);
+	};
+
+	int warmup = std::max(g_bench_warmup, int(frame_profiler::frames_in_flight) + 1);
+	for (int i = 0; i < warmup; ++i) frame();
+	glFinish();
+
+	mesh_cache &cache = meshCache();
+	mesh_stats before = cache.stats();
+#ifdef CGRA_HEAP_COUNTER
+	unsigned long long allocations = heapAllocations();
+#endif
+
+	for (int i = 0; i < g_bench_frames; ++i) frame();
+	glFinish();
+
+	const mesh_stats &after = cache.stats();
+	unsigned long long builds = after.builds - before.builds, trig_calls = after.trig_calls - before.trig_calls;
+	bool pass = builds == 0 && trig_calls == 0 && after.draws > before.draws;
+	out << "Mesh cache: " << cache.size() << " meshes for " << g_scene.objects.size() << " objects, then over "
+		<< g_bench_frames << " frames " << builds << " builds, " << trig_calls << " trig calls, "
+		<< after.draws - before.draws << " draws";
+#ifdef CGRA_HEAP_COUNTER
+	allocations = heapAllocations() - allocations;
+	pass = pass && allocations == 0;
+	out << ", " << allocations << " heap allocations";
+#else
+	out << ", heap allocations not counted (build frame_check for that)";
+#endif
+	out << " " << (pass ? "pass" : "FAIL") << endl;
+	return pass;
+}
+
+
+// Headless benchmark loop
+// Renders a fixed number of frames into the (invisible) window, timing each
+// pass on the CPU and GPU, then writes the results as CSV. The light upload
+// (transform, clustering and texture upload) is timed as its own pass, and
+// the whole run is repeated for every light count in g_bench_lights.
+// With --trace every frame, warm up included, is also written as a trace.
+// Returns false (with a message) if the CSV can't be written
+//
+bool runBenchmark() {
+	int width, height;
+	glfwGetFramebufferSize(g_window, &width, &height);
+
+	ofstream csv(g_bench_csv);
+	if (!csv) {
+		cerr << "Error: Could not open " << g_bench_csv << " for writing" << endl;
+		return false;
+	}
+
+	vector<int> light_counts = g_bench_lights;
+	if (light_counts.empty()) light_counts.push_back(g_num_lights);
+
+	printGBufferReport(cout);
+
+	if (g_trace_benchmark) g_profiler.startCapture();
+
+	for (size_t run = 0; run < light_counts.size(); ++run) {
+		g_num_lights = light_counts[run];
+
+		// Warm up so one-off work (mesh cache, FBO allocation, shader
+		// compilation in the driver) doesn't end up in the timings
+		for (int i = 0; i < g_bench_warmup; ++i) {
+			g_profiler.beginFrame();
+			updateLights();
+			render(width, height);
+			g_profiler.endFrame();
+			glfwSwapBuffers(g_window);
+		}
+		glFinish();
+
+		frame_benchmark bench({ "scene", "lights", "inscatter", "deferred" }, g_bench_frames);
+		bench.setLightCount(g_num_lights);
+		if (!bench.gpuTiming() && run == 0) {
+			cout << "GL_ARB_timer_query not available, GPU timings will be empty" << endl;
+		}
+
+		while (!bench.done()) {
+			g_profiler.beginFrame();
+			updateLights();
+
+			setupCamera(width, height);
+
+			bench.beginPass(0);
+			renderSceneBuffer(width, height);
+			bench.endPass(0);
+
+			bench.beginPass(1);
+			uploadLights();
+			bench.endPass(1);
+
+			bench.beginPass(2);
+			renderInscatter(width, height);
+			bench.endPass(2);
+
+			bench.beginPass(3);
+			renderDeferred(width, height);
+			bench.endPass(3);
+
+			g_profiler.endFrame();
+			bench.nextFrame();
+			glfwSwapBuffers(g_window);
+			glfwPollEvents();
+		}
+
+		bench.collect();
+		bench.printSummary(cout);
+		const draw_list_stats &ds = g_scene_draw_stats;
+		cout << "Objects drawn per frame: " << g_cull_stats.visible << ", culled " << g_cull_stats.culled
+			<< " (BVH nodes tested " << g_cull_stats.nodes_tested << "), occluded " << g_occluded_objects << endl;
+		if (g_occlusion_mode == occlusion_raster) {
+			cout << "Occluders per frame: " << g_raster_stats.occluders << ", " << g_raster_stats.triangles << " triangles ("
+				<< g_raster_stats.triangles_set_up << " set up, " << g_raster_stats.bin_entries << " binned)" << endl;
+		}
+		cout << "Scene state changes per frame: " << ds.program_changes << " programs, " << ds.material_changes << " materials, "
+			<< ds.mesh_changes << " meshes for " << ds.draws << " draws" << endl;
+		cout << "Scene triangles per frame: " << g_scene_triangles << " (objects per level";
+		for (int count : g_lod_counts) cout << " " << count;
+		cout << ")" << endl;
+		cout << "Vertex cache ACMR of built meshes: " << meshCache().stats().acmr() << " ("
+			<< meshCache().stats().acmrGenerated() << " as generated)" << endl;
+		bench.writeCSV(csv, run == 0);
+	}
+
+	cout << "Wrote " << g_bench_csv << endl;
+
+	if (g_trace_benchmark) {
+		g_profiler.finish();
+		writeTrace();
+	}
+	return true;
+}
+
+
+// Reads command line options, returns false if they are malformed
+//
+bool parseArguments(int argc, char **argv) {
+	for (int i = 1; i < argc; ++i) {
+		string arg = argv[i];
+		bool has_value = i + 1 < argc;
+
+		if (arg == "--headless") {
+			g_headless = true;
+		} else if (arg == "--frames" && has_value) {
+			g_bench_frames = atoi(argv[++i]);
+		} else if (arg == "--warmup" && has_value) {
+			g_bench_warmup = atoi(argv[++i]);
+		} else if (arg == "--size" && has_value) {
+			istringstream ss(argv[++i]);
+			char x = 0;
+			if (!(ss >> g_headless_size.x >> x >> g_headless_size.y) || x != 'x') return false;
+		} else if (arg == "--lights" && has_value) {
+			// single count, or a comma separated list to sweep over
+			istringstream ss(argv[++i]);
+			string count;
+			g_bench_lights.clear();
+			while (getline(ss, count, ',')) {
+				g_bench_lights.push_back(atoi(count.c_str()));
+				if (g_bench_lights.back() < 0 || g_bench_lights.back() > g_max_lights) return false;
+			}
+			if (g_bench_lights.empty()) return false;
+			g_num_lights = g_bench_lights.front();
+		} else if (arg == "--simulate") {
+			g_simulate_lights = true;
+		} else if (arg == "--seed" && has_value) {
+			g_lights.seed(unsigned(strtoul(argv[++i], nullptr, 10)));
+		} else if (arg == "--csv" && has_value) {
+			g_bench_csv = argv[++i];
+		} else if (arg == "--inscatter" && has_value) {
+			string mode = argv[++i];
+			if (mode == "full") g_inscatter_mode = inscatter_per_pixel;
+			else if (mode == "half") { g_inscatter_mode = inscatter_low_res; g_inscatter_scale = 2; }
+			else if (mode == "quarter") { g_inscatter_mode = inscatter_low_res; g_inscatter_scale = 4; }
+			else if (mode == "froxels") g_inscatter_mode = inscatter_froxels;
+			else return false;
+		} else if (arg == "--froxels" && has_value) {
+			ivec3 &d = g_froxel_dims;
+			if (sscanf(argv[++i], "%dx%dx%d", &d.x, &d.y, &d.z) != 3 || d.x <= 0 || d.y <= 0 || d.z <= 0) return false;
+		} else if (arg == "--froxel-exponent" && has_value) {
+			g_froxel_exponent = float(atof(argv[++i]));
+			if (g_froxel_exponent <= 0) return false;
+		} else if (arg == "--lighting" && has_value) {
+			string mode = argv[++i];
+			if (mode == "fullscreen") g_lighting_mode = lighting_fullscreen;
+			else if (mode == "volumes") g_lighting_mode = lighting_volumes;
+			else return false;
+		} else if (arg == "--light-threshold" && has_value) {
+			g_light_threshold = float(atof(argv[++i]));
+			if (g_light_threshold <= 0) return false;
+		} else if (arg == "--scene" && has_value) {
+			g_scene_file = argv[++i];
+		} else if (arg == "--generate-scene" && has_value) {
+			g_generate_scene = atoi(argv[++i]);
+			if (g_generate_scene < 0) return false;
+		} else if (arg == "--write-scene" && has_value) {
+			g_write_scene = argv[++i];
+		} else if (arg == "--no-culling") {
+			g_frustum_culling = false;
+		} else if (arg == "--occlusion" && has_value) {
+			string mode = argv[++i];
+			if (mode == "off") g_occlusion_mode = occlusion_off;
+			else if (mode == "gpu") g_occlusion_mode = occlusion_gpu;
+			else if (mode == "cpu") g_occlusion_mode = occlusion_cpu;
+			else if (mode == "raster") g_occlusion_mode = occlusion_raster;
+			else return false;
+		} else if (arg == "--check-culling") {
+			g_check_culling = true;
+		} else if (arg == "--check-mesh-cache") {
+			g_check_mesh_cache = true;
+			g_headless = true;
+		} else if (arg == "--no-sort-draws") {
+			g_sort_draws = false;
+		} else if (arg == "--no-lod") {
+			g_lod_enabled = false;
+		} else if (arg == "--lod-edge" && has_value) {
+			g_lod.edge_pixels = float(atof(argv[++i]));
+			if (g_lod.edge_pixels <= 0) return false;
+		} else if (arg == "--draw-lights") {
+			g_draw_lights = true;
+		} else if (arg == "--instances" && has_value) {
+			g_stress_instances = atoi(argv[++i]);
+			if (g_stress_instances < 0 || g_stress_instances > g_max_stress_instances) return false;
+		} else if (arg == "--no-instancing") {
+			g_instancing = false;
+		} else if (arg == "--check-inscatter") {
+			g_check_inscatter = true;
+		} else if (arg == "--compact-gbuffer") {
+			g_compact_gbuffer = true;
+		} else if (arg == "--trace" && has_value) {
+			g_trace_file = argv[++i];
+			g_trace_benchmark = true;
+		} else {
+			return false;
+		}
+	}
+	return g_bench_frames > 0 && g_bench_warmup >= 0 && g_num_lights >= 0
+		&& g_headless_size.x > 0 && g_headless_size.y > 0;
+}
+
+
+void printUsage(const char *name) {
+	cerr << "Usage: " << name << " [--headless] [--frames N] [--warmup N] [--size WxH] [--compact-gbuffer]" << endl;
+	cerr << "       [--inscatter full|half|quarter|froxels] [--froxels WxHxD] [--froxel-exponent E]" << endl;
+	cerr << "       [--lighting fullscreen|volumes] [--light-threshold T]" << endl;
+	cerr << "       [--scene FILE] [--generate-scene N] [--write-scene FILE] [--no-sort-draws] [--no-culling]" << endl;
+	cerr << "       [--occlusion off|gpu|cpu|raster] [--no-lod] [--lod-edge P]" << endl;
+	cerr << "       [--draw-lights] [--instances N] [--no-instancing]" << endl;
+	cerr << "       [--lights N[,N...]] [--simulate] [--seed N] [--csv FILE] [--trace FILE]" << endl;
+	cerr << "       " << name << " --check-inscatter" << endl;
+	cerr << "       " << name << " --check-culling" << endl;
+	cerr << "       " << name << " --check-mesh-cache [--frames N] [--warmup N] [--size WxH] [scene and drawing options]" << endl;
+	cerr << endl;
+	cerr << "  --headless   render without a visible window and write per-pass timings" << endl;
+	cerr << "  --frames N   number of timed frames (default 300)" << endl;
+	cerr << "  --warmup N   number of untimed frames first (default 10)" << endl;
+	cerr << "  --size WxH   render resolution (default 1280x720)" << endl;
+	cerr << "  --compact-gbuffer  use the 16 B/px G-buffer layout (also without --headless)" << endl;
+	cerr << "  --inscatter M      in-scattering per pixel (full, default), at half or quarter" << endl;
+	cerr << "                     resolution, or from a froxel volume (froxels)" << endl;
+	cerr << "  --froxels WxHxD    froxel grid size (default 160x90x64)" << endl;
+	cerr << "  --froxel-exponent E  froxel slice distribution, 1 is linear (default 2)" << endl;
+	cerr << "  --lighting M       shade every light over the whole screen (fullscreen, default)" << endl;
+	cerr << "                     or only inside its influence sphere (volumes)" << endl;
+	cerr << "  --light-threshold T  displayed luminance lights fade out at (default 0.002)" << endl;
+	cerr << "  --scene FILE       scene to render, text or binary (default work/res/scenes/default.scene)" << endl;
+	cerr << "  --generate-scene N render N random objects over the floor instead" << endl;
+	cerr << "  --write-scene FILE write the scene as binary, for faster loading, and exit" << endl;
+	cerr << "  --no-sort-draws    draw the scene objects in file order, not sorted by state" << endl;
+	cerr << "  --no-culling       draw every scene object, without frustum culling" << endl;
+	cerr << "  --occlusion M      skip objects hidden in the last frame's depth, tested on the GPU" << endl;
+	cerr << "                     (gpu) or on the CPU against a small read back level (cpu), or hidden" << endl;
+	cerr << "                     behind large objects drawn by a CPU rasterizer (raster), or not (off, default)" << endl;
+	cerr << "  --no-lod           draw every object and marker as tessellated, without level of detail" << endl;
+	cerr << "  --lod-edge P       longest silhouette edge in pixels before a finer level is drawn (default 8)" << endl;
+	cerr << "  --draw-lights      draw a marker sphere at each light" << endl;
+	cerr << "  --instances N      also draw N spheres over the floor, to stress test the scene pass" << endl;
+	cerr << "  --no-instancing    draw the markers and spheres one draw call each" << endl;
+	cerr << "  --lights N   number of lights, or a comma separated list to benchmark each" << endl;
+	cerr << "  --simulate   move the lights while rendering" << endl;
+	cerr << "  --seed N     seed for creating lights, so runs are repeatable" << endl;
+	cerr << "  --csv FILE   where to write the timings (default benchmark.csv)" << endl;
+	cerr << "  --trace FILE also write every benchmark frame as a Chrome trace (JSON)" << endl;
+	cerr << "  --check-inscatter  compare the in-scattering table with a marched reference and exit" << endl;
+	cerr << "  --check-culling    compare BVH culling with testing every object, on generated scenes, and exit" << endl;
+	cerr << "  --check-mesh-cache check that after the warm up frames, frames build no meshes, evaluate no" << endl;
+	cerr << "                     trig functions and (in frame_check) make no heap allocations, and exit" << endl;
+}
+
+
+
 // Forward decleration for cleanliness (Ignore)
 void APIENTRY debugCallbackARB(GLenum, GLenum, GLuint, GLenum, GLsizei, const GLchar*, GLvoid*);
 
@@ -642,6 +2339,31 @@ void APIENTRY debugCallbackARB(GLenum, GLenum, GLuint, GLenum, GLsizei, const GL
 // 
 int main(int argc, char **argv) {
 
+	if (!parseArguments(argc, argv)) {
+		printUsage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	// CPU only, no window needed
+	if (g_check_inscatter) {
+		return checkInscatter(cout) ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+	if (g_check_culling) {
+		return checkCulling(cout) ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+	if (!loadScene()) return EXIT_FAILURE;
+	if (!g_write_scene.empty()) {
+		try {
+			g_scene.writeBinary(g_write_scene);
+		} catch (const exception &e) {
+			cerr << e.what() << endl;
+			return EXIT_FAILURE;
+		}
+		cout << "Wrote " << g_write_scene << endl;
+		return EXIT_SUCCESS;
+	}
+
 	// Initialize the GLFW library
 	if (!glfwInit()) {
 		cerr << "Error: Could not initialize GLFW" << endl;
@@ -657,7 +2379,14 @@ int main(int argc, char **argv) {
 #endif
 
 	// Create a windowed mode window and its OpenGL context
-	g_window = glfwCreateWindow(640, 480, "Hello World", nullptr, nullptr);
+	// In headless mode the window is never shown, it just provides the context
+	// and a default framebuffer of the requested size
+	if (g_headless) {
+		glfwWindowHint(GLFW_VISIBLE, false);
+		g_window = glfwCreateWindow(g_headless_size.x, g_headless_size.y, "Benchmark", nullptr, nullptr);
+	} else {
+		g_window = glfwCreateWindow(640, 480, "Hello World", nullptr, nullptr);
+	}
 	if (!g_window) {
 		cerr << "Error: Could not create GLFW window" << endl;
 		abort(); // Unrecoverable error
@@ -725,6 +2454,19 @@ int main(int argc, char **argv) {
 
 	// Initialize Geometry/Material/Lights
 	initShader();
+	initAirlight();
+
+	if (g_check_mesh_cache) {
+		bool pass = checkMeshCache(cout);
+		glfwTerminate();
+		return pass ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+	if (g_headless) {
+		bool written = runBenchmark();
+		glfwTerminate();
+		return written ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
 
 	// Loop until the user closes the window
 	while (!glfwWindowShouldClose(g_window)) {
@@ -735,6 +2477,8 @@ int main(int argc, char **argv) {
 		glViewport(0, 0, width, height);
 
 
+		g_profiler.beginFrame();
+
 		// Update Scene
 		updateLights();
 
@@ -742,9 +2486,20 @@ int main(int argc, char **argv) {
 		render(width, height);
 
 		// Render GUI on top
-		SimpleGUI::newFrame();
-		renderGUI();
-		SimpleGUI::render();
+		{
+			profile_scope scope(g_profiler, "gui");
+			SimpleGUI::newFrame();
+			renderGUI();
+			SimpleGUI::render();
+		}
+
+		g_profiler.endFrame();
+
+		// Write the trace once all the frames asked for are captured
+		if (g_trace_pending && !g_profiler.capturing()) {
+			writeTrace();
+			g_trace_pending = false;
+		}
 
 		// Swap front and back buffers
 		glfwSwapBuffers(g_window);
@@ -0,0 +1,234 @@
+//---------------------------------------------------------------------------
+//
+// Copyright (c) 2016 Taehyun Rhee, Joshua Scott, Ben Allen
+//
+// This software is provided 'as-is' for assignment of COMP308 in ECS,
+// Victoria University of Wellington, without any express or implied warranty. 
+// In no event will the authors be held liable for any damages arising from
+// the use of this software.
+//
+// The contents of this file may not be copied or duplicated in any form
+// without the prior permission of its owner.
+//
+//----------------------------------------------------------------------------
+
+//----------------------------------------------------------------------------
+//
+// Microbenchmark for the matrix4<float> / vector4<float> SIMD paths
+//
+// Times multiply, transform, transpose and inverse over arrays of random
+// matrices, and the batch point transform, for the generic templates, the
+// scalar fallback and whichever SIMD path cgra_math.hpp selected, and reports
+// the largest difference between their results.
+//
+// Also steps the light simulation with the scalar, SIMD and threaded paths
+// from the same seed and checks they stay bit-for-bit identical.
+//
+// Usage: math_bench [count] [repeats]
+// Returns failure if any of the checks fail
+//
+//----------------------------------------------------------------------------
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "cgra_lights.hpp"
+#include "cgra_math.hpp"
+#include "cgra_parallel.hpp"
+
+using namespace std;
+using namespace cgra;
+
+
+// best time per call in nanoseconds over a number of repeats
+template <typename Op>
+double timeOp(int count, int repeats, Op op) {
+	double best = inf<double>();
+	for (int r = 0; r < repeats; ++r) {
+		auto start = chrono::high_resolution_clock::now();
+		for (int i = 0; i < count; ++i) op(i);
+		double ns = chrono::duration<double, nano>(chrono::high_resolution_clock::now() - start).count();
+		best = std::min(best, ns / count);
+	}
+	return best;
+}
+
+
+bool sameBits(const vector<float> &a, const vector<float> &b) {
+	return a.size() == b.size() && memcmp(a.data(), b.data(), a.size() * sizeof(float)) == 0;
+}
+
+
+bool sameBits(const light_store &a, const light_store &b) {
+	return sameBits(a.pos_x, b.pos_x) && sameBits(a.pos_y, b.pos_y) && sameBits(a.pos_z, b.pos_z)
+		&& sameBits(a.vel_x, b.vel_x) && sameBits(a.vel_y, b.vel_y) && sameBits(a.vel_z, b.vel_z);
+}
+
+
+float maxComponent(const vec4 &v) {
+	return std::max(std::max(v.x, v.y), std::max(v.z, v.w));
+}
+
+
+float maxDifference(const vector<mat4> &a, const vector<mat4> &b) {
+	float d = 0;
+	for (size_t i = 0; i < a.size(); ++i) {
+		for (int j = 0; j < 4; ++j) {
+			d = std::max(d, maxComponent(abs(a[i][j] - b[i][j])));
+		}
+	}
+	return d;
+}
+
+
+float maxDifference(const vector<vec4> &a, const vector<vec4> &b) {
+	float d = 0;
+	for (size_t i = 0; i < a.size(); ++i) {
+		d = std::max(d, maxComponent(abs(a[i] - b[i])));
+	}
+	return d;
+}
+
+
+void printRow(const string &name, double t_template, double t_scalar, double t_simd, float diff) {
+	cout << setw(10) << name
+		<< setw(12) << t_template << setw(12) << t_scalar << setw(12) << t_simd
+		<< setw(10) << t_template / t_simd << "x"
+		<< setw(14) << scientific << diff << fixed << endl;
+}
+
+
+int main(int argc, char **argv) {
+	int count = argc > 1 ? atoi(argv[1]) : 100000;
+	int repeats = argc > 2 ? atoi(argv[2]) : 20;
+	if (count <= 0 || repeats <= 0) {
+		cerr << "Usage: " << argv[0] << " [count] [repeats]" << endl;
+		return EXIT_FAILURE;
+	}
+
+#if defined(CGRA_MATH_SSE)
+	cout << "SIMD path : SSE" << endl;
+#elif defined(CGRA_MATH_NEON)
+	cout << "SIMD path : NEON" << endl;
+#else
+	cout << "SIMD path : none (scalar fallback)" << endl;
+#endif
+	cout << count << " operations, best of " << repeats << " runs, ns per operation" << endl << endl;
+
+	// well conditioned random matrices (diagonally dominant) so the
+	// inverses can be compared meaningfully
+	vector<mat4> a(count), b(count);
+	vector<vec4> v(count);
+	for (int i = 0; i < count; ++i) {
+		a[i] = mat4::random(-1, 1) + mat4(4);
+		b[i] = mat4::random(-1, 1) + mat4(4);
+		v[i] = vec4::random(-1, 1);
+	}
+
+	vector<mat4> m_template(count), m_scalar(count), m_simd(count);
+	vector<vec4> v_template(count), v_scalar(count), v_simd(count);
+
+	cout << fixed << setprecision(2);
+	cout << setw(10) << "op" << setw(12) << "template" << setw(12) << "scalar" << setw(12) << "simd"
+		<< setw(11) << "speedup" << setw(14) << "max diff" << endl;
+
+	// the generic operator*= is replaced for float, the scalar fallback
+	// uses the same loop
+	double t_template = timeOp(count, repeats, [&](int i) {
+		simd::scalar::multiply(a[i][0].dataPointer(), b[i][0].dataPointer(), m_template[i][0].dataPointer());
+	});
+	double t_scalar = t_template;
+	double t_simd = timeOp(count, repeats, [&](int i) { m_simd[i] = a[i] * b[i]; });
+	printRow("multiply", t_template, t_scalar, t_simd, maxDifference(m_template, m_simd));
+
+	t_template = timeOp(count, repeats, [&](int i) { v_template[i] = operator*<float, float>(a[i], v[i]); });
+	t_scalar = timeOp(count, repeats, [&](int i) {
+		simd::scalar::transform(a[i][0].dataPointer(), v[i].dataPointer(), v_scalar[i].dataPointer());
+	});
+	t_simd = timeOp(count, repeats, [&](int i) { v_simd[i] = a[i] * v[i]; });
+	printRow("transform", t_template, t_scalar, t_simd, std::max(maxDifference(v_template, v_scalar), maxDifference(v_template, v_simd)));
+
+	t_template = timeOp(count, repeats, [&](int i) { m_template[i] = transpose<float>(a[i]); });
+	t_scalar = timeOp(count, repeats, [&](int i) {
+		simd::scalar::transpose(a[i][0].dataPointer(), m_scalar[i][0].dataPointer());
+	});
+	t_simd = timeOp(count, repeats, [&](int i) { m_simd[i] = transpose(a[i]); });
+	printRow("transpose", t_template, t_scalar, t_simd, std::max(maxDifference(m_template, m_scalar), maxDifference(m_template, m_simd)));
+
+	t_template = timeOp(count, repeats, [&](int i) { m_template[i] = inverse<float>(a[i]); });
+	t_scalar = timeOp(count, repeats, [&](int i) {
+		simd::scalar::inverse(a[i][0].dataPointer(), m_scalar[i][0].dataPointer());
+	});
+	t_simd = timeOp(count, repeats, [&](int i) { m_simd[i] = inverse(a[i]); });
+	printRow("inverse", t_template, t_scalar, t_simd, std::max(maxDifference(m_template, m_scalar), maxDifference(m_template, m_simd)));
+
+	// batch point transform, timed per point
+	vector<vec3> p(count), p_template(count), p_scalar(count), p_simd(count), p_threaded(count);
+	for (int i = 0; i < count; ++i) p[i] = vec3::random(-100, 100);
+	unsigned threads = workerPool().size();
+
+	t_template = timeOp(1, repeats, [&](int) {
+		for (int i = 0; i < count; ++i) p_template[i] = vec3(operator*<float, float>(a[0], vec4(p[i], 1)));
+	}) / count;
+	t_scalar = timeOp(1, repeats, [&](int) {
+		simd::scalar::transformPoints(a[0][0].dataPointer(), p[0].dataPointer(), p_scalar[0].dataPointer(), count);
+	}) / count;
+	t_simd = timeOp(1, repeats, [&](int) { transformPoints(a[0], p.data(), p_simd.data(), count); }) / count;
+	double t_threaded = timeOp(1, repeats, [&](int) { transformPoints(a[0], p.data(), p_threaded.data(), count, &workerPool()); }) / count;
+
+	float point_diff = 0;
+	for (int i = 0; i < count; ++i) {
+		point_diff = std::max(point_diff, std::max(maxComponent(vec4(abs(p_template[i] - p_scalar[i]), 0)), maxComponent(vec4(abs(p_template[i] - p_simd[i]), 0))));
+		point_diff = std::max(point_diff, maxComponent(vec4(abs(p_template[i] - p_threaded[i]), 0)));
+	}
+	printRow("points", t_template, t_scalar, t_simd, point_diff);
+	cout << setw(10) << "threaded" << setw(36) << t_threaded << setw(10) << t_template / t_threaded << "x"
+		<< "    (" << threads << " threads)" << endl;
+
+	// light simulation step, timed per light
+	// a small zone so lights hit its edges and the speed clamps
+	light_motion motion;
+	motion.zone_min = vec3(-5, 8, -5);
+	motion.zone_max = vec3(5, 12, 5);
+
+	light_store l_scalar;
+	l_scalar.seed(308);
+	l_scalar.resize(count);
+	light_store l_simd = l_scalar;
+	light_store l_threaded = l_scalar;
+
+	t_scalar = timeOp(1, repeats, [&](int) { l_scalar.stepScalar(motion); }) / count;
+	t_simd = timeOp(1, repeats, [&](int) { l_simd.step(motion); }) / count;
+	t_threaded = timeOp(1, repeats, [&](int) { l_threaded.step(motion, &workerPool()); }) / count;
+
+	// keep going for longer without timing so more lights bounce
+	for (int i = 0; i < 200; ++i) {
+		l_scalar.stepScalar(motion);
+		l_simd.step(motion);
+		l_threaded.step(motion, &workerPool());
+	}
+	bool lights_match = sameBits(l_scalar, l_simd) && sameBits(l_scalar, l_threaded);
+
+	cout << setw(10) << "lights" << setw(24) << t_scalar << setw(12) << t_simd << setw(10) << t_scalar / t_simd << "x"
+		<< "    (vs scalar)" << endl;
+	cout << setw(10) << "threaded" << setw(36) << t_threaded << setw(10) << t_scalar / t_threaded << "x"
+		<< "    (" << workerPool().size() << " threads)" << endl;
+	cout << endl << "light steps bit-identical : " << (lights_match ? "yes" : "NO") << endl;
+
+	// sanity check, a * inverse(a) should be the identity
+	float identity_error = 0;
+	for (int i = 0; i < count; ++i) {
+		mat4 e = a[i] * m_simd[i] - mat4(1);
+		for (int j = 0; j < 4; ++j) identity_error = std::max(identity_error, maxComponent(abs(e[j])));
+	}
+	cout << scientific << "max |a * inverse(a) - I| : " << identity_error << endl;
+
+	return identity_error < 1e-4 && lights_match ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,158 @@
+//---------------------------------------------------------------------------
+//
+// Copyright (c) 2016 Taehyun Rhee, Joshua Scott, Ben Allen
+//
+// This software is provided 'as-is' for assignment of COMP308 in ECS,
+// Victoria University of Wellington, without any express or implied warranty. 
+// In no event will the authors be held liable for any damages arising from
+// the use of this software.
+//
+// The contents of this file may not be copied or duplicated in any form
+// without the prior permission of its owner.
+//
+//----------------------------------------------------------------------------
+
+//----------------------------------------------------------------------------
+//
+// Benchmark for the vertex cache optimisation (cgra_vertex_cache.hpp)
+//
+// Generates the meshes the scenes use, every level of detail of a 100x100
+// sphere and cylinder and the generated scene's shapes, and reports the
+// simulated ACMR (vertex cache misses per triangle) as generated and after
+// optimizeVertexCache, for FIFO caches of a few sizes, and how long the
+// optimisation takes.
+//
+// Also checks that the optimised meshes have exactly the same triangles,
+// with the same winding, and never miss more often than as generated, and
+// that lod_policy takes an object receding from the camera through every
+// level in turn, and back as it approaches.
+//
+// Usage: mesh_bench [repeats]
+// Returns failure if any of the checks fail
+//
+//----------------------------------------------------------------------------
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "cgra_geometry.hpp"
+#include "cgra_lod.hpp"
+#include "cgra_vertex_cache.hpp"
+
+using namespace std;
+using namespace cgra;
+
+
+// Triangles rotated to start at their smallest index, which keeps the
+// winding, and sorted, to compare orderings of the same triangles
+vector<array<GLuint, 3>> canonicalTriangles(const vector<GLuint> &indices) {
+	vector<array<GLuint, 3>> tris;
+	for (size_t i = 0; i + 2 < indices.size(); i += 3) {
+		array<GLuint, 3> t = { indices[i], indices[i + 1], indices[i + 2] };
+		rotate(t.begin(), min_element(t.begin(), t.end()), t.end());
+		tris.push_back(t);
+	}
+	sort(tris.begin(), tris.end());
+	return tris;
+}
+
+
+// Walks a 100 slice object from 500 pixels across to half a pixel and back,
+// which must pass through every level in order, ending where a fresh
+// selection would
+bool checkLodWalk() {
+	lod_policy lod;
+	const int segments = 200, top = lod_policy::max_levels - 1;
+	int level = -1, expected = 0;
+	bool ok = true;
+	for (float r = 500; r > 0.5f; r *= 0.97f) {
+		int next = lod.select(r, segments, level);
+		if (next != level) ok = ok && next == expected++;
+		level = next;
+	}
+	ok = ok && level == top && lod.select(0.5f, segments, -1) == top;
+	expected = top - 1;
+	for (float r = 0.5f; r < 500; r *= 1.03f) {
+		int next = lod.select(r, segments, level);
+		if (next != level) ok = ok && next == expected--;
+		level = next;
+	}
+	return ok && level == 0 && lod.select(500, segments, -1) == 0;
+}
+
+
+string describe(const mesh_cache::key &k) {
+	ostringstream out;
+	if (k.s == mesh_cache::shape::sphere) out << "sphere ";
+	else out << (k.radius1 > 0 ? "cylinder " : "cone ");
+	out << k.slices << "x" << k.stacks;
+	return out.str();
+}
+
+
+int main(int argc, char **argv) {
+	int repeats = argc > 1 ? atoi(argv[1]) : 10;
+	if (repeats <= 0) {
+		cerr << "Usage: " << argv[0] << " [repeats]" << endl;
+		return EXIT_FAILURE;
+	}
+
+	vector<mesh_cache::key> keys;
+	for (mesh_cache::key base : {
+		mesh_cache::key { mesh_cache::shape::sphere, 4, 0, 0, 100, 100 },
+		mesh_cache::key { mesh_cache::shape::cylinder, 2, 2, 20, 100, 100 },
+		mesh_cache::key { mesh_cache::shape::cylinder, 3, 0, 8, 100, 100 },
+	}) {
+		for (int level = 0; level < lod_policy::max_levels; ++level) keys.push_back(mesh_cache::lodKey(base, level));
+	}
+	keys.push_back({ mesh_cache::shape::sphere, 1, 0, 0, 20, 20 });
+	keys.push_back({ mesh_cache::shape::cylinder, 1, 1, 4, 20, 4 });
+	keys.push_back({ mesh_cache::shape::sphere, 1, 0, 0, 10, 10 });
+
+	const int cache_sizes[] = { 8, 16, 32 };
+	bool ok = true;
+
+	cout << fixed << setprecision(3);
+	cout << setw(18) << "mesh" << setw(10) << "tris" << setw(10) << "verts";
+	for (int size : cache_sizes) cout << setw(10) << "gen/" + to_string(size) << setw(8) << "opt";
+	cout << setw(12) << "opt ms" << endl;
+
+	for (const mesh_cache::key &k : keys) {
+		mesh_data data = k.s == mesh_cache::shape::sphere
+			? sphereMeshData(k.radius0, k.slices, k.stacks)
+			: cylinderMeshData(k.radius0, k.radius1, k.height, k.slices, k.stacks);
+		size_t vertices = data.vertices.size(), triangles = data.indices.size() / 3;
+
+		vector<GLuint> optimized;
+		double best = 1e300;
+		for (int r = 0; r < repeats; ++r) {
+			optimized = data.indices;
+			auto start = chrono::high_resolution_clock::now();
+			optimizeVertexCache(optimized, vertices);
+			best = std::min(best, chrono::duration<double, milli>(chrono::high_resolution_clock::now() - start).count());
+		}
+
+		cout << setw(18) << describe(k) << setw(10) << triangles << setw(10) << vertices;
+		for (int size : cache_sizes) {
+			double before = double(vertexCacheMisses(data.indices, vertices, size)) / triangles;
+			double after = double(vertexCacheMisses(optimized, vertices, size)) / triangles;
+			cout << setw(10) << before << setw(8) << after;
+			ok = ok && after <= before;
+		}
+		cout << setw(12) << best << endl;
+
+		ok = ok && canonicalTriangles(optimized) == canonicalTriangles(data.indices);
+	}
+
+	bool lod_ok = checkLodWalk();
+	cout << endl << "same triangles, and no worse : " << (ok ? "yes" : "NO") << endl;
+	cout << "level of detail walk : " << (lod_ok ? "pass" : "FAIL") << endl;
+	return ok && lod_ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,105 @@
+//---------------------------------------------------------------------------
+//
+// Copyright (c) 2016 Taehyun Rhee, Joshua Scott, Ben Allen
+//
+// This software is provided 'as-is' for assignment of COMP308 in ECS,
+// Victoria University of Wellington, without any express or implied warranty. 
+// In no event will the authors be held liable for any damages arising from
+// the use of this software.
+//
+// The contents of this file may not be copied or duplicated in any form
+// without the prior permission of its owner.
+//
+//----------------------------------------------------------------------------
+
+//----------------------------------------------------------------------------
+//
+// Check for the mesh cache (cgra_geometry.hpp)
+//
+// Draws the shapes renderSceneBuffer draws, in an invisible window, for a
+// number of frames after the first. The first frame builds every mesh; the
+// frames after it must build nothing, call no trig functions and make no
+// heap allocations (counted by heap_counter.cpp), while still issuing every
+// draw.
+//
+// Usage: mesh_check [frames]
+// Returns failure if any of the checks fail
+//
+//----------------------------------------------------------------------------
+
+#include <cstdlib>
+#include <iostream>
+
+#include "cgra_geometry.hpp"
+#include "heap_counter.hpp"
+#include "opengl.hpp"
+
+using namespace std;
+using namespace cgra;
+
+
+// The scene's meshes, as renderSceneBuffer draws them, and the light markers
+const int frame_draws = 6 + 64;
+
+void drawFrame() {
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	cgraSphere(4.0, 100, 100);
+	cgraCylinder(2.0, 2.0, 20, 100, 100);
+	cgraCone(3.0, 8.0, 100, 100);
+	cgraCylinder(4.0, 1.0, 20, 100, 100);
+	cgraCylinder(1.5, 3.0, 20, 100, 100);
+	cgraSphere(1500000, 100, 100);
+	for (int i = 0; i < 64; ++i) cgraSphere(0.1);
+	glFinish();
+}
+
+
+int main(int argc, char **argv) {
+	int frames = argc > 1 ? atoi(argv[1]) : 100;
+	if (frames <= 0) {
+		cerr << "Usage: " << argv[0] << " [frames]" << endl;
+		return EXIT_FAILURE;
+	}
+
+	if (!glfwInit()) {
+		cerr << "Error: Could not initialize GLFW" << endl;
+		return EXIT_FAILURE;
+	}
+	glfwWindowHint(GLFW_VISIBLE, GL_FALSE);
+	GLFWwindow *window = glfwCreateWindow(64, 64, "mesh_check", nullptr, nullptr);
+	if (!window) {
+		cerr << "Error: Could not create GLFW window" << endl;
+		glfwTerminate();
+		return EXIT_FAILURE;
+	}
+	glfwMakeContextCurrent(window);
+	glewExperimental = GL_TRUE;
+	if (glewInit() != GLEW_OK) {
+		cerr << "Error: Could not initialize GLEW" << endl;
+		glfwTerminate();
+		return EXIT_FAILURE;
+	}
+	glEnable(GL_DEPTH_TEST);
+
+	drawFrame();
+	const mesh_stats first = meshCache().stats();
+	unsigned long long allocations = heapAllocations();
+
+	for (int i = 0; i < frames; ++i) drawFrame();
+
+	const mesh_stats &last = meshCache().stats();
+	allocations = heapAllocations() - allocations;
+	bool ok = last.builds == first.builds
+		&& last.trig_calls == first.trig_calls
+		&& last.draws - first.draws == (unsigned long long)(frames) * frame_draws
+		&& allocations == 0;
+
+	cout << "meshes built : " << first.builds << ", then " << last.builds - first.builds << endl;
+	cout << "trig calls : " << first.trig_calls << ", then " << last.trig_calls - first.trig_calls << endl;
+	cout << "draws over " << frames << " frames : " << last.draws - first.draws << endl;
+	cout << "heap allocations over " << frames << " frames : " << allocations << endl;
+	cout << "mesh cache check : " << (ok ? "pass" : "FAIL") << endl;
+
+	glfwTerminate();
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,172 @@
+//---------------------------------------------------------------------------
+//
+// Copyright (c) 2016 Taehyun Rhee, Joshua Scott, Ben Allen
+//
+// This software is provided 'as-is' for assignment of COMP308 in ECS,
+// Victoria University of Wellington, without any express or implied warranty. 
+// In no event will the authors be held liable for any damages arising from
+// the use of this software.
+//
+// The contents of this file may not be copied or duplicated in any form
+// without the prior permission of its owner.
+//
+//----------------------------------------------------------------------------
+
+//----------------------------------------------------------------------------
+//
+// Benchmark for the software occlusion rasterizer (cgra_raster.hpp)
+//
+// Generates a scene like --generate-scene does, draws its large objects as
+// occluders from a camera near the middle, and tests every object against
+// them. Reports occluder triangles per second for the scalar, SIMD and
+// threaded paths, and the test latency per object.
+//
+// Also checks that every path produces a bit-identical depth buffer, and
+// that a few boxes around a single occluding wall are hidden or not as
+// they should be.
+//
+// Usage: raster_bench [objects] [repeats] [width]
+// Returns failure if any of the checks fail
+//
+//----------------------------------------------------------------------------
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <vector>
+
+#include "cgra_geometry.hpp"
+#include "cgra_math.hpp"
+#include "cgra_parallel.hpp"
+#include "cgra_raster.hpp"
+#include "cgra_scene.hpp"
+
+using namespace std;
+using namespace cgra;
+
+
+// best time per run in nanoseconds over a number of repeats
+template <typename Op>
+double timeBest(int repeats, Op op) {
+	double best = inf<double>();
+	for (int r = 0; r < repeats; ++r) {
+		auto start = chrono::high_resolution_clock::now();
+		op();
+		best = std::min(best, chrono::duration<double, nano>(chrono::high_resolution_clock::now() - start).count());
+	}
+	return best;
+}
+
+
+bool sameDepth(const occlusion_rasterizer &a, const occlusion_rasterizer &b) {
+	size_t n = size_t(a.stride()) * a.height();
+	return a.stride() == b.stride() && memcmp(a.depth(), b.depth(), n * sizeof(float)) == 0;
+}
+
+
+// A wall 4 wide and 2 high facing the camera at z = 0, seen from z = 5.
+// Boxes fully behind it must be hidden, the rest visible
+bool checkWall() {
+	occluder_mesh wall = occluderMeshData(mesh_cache::key { mesh_cache::shape::plane, 1, 0, 0, 0, 0 });
+	mat4 model = mat4::scale(2, 1, 1) * mat4::rotateX(radians(90.f));
+	mat4 view_proj = mat4::perspectiveProjection(radians(60.f), 1.f, 0.1f, 100.f) * mat4::lookAt(vec3(0, 0, 5), vec3(0, 0, 0), vec3(0, 1, 0));
+
+	occlusion_rasterizer r(64, 64);
+	r.clear(view_proj, 0.1f);
+	r.addOccluder(wall, model);
+	r.render();
+
+	struct { vec3 min, max; bool visible; } cases[] = {
+		{ vec3(-0.5f, -0.5f, -2), vec3(0.5f, 0.5f, -1), false }, // behind the middle
+		{ vec3(-1.8f, -0.8f, -9), vec3(1.8f, 0.8f, -8), false }, // far behind, nearly as wide
+		{ vec3(-0.5f, -0.5f, 1), vec3(0.5f, 0.5f, 2), true },    // in front
+		{ vec3(-0.5f, -0.5f, -1), vec3(0.5f, 0.5f, 0.5f), true }, // through the wall
+		{ vec3(1.5f, -0.5f, -2), vec3(2.5f, 0.5f, -1), true },   // behind, but over the edge
+		{ vec3(-5, -0.5f, -6), vec3(5, 0.5f, -5), true },        // behind, wider than its shadow
+	};
+	bool ok = true;
+	for (const auto &c : cases) ok = ok && r.visible(c.min, c.max) == c.visible;
+	return ok;
+}
+
+
+int main(int argc, char **argv) {
+	int objects = argc > 1 ? atoi(argv[1]) : 10000;
+	int repeats = argc > 2 ? atoi(argv[2]) : 20;
+	int width = argc > 3 ? atoi(argv[3]) : 256;
+	if (objects <= 0 || repeats <= 0 || width <= 0) {
+		cerr << "Usage: " << argv[0] << " [objects] [repeats] [width]" << endl;
+		return EXIT_FAILURE;
+	}
+
+#if defined(CGRA_MATH_SSE)
+	cout << "SIMD path : SSE" << endl;
+#else
+	cout << "SIMD path : none (scalar fallback)" << endl;
+#endif
+
+	// same camera, occluder selection and occluder meshes as the renderer
+	scene s = scene::generate(objects, 1);
+	const float aspect = 16.f / 9, znear = 0.1f, min_size = 0.05f;
+	vec3 eye(0, 2, 10);
+	mat4 view_proj = mat4::perspectiveProjection(radians(60.f), aspect, znear, 1000.f) * mat4::lookAt(eye, vec3(0, 1, 0), vec3(0, 1, 0));
+
+	map<mesh_cache::key, occluder_mesh> meshes;
+	vector<const occluder_mesh *> occluders;
+	vector<mat4> models;
+	for (const scene_object &o : s.objects) {
+		if (length(o.bounds.halfSize()) < min_size * length(o.bounds.center() - eye)) continue;
+		mesh_cache::key k = mesh_cache::occluderKey(o.mesh);
+		auto it = meshes.find(k);
+		if (it == meshes.end()) it = meshes.emplace(k, occluderMeshData(k)).first;
+		occluders.push_back(&it->second);
+		models.push_back(o.model);
+	}
+
+	int height = std::max(1, int(width / aspect));
+	occlusion_rasterizer r_scalar(width, height), r_simd(width, height), r_threaded(width, height);
+	worker_pool single(1);
+	auto draw = [&](occlusion_rasterizer &r, worker_pool &pool, bool simd) {
+		r.clear(view_proj, znear);
+		for (size_t i = 0; i < occluders.size(); ++i) r.addOccluder(*occluders[i], models[i]);
+		r.render(pool, simd);
+	};
+
+	double t_scalar = timeBest(repeats, [&] { draw(r_scalar, single, false); });
+	double t_simd = timeBest(repeats, [&] { draw(r_simd, single, true); });
+	double t_threaded = timeBest(repeats, [&] { draw(r_threaded, workerPool(), true); });
+	const raster_stats &stats = r_simd.stats();
+
+	cout << objects << " objects, " << stats.occluders << " occluders, " << stats.triangles << " triangles ("
+		<< stats.triangles_set_up << " set up, " << stats.bin_entries << " binned) at " << width << "x" << height
+		<< ", best of " << repeats << " runs" << endl << endl;
+
+	cout << fixed << setprecision(2);
+	cout << setw(10) << "path" << setw(12) << "ms" << setw(16) << "Mtris/s" << setw(11) << "speedup" << endl;
+	auto printRow = [&](const char *name, double ns) {
+		cout << setw(10) << name << setw(12) << ns * 1e-6 << setw(16) << stats.triangles / ns * 1e3
+			<< setw(10) << t_scalar / ns << "x" << endl;
+	};
+	printRow("scalar", t_scalar);
+	printRow("simd", t_simd);
+	printRow("threaded", t_threaded);
+	cout << "    (" << workerPool().size() << " threads)" << endl;
+
+	int occluded = 0;
+	double t_test = timeBest(repeats, [&] {
+		occluded = 0;
+		for (const scene_object &o : s.objects) occluded += !r_threaded.visible(o.bounds.min, o.bounds.max);
+	}) / s.objects.size();
+	cout << endl << "test latency : " << t_test << " ns per object, " << occluded << " of " << s.objects.size() << " occluded" << endl;
+
+	bool depth_match = sameDepth(r_scalar, r_simd) && sameDepth(r_scalar, r_threaded);
+	bool wall_ok = checkWall();
+	cout << "depth buffers bit-identical : " << (depth_match ? "yes" : "NO") << endl;
+	cout << "wall occlusion cases : " << (wall_ok ? "pass" : "FAIL") << endl;
+
+	return depth_match && wall_ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
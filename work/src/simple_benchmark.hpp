@@ -0,0 +1,200 @@
+//---------------------------------------------------------------------------
+//
+// Copyright (c) 2016 Taehyun Rhee, Joshua Scott, Ben Allen
+//
+// This software is provided 'as-is' for assignment of COMP308 in ECS,
+// Victoria University of Wellington, without any express or implied warranty. 
+// In no event will the authors be held liable for any damages arising from
+// the use of this software.
+//
+// The contents of this file may not be copied or duplicated in any form
+// without the prior permission of its owner.
+//
+//----------------------------------------------------------------------------
+
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include "opengl.hpp"
+
+namespace cgra {
+
+	// p-th percentile (0 to 100) of some samples, linearly interpolated
+	// between the closest ranks. Returns NaN if there are no samples.
+	inline double percentile(std::vector<double> samples, double p) {
+		if (samples.empty()) return std::numeric_limits<double>::quiet_NaN();
+		std::sort(samples.begin(), samples.end());
+		double rank = std::max(0.0, std::min(1.0, p / 100.0)) * (samples.size() - 1);
+		size_t lo = size_t(std::floor(rank));
+		size_t hi = std::min(lo + 1, samples.size() - 1);
+		return samples[lo] + (samples[hi] - samples[lo]) * (rank - lo);
+	}
+
+
+	// Records CPU and GPU time of a fixed set of passes over a number of frames.
+	//
+	// GPU time uses one GL_TIME_ELAPSED query per pass per frame. The queries
+	// are only read back by collect(), after all frames have been issued, so
+	// recording never stalls the CPU waiting on the GPU.
+	//
+	// Usage:
+	//   frame_benchmark bench({ "scene", "deferred" }, frames);
+	//   for each frame:
+	//     bench.beginPass(0); renderScene(); bench.endPass(0);
+	//     bench.beginPass(1); renderDeferred(); bench.endPass(1);
+	//     bench.nextFrame();
+	//   bench.collect();
+	//   bench.writeCSV(file);
+	//
+	class frame_benchmark {
+	private:
+		using clock = std::chrono::high_resolution_clock;
+
+		struct pass {
+			std::string name;
+			std::vector<double> cpu_ms;
+			std::vector<double> gpu_ms;
+			std::vector<GLuint> queries;
+		};
+
+		std::vector<pass> m_passes;
+		int m_frames;
+		int m_frame = 0;
+		int m_lights = 0;
+		bool m_gpu_timing;
+		clock::time_point m_pass_start;
+
+	public:
+		frame_benchmark(const std::vector<std::string> &pass_names, int frames) : m_frames(frames) {
+			m_gpu_timing = GLEW_ARB_timer_query || GLEW_VERSION_3_3;
+			for (const std::string &name : pass_names) {
+				pass p;
+				p.name = name;
+				p.cpu_ms.assign(frames, 0.0);
+				p.gpu_ms.assign(frames, std::numeric_limits<double>::quiet_NaN());
+				if (m_gpu_timing) {
+					p.queries.assign(frames, 0);
+					glGenQueries(frames, &p.queries[0]);
+				}
+				m_passes.push_back(std::move(p));
+			}
+		}
+
+		frame_benchmark(const frame_benchmark &) = delete;
+		frame_benchmark & operator=(const frame_benchmark &) = delete;
+
+		~frame_benchmark() {
+			for (pass &p : m_passes) {
+				if (!p.queries.empty()) glDeleteQueries(GLsizei(p.queries.size()), &p.queries[0]);
+			}
+		}
+
+		// Extra column written with every row, so runs can be told apart
+		void setLightCount(int lights) { m_lights = lights; }
+
+		bool gpuTiming() const { return m_gpu_timing; }
+
+		bool done() const { return m_frame >= m_frames; }
+
+		void beginPass(size_t i) {
+			assert(i < m_passes.size() && !done());
+			if (m_gpu_timing) glBeginQuery(GL_TIME_ELAPSED, m_passes[i].queries[m_frame]);
+			m_pass_start = clock::now();
+		}
+
+		void endPass(size_t i) {
+			assert(i < m_passes.size() && !done());
+			m_passes[i].cpu_ms[m_frame] = std::chrono::duration<double, std::milli>(clock::now() - m_pass_start).count();
+			if (m_gpu_timing) glEndQuery(GL_TIME_ELAPSED);
+		}
+
+		void nextFrame() {
+			m_frame++;
+		}
+
+		// Reads back all GPU queries (blocks until the GPU has finished)
+		void collect() {
+			if (!m_gpu_timing) return;
+			for (pass &p : m_passes) {
+				for (int f = 0; f < m_frame; ++f) {
+					GLuint64 ns = 0;
+					glGetQueryObjectui64v(p.queries[f], GL_QUERY_RESULT, &ns);
+					p.gpu_ms[f] = ns * 1e-6;
+				}
+			}
+		}
+
+		// Per-frame rows followed by summary rows (p50, p90, p99, max),
+		// the summary rows have the statistic name in the frame column
+		void writeCSV(std::ostream &out, bool header = true) const {
+			if (header) {
+				out << "frame,lights";
+				for (const pass &p : m_passes) {
+					out << "," << p.name << "_cpu_ms," << p.name << "_gpu_ms";
+				}
+				out << std::endl;
+			}
+
+			out << std::fixed << std::setprecision(4);
+			for (int f = 0; f < m_frame; ++f) {
+				out << f << "," << m_lights;
+				for (const pass &p : m_passes) {
+					out << ",";
+					writeValue(out, p.cpu_ms[f]);
+					out << ",";
+					writeValue(out, p.gpu_ms[f]);
+				}
+				out << std::endl;
+			}
+
+			const double stats[] = { 50, 90, 99, 100 };
+			const char *stat_names[] = { "p50", "p90", "p99", "max" };
+			for (int s = 0; s < 4; ++s) {
+				out << stat_names[s] << "," << m_lights;
+				for (const pass &p : m_passes) {
+					out << ",";
+					writeValue(out, percentile(samples(p.cpu_ms), stats[s]));
+					out << ",";
+					writeValue(out, percentile(samples(p.gpu_ms), stats[s]));
+				}
+				out << std::endl;
+			}
+		}
+
+		// Human readable median/p99 per pass
+		void printSummary(std::ostream &out) const {
+			out << std::fixed << std::setprecision(3);
+			out << "Benchmark : " << m_frame << " frames, " << m_lights << " lights" << std::endl;
+			for (const pass &p : m_passes) {
+				out << "  " << std::setw(10) << p.name
+					<< "  cpu p50 " << percentile(samples(p.cpu_ms), 50) << " ms, p99 " << percentile(samples(p.cpu_ms), 99) << " ms"
+					<< "  |  gpu p50 " << percentile(samples(p.gpu_ms), 50) << " ms, p99 " << percentile(samples(p.gpu_ms), 99) << " ms"
+					<< std::endl;
+			}
+		}
+
+	private:
+		// recorded samples, skipping frames not run and missing gpu results
+		std::vector<double> samples(const std::vector<double> &values) const {
+			std::vector<double> r;
+			for (int f = 0; f < m_frame; ++f) {
+				if (values[f] == values[f]) r.push_back(values[f]);
+			}
+			return r;
+		}
+
+		static void writeValue(std::ostream &out, double v) {
+			// leave missing values empty rather than writing nan
+			if (v == v) out << v;
+		}
+	};
+}
@@ -0,0 +1,324 @@
+//---------------------------------------------------------------------------
+//
+// Copyright (c) 2016 Taehyun Rhee, Joshua Scott, Ben Allen
+//
+// This software is provided 'as-is' for assignment of COMP308 in ECS,
+// Victoria University of Wellington, without any express or implied warranty. 
+// In no event will the authors be held liable for any damages arising from
+// the use of this software.
+//
+// The contents of this file may not be copied or duplicated in any form
+// without the prior permission of its owner.
+//
+//----------------------------------------------------------------------------
+
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <limits>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "opengl.hpp"
+
+namespace cgra {
+
+	// Hierarchical CPU and GPU profiler for every frame.
+	//
+	// Scopes can nest. Each one records its CPU time with a clock and its GPU
+	// time with a pair of GL_TIMESTAMP queries (GL_TIME_ELAPSED queries can't
+	// be nested). Queries are kept for frames_in_flight frames before being
+	// read, so the results are normally ready and the CPU never waits on the
+	// GPU. If they aren't ready yet the GPU times of that frame are dropped.
+	//
+	// The results of the last finished frame and a rolling history of every
+	// scope are kept for display, and frames can be captured and written in
+	// the Chrome trace format (open with chrome://tracing or Perfetto).
+	//
+	// It can be a global, nothing touches GL until it is first used.
+	// Query objects are left for the context to clean up.
+	//
+	// Usage:
+	//   profiler.beginFrame();
+	//   { profile_scope s(profiler, "scene"); renderScene(); }
+	//   profiler.endFrame();
+	//
+	class frame_profiler {
+	public:
+		static const int frames_in_flight = 3;
+		static const int history_length = 128;
+
+		// Timing of one scope in a finished frame
+		struct scope_result {
+			int name;
+			int depth;
+			double cpu_ms;
+			double gpu_ms; // NaN if not available
+		};
+
+	private:
+		using clock = std::chrono::high_resolution_clock;
+
+		struct scope_record {
+			int name;
+			int depth;
+			double cpu_begin_us;
+			double cpu_end_us;
+			size_t query; // index of the begin query, end is query + 1
+		};
+
+		struct frame_slot {
+			std::vector<scope_record> scopes;
+			std::vector<GLuint> queries;
+			size_t queries_used = 0;
+			bool pending = false;
+			long long frame = 0;
+		};
+
+		struct trace_event {
+			int name;
+			long long frame;
+			bool gpu;
+			double begin_us;
+			double end_us;
+		};
+
+		// rolling per scope history, indexed by name
+		struct scope_history {
+			std::vector<float> cpu_ms;
+			std::vector<float> gpu_ms;
+		};
+
+		bool m_started = false;
+		bool m_gpu_timing = false;
+		clock::time_point m_epoch;
+		long long m_frame = 0;
+		frame_slot m_slots[frames_in_flight];
+		std::vector<size_t> m_stack;
+
+		std::vector<std::string> m_names;
+		std::vector<scope_history> m_history;
+		int m_history_pos = 0;
+		std::vector<scope_result> m_last;
+
+		int m_capture_frames = 0; // frames left to capture, -1 until stopped
+		double m_gpu_offset_us = 0; // cpu time minus gpu time
+		std::vector<trace_event> m_trace;
+
+	public:
+		frame_profiler() : m_epoch(clock::now()) { }
+
+		frame_profiler(const frame_profiler &) = delete;
+		frame_profiler & operator=(const frame_profiler &) = delete;
+
+		// Only valid after the first beginFrame() or startCapture()
+		bool gpuTiming() const { return m_gpu_timing; }
+
+		// Starts a frame, reading back the frame that used this slot before
+		// Everything up to endFrame() is inside a root scope named "frame"
+		void beginFrame() {
+			assert(m_stack.empty());
+			start();
+
+			frame_slot &slot = m_slots[m_frame % frames_in_flight];
+			if (slot.pending) resolve(slot, false);
+
+			slot.scopes.clear();
+			slot.queries_used = 0;
+			slot.frame = m_frame;
+			push("frame");
+		}
+
+		void endFrame() {
+			pop();
+			assert(m_stack.empty());
+			m_slots[m_frame % frames_in_flight].pending = true;
+			m_frame++;
+		}
+
+		void push(const char *name) {
+			frame_slot &slot = m_slots[m_frame % frames_in_flight];
+			scope_record r;
+			r.name = nameIndex(name);
+			r.depth = int(m_stack.size());
+			r.cpu_begin_us = now();
+			r.cpu_end_us = r.cpu_begin_us;
+			r.query = slot.queries_used;
+			if (m_gpu_timing) {
+				if (slot.queries_used + 2 > slot.queries.size()) {
+					size_t n = slot.queries.size();
+					slot.queries.resize(std::max<size_t>(16, 2 * n));
+					glGenQueries(GLsizei(slot.queries.size() - n), &slot.queries[n]);
+				}
+				glQueryCounter(slot.queries[r.query], GL_TIMESTAMP);
+				slot.queries_used += 2;
+			}
+			m_stack.push_back(slot.scopes.size());
+			slot.scopes.push_back(r);
+		}
+
+		void pop() {
+			assert(!m_stack.empty());
+			frame_slot &slot = m_slots[m_frame % frames_in_flight];
+			scope_record &r = slot.scopes[m_stack.back()];
+			m_stack.pop_back();
+			if (m_gpu_timing) glQueryCounter(slot.queries[r.query + 1], GL_TIMESTAMP);
+			r.cpu_end_us = now();
+		}
+
+		// Scopes of the last frame that has been read back, in the order
+		// they started (so children follow their parent)
+		const std::vector<scope_result> & lastFrame() const { return m_last; }
+
+		const std::string & name(int i) const { return m_names[i]; }
+
+		// Rolling history of a scope, oldest first from historyOffset()
+		// Frames the scope didn't run in are 0
+		const std::vector<float> & cpuHistory(int name) const { return m_history[name].cpu_ms; }
+		const std::vector<float> & gpuHistory(int name) const { return m_history[name].gpu_ms; }
+		int historyOffset() const { return m_history_pos; }
+
+		// Records the next number of frames to write as a trace, or every
+		// frame until stopCapture() if frames is negative
+		void startCapture(int frames = -1) {
+			start();
+			m_trace.clear();
+			m_capture_frames = frames;
+			if (m_gpu_timing) {
+				// line up the GPU clock with ours (this one call waits for the GPU)
+				GLint64 gpu_ns = 0;
+				glGetInteger64v(GL_TIMESTAMP, &gpu_ns);
+				m_gpu_offset_us = now() - gpu_ns * 1e-3;
+			}
+		}
+
+		void stopCapture() { m_capture_frames = 0; }
+
+		bool capturing() const { return m_capture_frames != 0; }
+
+		bool hasCapture() const { return !m_trace.empty(); }
+
+		// Reads back all frames still in flight, waiting for the GPU
+		void finish() {
+			for (long long f = m_frame - frames_in_flight; f < m_frame; ++f) {
+				if (f < 0) continue;
+				frame_slot &slot = m_slots[f % frames_in_flight];
+				if (slot.pending) resolve(slot, true);
+			}
+		}
+
+		// Writes the captured frames in the Chrome trace event format, with
+		// CPU and GPU scopes as two threads
+		void writeChromeTrace(std::ostream &out) const {
+			out << "{\"traceEvents\":[" << std::endl;
+			out << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1,\"args\":{\"name\":\"CPU\"}}," << std::endl;
+			out << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":2,\"args\":{\"name\":\"GPU\"}}";
+			std::streamsize precision = out.precision();
+			out.precision(3);
+			out << std::fixed;
+			for (const trace_event &e : m_trace) {
+				out << "," << std::endl;
+				out << "{\"name\":\"" << m_names[e.name] << "\",\"cat\":\"" << (e.gpu ? "gpu" : "cpu")
+					<< "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << (e.gpu ? 2 : 1)
+					<< ",\"ts\":" << e.begin_us << ",\"dur\":" << (e.end_us - e.begin_us)
+					<< ",\"args\":{\"frame\":" << e.frame << "}}";
+			}
+			out << std::endl << "]}" << std::endl;
+			out.precision(precision);
+		}
+
+	private:
+		void start() {
+			if (m_started) return;
+			m_gpu_timing = GLEW_ARB_timer_query || GLEW_VERSION_3_3;
+			m_started = true;
+		}
+
+		double now() const {
+			return std::chrono::duration<double, std::micro>(clock::now() - m_epoch).count();
+		}
+
+		// names are compared by string so scopes can be named with literals
+		// or built strings, there are only ever a handful
+		int nameIndex(const char *name) {
+			for (size_t i = 0; i < m_names.size(); ++i) {
+				if (m_names[i] == name) return int(i);
+			}
+			m_names.push_back(name);
+			scope_history h;
+			h.cpu_ms.assign(history_length, 0.f);
+			h.gpu_ms.assign(history_length, 0.f);
+			m_history.push_back(h);
+			return int(m_names.size() - 1);
+		}
+
+		void resolve(frame_slot &slot, bool wait) {
+			slot.pending = false;
+
+			// queries finish in order, so if the last is ready they all are
+			bool gpu_ready = m_gpu_timing && slot.queries_used > 0;
+			if (gpu_ready && !wait) {
+				GLint available = 0;
+				glGetQueryObjectiv(slot.queries[slot.queries_used - 1], GL_QUERY_RESULT_AVAILABLE, &available);
+				gpu_ready = available != 0;
+			}
+
+			m_last.clear();
+			for (scope_history &h : m_history) {
+				h.cpu_ms[m_history_pos] = 0.f;
+				h.gpu_ms[m_history_pos] = 0.f;
+			}
+
+			bool capture = capturing();
+			for (const scope_record &r : slot.scopes) {
+				scope_result result;
+				result.name = r.name;
+				result.depth = r.depth;
+				result.cpu_ms = (r.cpu_end_us - r.cpu_begin_us) * 1e-3;
+				result.gpu_ms = std::numeric_limits<double>::quiet_NaN();
+
+				GLuint64 gpu_begin = 0, gpu_end = 0;
+				if (gpu_ready) {
+					glGetQueryObjectui64v(slot.queries[r.query], GL_QUERY_RESULT, &gpu_begin);
+					glGetQueryObjectui64v(slot.queries[r.query + 1], GL_QUERY_RESULT, &gpu_end);
+					result.gpu_ms = (gpu_end - gpu_begin) * 1e-6;
+				}
+				m_last.push_back(result);
+
+				// a scope can run more than once in a frame
+				m_history[r.name].cpu_ms[m_history_pos] += float(result.cpu_ms);
+				if (gpu_ready) m_history[r.name].gpu_ms[m_history_pos] += float(result.gpu_ms);
+
+				if (capture) {
+					m_trace.push_back({ r.name, slot.frame, false, r.cpu_begin_us, r.cpu_end_us });
+					if (gpu_ready) {
+						m_trace.push_back({ r.name, slot.frame, true, gpu_begin * 1e-3 + m_gpu_offset_us, gpu_end * 1e-3 + m_gpu_offset_us });
+					}
+				}
+			}
+
+			m_history_pos = (m_history_pos + 1) % history_length;
+			if (capture && m_capture_frames > 0) m_capture_frames--;
+		}
+	};
+
+
+	// Times everything from construction until it goes out of scope
+	class profile_scope {
+	private:
+		frame_profiler &m_profiler;
+
+	public:
+		profile_scope(frame_profiler &profiler, const char *name) : m_profiler(profiler) {
+			m_profiler.push(name);
+		}
+
+		profile_scope(const profile_scope &) = delete;
+		profile_scope & operator=(const profile_scope &) = delete;
+
+		~profile_scope() { m_profiler.pop(); }
+	};
+}
@@ -14,6 +14,10 @@
 
 #pragma once
 
+#include <algorithm>
+#include <cassert>
+#include <functional>
+#include <map>
 #include <string>
 #include <vector>
 #include <fstream>
@@ -111,7 +115,29 @@ namespace cgra {
 		return prog;
 	}
 
-	inline GLuint makeShaderProgramFromFile(const std::vector<GLenum> &stypes, const std::vector<std::string> &sourcefiles) {
+	// Adds a #define for each of defines to a shader source, after the
+	// #version line if there is one (it has to come first)
+	inline std::string addShaderDefines(const std::string &source, const std::vector<std::string> &defines) {
+		if (defines.empty()) return source;
+
+		size_t insert = 0;
+		if (source.compare(0, 8, "#version") == 0) {
+			insert = source.find('\n');
+			insert = insert == std::string::npos ? source.size() : insert + 1;
+		}
+
+		std::ostringstream oss;
+		oss << source.substr(0, insert);
+		if (insert > 0 && source[insert - 1] != '\n') oss << std::endl;
+		for (const std::string &d : defines) {
+			oss << "#define " << d << std::endl;
+		}
+		oss << source.substr(insert);
+		return oss.str();
+	}
+
+	// defines are added to every shader (see addShaderDefines)
+	inline GLuint makeShaderProgramFromFile(const std::vector<GLenum> &stypes, const std::vector<std::string> &sourcefiles, const std::vector<std::string> &defines = {}) {
 		std::vector<std::string> sources;
 		for (std::string filename : sourcefiles) {
 			std::ifstream fileStream(filename);
@@ -122,7 +148,7 @@ namespace cgra {
 
 			std::stringstream buffer;
 			buffer << fileStream.rdbuf();
-			sources.push_back(buffer.str());
+			sources.push_back(addShaderDefines(buffer.str(), defines));
 		}
 
 		return makeShaderProgram(stypes, sources);
@@ -174,4 +200,82 @@ namespace cgra {
 
 		return makeShaderProgram(profile, stypes, buffer.str());
 	}	
+
+
+	// A linked shader program with a table of its active uniforms.
+	// The table is built once from glGetActiveUniform, so looking up a location
+	// afterwards never calls into the driver, and it is searched by C string so
+	// looking up a literal doesn't build a std::string either.
+	// Uniforms set every frame should be resolved into slots with
+	// resolveSlots, after which location() is a plain array index.
+	class shader_program {
+	private:
+		GLuint m_prog = 0;
+		std::map<std::string, GLint, std::less<>> m_uniforms;
+		std::vector<GLint> m_slots;
+
+	public:
+		shader_program() { }
+
+		explicit shader_program(GLuint prog) : m_prog(prog) {
+			GLint count = 0, max_length = 0;
+			glGetProgramiv(prog, GL_ACTIVE_UNIFORMS, &count);
+			glGetProgramiv(prog, GL_ACTIVE_UNIFORM_MAX_LENGTH, &max_length);
+			std::vector<GLchar> buffer(std::max(max_length, 1));
+
+			for (GLint i = 0; i < count; ++i) {
+				GLsizei length = 0;
+				GLint size = 0;
+				GLenum type;
+				glGetActiveUniform(prog, i, GLsizei(buffer.size()), &length, &size, &type, &buffer[0]);
+				std::string name(&buffer[0], length);
+
+				// built-in uniforms (gl_ModelViewMatrix etc.) have no location
+				GLint location = glGetUniformLocation(prog, name.c_str());
+				if (location < 0) continue;
+
+				// arrays of basic types are reported once as "name[0]", so
+				// add the bare name and every element as well
+				size_t bracket = name.find('[');
+				if (size > 1 && bracket != std::string::npos && name.compare(bracket, std::string::npos, "[0]") == 0) {
+					std::string base = name.substr(0, bracket);
+					m_uniforms[base] = location;
+					for (GLint j = 0; j < size; ++j) {
+						std::string element = base + "[" + std::to_string(j) + "]";
+						m_uniforms[element] = glGetUniformLocation(prog, element.c_str());
+					}
+				} else {
+					m_uniforms[name] = location;
+				}
+			}
+		}
+
+		GLuint id() const { return m_prog; }
+
+		// Location of an active uniform, or -1 (ignored by glUniform*) if the
+		// uniform doesn't exist or was optimized out
+		GLint uniformLocation(const char *name) const {
+			auto it = m_uniforms.find(name);
+			return it == m_uniforms.end() ? -1 : it->second;
+		}
+
+		GLint uniformLocation(const std::string &name) const {
+			return uniformLocation(name.c_str());
+		}
+
+		// Looks up count names into slots 0 to count - 1, for the caller to
+		// index with an enum listing the same names in the same order
+		void resolveSlots(const char * const *names, size_t count) {
+			m_slots.resize(count);
+			for (size_t i = 0; i < count; ++i) m_slots[i] = uniformLocation(names[i]);
+		}
+
+		// Location of the uniform in a slot (see resolveSlots), or -1
+		GLint location(size_t slot) const {
+			assert(slot < m_slots.size());
+			return m_slots[slot];
+		}
+
+		size_t activeUniformCount() const { return m_uniforms.size(); }
+	};
 }
\ No newline at end of file